@@ -36,32 +36,141 @@ static const AMFObjectProperty AMFProp_Invalid = { {0, 0}, AMF_INVALID };
 static const AMFObject AMFObj_Invalid = { 0, 0 };
 static const AVal AV_empty = { 0, 0 };
 
-/* Data is Big-Endian */
+static int PropDecode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+		      int bDecodeName, AMFArena *arena);
+static int ObjDecode(AMFObject *obj, const char *pBuffer, int nSize,
+		     int bDecodeName, AMFArena *arena);
+static int ArrayDecode(AMFObject *obj, const char *pBuffer, int nSize,
+		       int nArrayLen, int bDecodeName, AMFArena *arena);
+
+/* AMF3 reference tables for one AMF3 context: a whole AMF3_Decode call,
+ * or one AMF_AVMPLUS value inside AMF0.
+ */
+typedef struct AMF3Refs
+{
+  AVal *r_strings;
+  int r_nstrings;
+  AMFObjectProperty *r_objects;	/* AMF_INVALID while still decoding */
+  int r_nobjects;
+  AMF3ClassDef *r_traits;
+  int r_ntraits;
+  int r_copied;			/* properties duplicated for references */
+} AMF3Refs;
+
+static int AMF3PropDecode(AMFObjectProperty *prop, const char *pBuffer,
+			  int nSize, int bDecodeName, AMFArena *arena,
+			  AMF3Refs *refs);
+static int AMF3ObjDecode(AMFObject *obj, const char *pBuffer, int nSize,
+			 int bAMFData, AMFArena *arena, AMF3Refs *refs);
+static void ObjAdd(AMFObject *obj, const AMFObjectProperty *prop,
+		   AMFArena *arena);
+static void ObjEnd(AMFObject *obj, int base, AMFArena *arena);
+
+/* Data is Big-Endian. The loads and stores go through memcpy, which
+ * compilers turn into single unaligned moves, and a byte swap on
+ * little endian hosts.
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define BSWAP16(x)	__builtin_bswap16(x)
+#define BSWAP32(x)	__builtin_bswap32(x)
+#define BSWAP64(x)	__builtin_bswap64(x)
+#elif defined(_MSC_VER)
+#define BSWAP16(x)	_byteswap_ushort(x)
+#define BSWAP32(x)	_byteswap_ulong(x)
+#define BSWAP64(x)	_byteswap_uint64(x)
+#else
+#define BSWAP16(x)	((uint16_t)(((x) >> 8) | ((x) << 8)))
+#define BSWAP32(x)	((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) | \
+			 (((x) >> 8) & 0xff00) | ((x) >> 24))
+#define BSWAP64(x)	(((uint64_t)BSWAP32((uint32_t)(x)) << 32) | \
+			 BSWAP32((uint32_t)((x) >> 32)))
+#endif
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define BE16(x)	(x)
+#define BE32(x)	(x)
+#define BE64(x)	(x)
+#else
+#define BE16(x)	BSWAP16(x)
+#define BE32(x)	BSWAP32(x)
+#define BE64(x)	BSWAP64(x)
+#endif
+
+/* Raw 8 byte big endian double, without the AMF0 type marker */
+static inline double
+NumberGet(const char *data)
+{
+  double dVal;
+#if __FLOAT_WORD_ORDER == __BYTE_ORDER
+  uint64_t v;
+  memcpy(&v, data, 8);
+  v = BE64(v);
+  memcpy(&dVal, &v, 8);
+#else
+  /* mixed endian doubles: swap the bytes within each 32 bit word */
+  uint32_t w[2];
+  memcpy(w, data, 8);
+  w[0] = BE32(w[0]);
+  w[1] = BE32(w[1]);
+#if __BYTE_ORDER == __LITTLE_ENDIAN	/* __FLOAT_WORD_ORDER == __BIG_ENDIAN */
+  memcpy(&dVal, w, 8);
+#else /* __BYTE_ORDER == __BIG_ENDIAN && __FLOAT_WORD_ORDER == __LITTLE_ENDIAN */
+  {
+    uint32_t t = w[0];
+    w[0] = w[1];
+    w[1] = t;
+    memcpy(&dVal, w, 8);
+  }
+#endif
+#endif
+  return dVal;
+}
+
+static inline void
+NumberPut(char *output, double dVal)
+{
+#if __FLOAT_WORD_ORDER == __BYTE_ORDER
+  uint64_t v;
+  memcpy(&v, &dVal, 8);
+  v = BE64(v);
+  memcpy(output, &v, 8);
+#else
+  uint32_t w[2];
+  memcpy(w, &dVal, 8);
+#if __BYTE_ORDER == __BIG_ENDIAN	/* __FLOAT_WORD_ORDER == __LITTLE_ENDIAN */
+  {
+    uint32_t t = w[0];
+    w[0] = w[1];
+    w[1] = t;
+  }
+#endif
+  w[0] = BE32(w[0]);
+  w[1] = BE32(w[1]);
+  memcpy(output, w, 8);
+#endif
+}
+
 unsigned short
 AMF_DecodeInt16(const char *data)
 {
-  unsigned char *c = (unsigned char *) data;
-  unsigned short val;
-  val = (c[0] << 8) | c[1];
-  return val;
+  uint16_t val;
+  memcpy(&val, data, 2);
+  return BE16(val);
 }
 
 unsigned int
 AMF_DecodeInt24(const char *data)
 {
   unsigned char *c = (unsigned char *) data;
-  unsigned int val;
-  val = (c[0] << 16) | (c[1] << 8) | c[2];
-  return val;
+  return (AMF_DecodeInt16(data) << 8) | c[2];
 }
 
 unsigned int
 AMF_DecodeInt32(const char *data)
 {
-  unsigned char *c = (unsigned char *)data;
-  unsigned int val;
-  val = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
-  return val;
+  uint32_t val;
+  memcpy(&val, data, 4);
+  return BE32(val);
 }
 
 void
@@ -81,51 +190,7 @@ AMF_DecodeLongString(const char *data, AVal *bv)
 double
 AMF_DecodeNumber(const char *data)
 {
-  double dVal;
-#if __FLOAT_WORD_ORDER == __BYTE_ORDER
-#if __BYTE_ORDER == __BIG_ENDIAN
-  memcpy(&dVal, data, 8);
-#elif __BYTE_ORDER == __LITTLE_ENDIAN
-  unsigned char *ci, *co;
-  ci = (unsigned char *)data;
-  co = (unsigned char *)&dVal;
-  co[0] = ci[7];
-  co[1] = ci[6];
-  co[2] = ci[5];
-  co[3] = ci[4];
-  co[4] = ci[3];
-  co[5] = ci[2];
-  co[6] = ci[1];
-  co[7] = ci[0];
-#endif
-#else
-#if __BYTE_ORDER == __LITTLE_ENDIAN	/* __FLOAT_WORD_ORER == __BIG_ENDIAN */
-  unsigned char *ci, *co;
-  ci = (unsigned char *)data;
-  co = (unsigned char *)&dVal;
-  co[0] = ci[3];
-  co[1] = ci[2];
-  co[2] = ci[1];
-  co[3] = ci[0];
-  co[4] = ci[7];
-  co[5] = ci[6];
-  co[6] = ci[5];
-  co[7] = ci[4];
-#else /* __BYTE_ORDER == __BIG_ENDIAN && __FLOAT_WORD_ORER == __LITTLE_ENDIAN */
-  unsigned char *ci, *co;
-  ci = (unsigned char *)data;
-  co = (unsigned char *)&dVal;
-  co[0] = ci[4];
-  co[1] = ci[5];
-  co[2] = ci[6];
-  co[3] = ci[7];
-  co[4] = ci[0];
-  co[5] = ci[1];
-  co[6] = ci[2];
-  co[7] = ci[3];
-#endif
-#endif
-  return dVal;
+  return NumberGet(data);
 }
 
 int
@@ -137,11 +202,12 @@ AMF_DecodeBoolean(const char *data)
 char *
 AMF_EncodeInt16(char *output, char *outend, short nVal)
 {
+  uint16_t val = BE16((uint16_t)nVal);
+
   if (output+2 > outend)
     return NULL;
 
-  output[1] = nVal & 0xff;
-  output[0] = nVal >> 8;
+  memcpy(output, &val, 2);
   return output+2;
 }
 
@@ -160,13 +226,12 @@ AMF_EncodeInt24(char *output, char *outend, int nVal)
 char *
 AMF_EncodeInt32(char *output, char *outend, int nVal)
 {
+  uint32_t val = BE32((uint32_t)nVal);
+
   if (output+4 > outend)
     return NULL;
 
-  output[3] = nVal & 0xff;
-  output[2] = nVal >> 8;
-  output[1] = nVal >> 16;
-  output[0] = nVal >> 24;
+  memcpy(output, &val, 4);
   return output+4;
 }
 
@@ -202,57 +267,7 @@ AMF_EncodeNumber(char *output, char *outend, double dVal)
     return NULL;
 
   *output++ = AMF_NUMBER;	/* type: Number */
-
-#if __FLOAT_WORD_ORDER == __BYTE_ORDER
-#if __BYTE_ORDER == __BIG_ENDIAN
-  memcpy(output, &dVal, 8);
-#elif __BYTE_ORDER == __LITTLE_ENDIAN
-  {
-    unsigned char *ci, *co;
-    ci = (unsigned char *)&dVal;
-    co = (unsigned char *)output;
-    co[0] = ci[7];
-    co[1] = ci[6];
-    co[2] = ci[5];
-    co[3] = ci[4];
-    co[4] = ci[3];
-    co[5] = ci[2];
-    co[6] = ci[1];
-    co[7] = ci[0];
-  }
-#endif
-#else
-#if __BYTE_ORDER == __LITTLE_ENDIAN	/* __FLOAT_WORD_ORER == __BIG_ENDIAN */
-  {
-    unsigned char *ci, *co;
-    ci = (unsigned char *)&dVal;
-    co = (unsigned char *)output;
-    co[0] = ci[3];
-    co[1] = ci[2];
-    co[2] = ci[1];
-    co[3] = ci[0];
-    co[4] = ci[7];
-    co[5] = ci[6];
-    co[6] = ci[5];
-    co[7] = ci[4];
-  }
-#else /* __BYTE_ORDER == __BIG_ENDIAN && __FLOAT_WORD_ORER == __LITTLE_ENDIAN */
-  {
-    unsigned char *ci, *co;
-    ci = (unsigned char *)&dVal;
-    co = (unsigned char *)output;
-    co[0] = ci[4];
-    co[1] = ci[5];
-    co[2] = ci[6];
-    co[3] = ci[7];
-    co[4] = ci[0];
-    co[5] = ci[1];
-    co[6] = ci[2];
-    co[7] = ci[3];
-  }
-#endif
-#endif
-
+  NumberPut(output, dVal);
   return output+8;
 }
 
@@ -494,15 +509,266 @@ AMF3ReadString(const char *data, AVal *str)
   return len;
 }
 
+/* Bounds-checked U29 read; returns the bytes used or -1 */
+static int
+AMF3ReadU29(const char *data, int nSize, uint32_t *valp)
+{
+  const unsigned char *c = (const unsigned char *)data;
+  uint32_t val = 0;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      if (i >= nSize)
+	return -1;
+      val = (val << 7) | (c[i] & 0x7f);
+      if (!(c[i] & 0x80))
+	{
+	  *valp = val;
+	  return i + 1;
+	}
+    }
+  if (nSize < 4)
+    return -1;
+  *valp = (val << 8) | c[3];
+  return 4;
+}
+
+/* Tables start at 16 entries and double, like AMF_AddProp */
+static int
+RefsGrow(void *tabp, int num, size_t size)
+{
+  void **tab = tabp, *t;
+
+  if (num && (num < 16 || (num & (num - 1))))
+    return TRUE;
+  t = realloc(*tab, (num ? num * 2 : 16) * size);
+  if (!t)
+    return FALSE;
+  *tab = t;
+  return TRUE;
+}
+
+static void
+AMF3RefsFree(AMF3Refs *refs)
+{
+  int i;
+  for (i = 0; i < refs->r_ntraits; i++)
+    free(refs->r_traits[i].cd_props);
+  free(refs->r_traits);
+  free(refs->r_objects);
+  free(refs->r_strings);
+}
+
+/* Claim the next object table slot; complex values fill it in once
+ * decoded so that references to them from inside stay detectable.
+ */
+static int
+RefReserve(AMF3Refs *refs)
+{
+  if (!RefsGrow(&refs->r_objects, refs->r_nobjects, sizeof(AMFObjectProperty)))
+    return -1;
+  refs->r_objects[refs->r_nobjects].p_type = AMF_INVALID;
+  return refs->r_nobjects++;
+}
+
+static void
+RefSet(AMF3Refs *refs, int slot, const AMFObjectProperty *prop)
+{
+  if (slot < 0)
+    return;
+  refs->r_objects[slot] = *prop;
+  refs->r_objects[slot].p_name = AV_empty;
+}
+
+#define AMF3_MAXCOPY	65536	/* limit on properties duplicated by references */
+
+static int
+ObjCopy(AMFObject *dst, const AMFObject *src, AMFArena *arena, AMF3Refs *refs)
+{
+  int i, base = arena ? arena->a_top : 0;
+
+  dst->o_num = 0;
+  dst->o_props = NULL;
+  refs->r_copied += src->o_num;
+  if (refs->r_copied > AMF3_MAXCOPY)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, too many AMF3 object references",
+	  __FUNCTION__);
+      return FALSE;
+    }
+  for (i = 0; i < src->o_num; i++)
+    {
+      AMFObjectProperty prop = src->o_props[i];
+      if (prop.p_type == AMF_OBJECT || prop.p_type == AMF_ECMA_ARRAY ||
+	  prop.p_type == AMF_STRICT_ARRAY)
+	{
+	  if (!ObjCopy(&prop.p_vu.p_object, &src->o_props[i].p_vu.p_object,
+		       arena, refs))
+	    {
+	      ObjEnd(dst, base, arena);
+	      if (!arena)
+		AMF_Reset(dst);
+	      return FALSE;
+	    }
+	}
+      ObjAdd(dst, &prop, arena);
+    }
+  ObjEnd(dst, base, arena);
+  return TRUE;
+}
+
+/* Resolve an object table reference into prop, keeping its name. Every
+ * reference gets its own copy since decoded objects own their members;
+ * a reference to an object still being decoded (a cycle) is returned
+ * as AMF_REFERENCE with the table index.
+ */
+static int
+RefGet(AMF3Refs *refs, uint32_t idx, AMFObjectProperty *prop, AMFArena *arena)
+{
+  AMFObjectProperty *ref;
+
+  if (idx >= (uint32_t)refs->r_nobjects)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s, AMF3 object reference %u out of range",
+	  __FUNCTION__, idx);
+      return FALSE;
+    }
+  ref = &refs->r_objects[idx];
+  if (ref->p_type == AMF_INVALID)
+    {
+      prop->p_type = AMF_REFERENCE;
+      prop->p_vu.p_number = idx;
+      return TRUE;
+    }
+  prop->p_type = ref->p_type;
+  prop->p_UTCoffset = ref->p_UTCoffset;
+  if (ref->p_type == AMF_OBJECT || ref->p_type == AMF_ECMA_ARRAY ||
+      ref->p_type == AMF_STRICT_ARRAY)
+    return ObjCopy(&prop->p_vu.p_object, &ref->p_vu.p_object, arena, refs);
+  prop->p_vu = ref->p_vu;
+  return TRUE;
+}
+
+static int
+ReadString3(AMF3Refs *refs, const char *data, int nSize, AVal *str)
+{
+  uint32_t ref;
+  int len = AMF3ReadU29(data, nSize, &ref);
+
+  if (len < 0)
+    return -1;
+  if (!(ref & 1))
+    {
+      ref >>= 1;
+      if (ref >= (uint32_t)refs->r_nstrings)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, AMF3 string reference %u out of range",
+	      __FUNCTION__, ref);
+	  return -1;
+	}
+      *str = refs->r_strings[ref];
+      return len;
+    }
+  ref >>= 1;
+  if (ref > (uint32_t)(nSize - len))
+    return -1;
+  str->av_len = ref;
+  str->av_val = ref ? (char *)data + len : NULL;
+  /* the empty string is never sent by reference */
+  if (ref)
+    {
+      if (!RefsGrow(&refs->r_strings, refs->r_nstrings, sizeof(AVal)))
+	return -1;
+      refs->r_strings[refs->r_nstrings++] = *str;
+    }
+  return len + ref;
+}
+
 int
 AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 		int bDecodeName)
+{
+  AMF3Refs refs = { 0 };
+  int nRes = AMF3PropDecode(prop, pBuffer, nSize, bDecodeName, NULL, &refs);
+  AMF3RefsFree(&refs);
+  return nRes;
+}
+
+static int
+AMF3ArrayDecode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+		AMFArena *arena, AMF3Refs *refs)
+{
+  int nOriginalSize = nSize;
+  AMFObject *obj = &prop->p_vu.p_object;
+  int base = arena ? arena->a_top : 0;
+  int slot, len, nRes;
+  uint32_t count;
+  AMFObjectProperty item;
+  AVal key;
+
+  obj->o_num = 0;
+  obj->o_props = NULL;
+  prop->p_type = AMF_STRICT_ARRAY;
+  if ((len = AMF3ReadU29(pBuffer, nSize, &count)) < 0)
+    return -1;
+  pBuffer += len;
+  nSize -= len;
+  count >>= 1;
+  if (count > (uint32_t)nSize)
+    return -1;
+  slot = RefReserve(refs);
+
+  /* associative part, then the dense items */
+  for (;;)
+    {
+      if ((len = ReadString3(refs, pBuffer, nSize, &key)) < 0)
+	goto fail;
+      pBuffer += len;
+      nSize -= len;
+      if (!key.av_len)
+	break;
+      if ((nRes = AMF3PropDecode(&item, pBuffer, nSize, FALSE, arena,
+				 refs)) < 0)
+	goto fail;
+      item.p_name = key;
+      ObjAdd(obj, &item, arena);
+      pBuffer += nRes;
+      nSize -= nRes;
+      prop->p_type = AMF_ECMA_ARRAY;
+    }
+  while (count--)
+    {
+      if ((nRes = AMF3PropDecode(&item, pBuffer, nSize, FALSE, arena,
+				 refs)) < 0)
+	goto fail;
+      ObjAdd(obj, &item, arena);
+      pBuffer += nRes;
+      nSize -= nRes;
+    }
+  ObjEnd(obj, base, arena);
+  RefSet(refs, slot, prop);
+  return nOriginalSize - nSize;
+
+fail:
+  ObjEnd(obj, base, arena);
+  if (!arena)
+    AMF_Reset(obj);
+  return -1;
+}
+
+static int
+AMF3PropDecode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+	       int bDecodeName, AMFArena *arena, AMF3Refs *refs)
 {
   int nOriginalSize = nSize;
   AMF3DataType type;
+  uint32_t u;
+  int len;
 
   prop->p_name.av_len = 0;
   prop->p_name.av_val = NULL;
+  prop->p_type = AMF_INVALID;
 
   if (nSize == 0 || !pBuffer)
     {
@@ -514,8 +780,10 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
   if (bDecodeName)
     {
       AVal name;
-      int nRes = AMF3ReadString(pBuffer, &name);
+      int nRes = ReadString3(refs, pBuffer, nSize, &name);
 
+      if (nRes < 0)
+	return -1;
       if (name.av_len <= 0)
 	return nRes;
 
@@ -530,6 +798,19 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
   type = *pBuffer++;
   nSize--;
 
+  /* everything from XMLDocument on may be a reference instead */
+  if (type >= AMF3_XML_DOC && type <= AMF3_BYTE_ARRAY)
+    {
+      if ((len = AMF3ReadU29(pBuffer, nSize, &u)) < 0)
+	return -1;
+      if (!(u & 1))
+	{
+	  if (!RefGet(refs, u >> 1, prop, arena))
+	    return -1;
+	  return nOriginalSize - nSize + len;
+	}
+    }
+
   switch (type)
     {
     case AMF3_UNDEFINED:
@@ -545,14 +826,14 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       prop->p_vu.p_number = 1.0;
       break;
     case AMF3_INTEGER:
-      {
-	int32_t res = 0;
-	int len = AMF3ReadInteger(pBuffer, &res);
-	prop->p_vu.p_number = (double)res;
-	prop->p_type = AMF_NUMBER;
-	nSize -= len;
-	break;
-      }
+      if ((len = AMF3ReadU29(pBuffer, nSize, &u)) < 0)
+	return -1;
+      /* sign extend from 29 bits */
+      prop->p_vu.p_number = (u & 0x10000000) ? (int32_t)u - (1 << 29) :
+	(int32_t)u;
+      prop->p_type = AMF_NUMBER;
+      nSize -= len;
+      break;
     case AMF3_DOUBLE:
       if (nSize < 8)
 	return -1;
@@ -561,52 +842,52 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       nSize -= 8;
       break;
     case AMF3_STRING:
+      if ((len = ReadString3(refs, pBuffer, nSize, &prop->p_vu.p_aval)) < 0)
+	return -1;
+      prop->p_type = AMF_STRING;
+      nSize -= len;
+      break;
     case AMF3_XML_DOC:
     case AMF3_XML:
-      {
-	int len = AMF3ReadString(pBuffer, &prop->p_vu.p_aval);
-	prop->p_type = AMF_STRING;
-	nSize -= len;
-	break;
-      }
+    case AMF3_BYTE_ARRAY:
+      u >>= 1;
+      if (u > (uint32_t)(nSize - len))
+	return -1;
+      prop->p_vu.p_aval.av_val = (char *)pBuffer + len;
+      prop->p_vu.p_aval.av_len = u;
+      prop->p_type = type == AMF3_BYTE_ARRAY ? AMF_UNSUPPORTED : AMF_STRING;
+      RefSet(refs, RefReserve(refs), prop);
+      nSize -= len + u;
+      break;
     case AMF3_DATE:
+      if (nSize < len + 8)
+	return -1;
+      prop->p_vu.p_number = AMF_DecodeNumber(pBuffer + len);
+      prop->p_type = AMF_NUMBER;
+      RefSet(refs, RefReserve(refs), prop);
+      nSize -= len + 8;
+      break;
+    case AMF3_ARRAY:
       {
-	int32_t res = 0;
-	int len = AMF3ReadInteger(pBuffer, &res);
-
-	nSize -= len;
-	pBuffer += len;
-
-	if ((res & 0x1) == 0)
-	  {			/* reference */
-	    uint32_t nIndex = (res >> 1);
-	    RTMP_Log(RTMP_LOGDEBUG, "AMF3_DATE reference: %d, not supported!", nIndex);
-	  }
-	else
-	  {
-	    if (nSize < 8)
-	      return -1;
-
-	    prop->p_vu.p_number = AMF_DecodeNumber(pBuffer);
-	    nSize -= 8;
-	    prop->p_type = AMF_NUMBER;
-	  }
+	int nRes = AMF3ArrayDecode(prop, pBuffer, nSize, arena, refs);
+	if (nRes == -1)
+	  return -1;
+	nSize -= nRes;
 	break;
       }
     case AMF3_OBJECT:
       {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+	int nRes = AMF3ObjDecode(&prop->p_vu.p_object, pBuffer, nSize, FALSE,
+				 arena, refs);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
 	prop->p_type = AMF_OBJECT;
 	break;
       }
-    case AMF3_ARRAY:
-    case AMF3_BYTE_ARRAY:
     default:
       RTMP_Log(RTMP_LOGDEBUG, "%s - AMF3 unknown/unsupported datatype 0x%02x, @%p",
-	  __FUNCTION__, (unsigned char)(*pBuffer), pBuffer);
+	  __FUNCTION__, (unsigned char)type, pBuffer - 1);
       return -1;
     }
   if (nSize < 0)
@@ -618,6 +899,13 @@ AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 int
 AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	       int bDecodeName)
+{
+  return PropDecode(prop, pBuffer, nSize, bDecodeName, NULL);
+}
+
+static int
+PropDecode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
+	   int bDecodeName, AMFArena *arena)
 {
   int nOriginalSize = nSize;
   int nRes;
@@ -689,7 +977,7 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       }
     case AMF_OBJECT:
       {
-	int nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+	int nRes = ObjDecode(&prop->p_vu.p_object, pBuffer, nSize, TRUE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -717,7 +1005,7 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	nSize -= 4;
 
 	/* next comes the rest, mixed array has a final 0x000009 mark and names, so its an object */
-	nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE);
+	nRes = ObjDecode(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -733,8 +1021,8 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
 	unsigned int nArrayLen = AMF_DecodeInt32(pBuffer);
 	nSize -= 4;
 
-	nRes = AMF_DecodeArray(&prop->p_vu.p_object, pBuffer + 4, nSize,
-				   nArrayLen, FALSE);
+	nRes = ArrayDecode(&prop->p_vu.p_object, pBuffer + 4, nSize,
+			   nArrayLen, FALSE, arena);
 	if (nRes == -1)
 	  return -1;
 	nSize -= nRes;
@@ -779,11 +1067,16 @@ AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize,
       }
     case AMF_AVMPLUS:
       {
-	int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+	/* each switch to AMF3 starts with empty reference tables */
+	AMF3Refs refs = { 0 };
+	AVal name = prop->p_name;
+
+	nRes = AMF3PropDecode(prop, pBuffer, nSize, FALSE, arena, &refs);
+	AMF3RefsFree(&refs);
 	if (nRes == -1)
 	  return -1;
+	prop->p_name = name;
 	nSize -= nRes;
-	prop->p_type = AMF_OBJECT;
 	break;
       }
     default:
@@ -802,6 +1095,9 @@ AMFProp_Dump(AMFObjectProperty *prop)
   char str[256];
   AVal name;
 
+  if (!RTMP_LogEnabled(RTMP_LOGDEBUG))
+    return;
+
   if (prop->p_type == AMF_INVALID)
     {
       RTMP_Log(RTMP_LOGDEBUG, "Property: INVALID");
@@ -864,6 +1160,12 @@ AMFProp_Dump(AMFObjectProperty *prop)
       snprintf(str, 255, "DATE:\ttimestamp: %.2f, UTC offset: %d",
 	       prop->p_vu.p_number, prop->p_UTCoffset);
       break;
+    case AMF_REFERENCE:
+      snprintf(str, 255, "REFERENCE:\t%d", (int)prop->p_vu.p_number);
+      break;
+    case AMF_UNSUPPORTED:
+      snprintf(str, 255, "BYTEARRAY:\t%d bytes", prop->p_vu.p_aval.av_len);
+      break;
     default:
       snprintf(str, 255, "INVALID TYPE 0x%02x", (unsigned char)prop->p_type);
     }
@@ -990,197 +1292,434 @@ AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd)
   return pBuffer;
 }
 
+/* Strict array of numbers straight from a double[], such as keyframe
+ * times or file positions. The whole array is bounds checked once.
+ */
+char *
+AMF_EncodeNumberArray(char *output, char *outend, const double *vals,
+		      int nVals)
+{
+  int i;
+
+  if (nVals < 0 || outend - output < 5 || (outend - output - 5) / 9 < nVals)
+    return NULL;
+
+  *output++ = AMF_STRICT_ARRAY;
+  output = AMF_EncodeInt32(output, outend, nVals);
+  for (i = 0; i < nVals; i++)
+    {
+      output[0] = AMF_NUMBER;
+      NumberPut(output + 1, vals[i]);
+      output += 9;
+    }
+  return output;
+}
+
+char *
+AMF_EncodeNamedNumberArray(char *output, char *outend, const AVal *strName,
+			   const double *vals, int nVals)
+{
+  if (output+2+strName->av_len > outend)
+    return NULL;
+  output = AMF_EncodeInt16(output, outend, strName->av_len);
+
+  memcpy(output, strName->av_val, strName->av_len);
+  output += strName->av_len;
+
+  return AMF_EncodeNumberArray(output, outend, vals, nVals);
+}
+
 int
-AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
-		int nArrayLen, int bDecodeName)
+AMF_DecodeNumberArray(const char *pBuffer, int nSize, double *vals,
+		      int nMax, int *nVals)
 {
-  int nOriginalSize = nSize;
-  int bError = FALSE;
+  const char *p = pBuffer;
+  int i, n, len;
 
-  obj->o_num = 0;
-  obj->o_props = NULL;
-  while (nArrayLen > 0)
+  if (nSize < 5)
+    return -1;
+  if (*p == AMF_STRICT_ARRAY)
     {
-      AMFObjectProperty prop;
-      int nRes;
-      nArrayLen--;
+      n = AMF_DecodeInt32(p + 1);
+      if (n < 0 || (vals && n > nMax) || (nSize - 5) / 9 < n)
+	return -1;
 
-      if (nSize <= 0)
-	{
-	  bError = TRUE;
-	  break;
-	}
-      nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
-      if (nRes == -1)
-	{
-	  bError = TRUE;
-	  break;
-	}
-      else
+      p += 5;
+      for (i = 0; i < n; i++)
 	{
-	  nSize -= nRes;
-	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  if (p[0] != AMF_NUMBER)
+	    return -1;
+	  if (vals)
+	    vals[i] = NumberGet(p + 1);
+	  p += 9;
 	}
+      *nVals = n;
+      return p - pBuffer;
     }
-  if (bError)
+  if (*p != AMF_ECMA_ARRAY)
     return -1;
 
-  return nOriginalSize - nSize;
+  /* like AMF_Decode, ignore the count and run to the end marker */
+  p += 5;
+  nSize -= 5;
+  for (n = 0;; n++)
+    {
+      if (nSize >= 3 && AMF_DecodeInt24(p) == AMF_OBJECT_END)
+	break;
+      if (nSize < 2 || (len = AMF_DecodeInt16(p)) > nSize - 2 - 9)
+	return -1;
+      p += 2 + len;
+      if (p[0] != AMF_NUMBER || (vals && n >= nMax))
+	return -1;
+      if (vals)
+	vals[n] = NumberGet(p + 1);
+      p += 9;
+      nSize -= 2 + len + 9;
+    }
+  *nVals = n;
+  return p + 3 - pBuffer;
 }
 
-int
-AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData)
+/* AMFArena */
+
+struct AMFArenaBlock
 {
-  int nOriginalSize = nSize;
-  int32_t ref;
-  int len;
+  struct AMFArenaBlock *b_next;
+  int b_size;
+  int b_used;
+  AMFObjectProperty b_props[1];
+};
 
-  obj->o_num = 0;
-  obj->o_props = NULL;
-  if (bAMFData)
+#define ARENA_MIN	64
+
+void
+AMFArena_Init(AMFArena *arena)
+{
+  memset(arena, 0, sizeof(AMFArena));
+}
+
+/* Keeps the newest (largest) block, so decoding messages of a similar
+ * size in a loop stops allocating after the first one.
+ */
+void
+AMFArena_Reset(AMFArena *arena)
+{
+  AMFArenaBlock *b, *next;
+
+  if (!arena->a_blocks)
+    return;
+  for (b = arena->a_blocks->b_next; b; b = next)
     {
-      if (*pBuffer != AMF3_OBJECT)
-	RTMP_Log(RTMP_LOGERROR,
-	    "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
-      pBuffer++;
-      nSize--;
+      next = b->b_next;
+      free(b);
     }
+  arena->a_blocks->b_next = NULL;
+  arena->a_blocks->b_used = 0;
+  arena->a_top = 0;
+}
 
-  ref = 0;
-  len = AMF3ReadInteger(pBuffer, &ref);
-  pBuffer += len;
-  nSize -= len;
+void
+AMFArena_Free(AMFArena *arena)
+{
+  AMFArena_Reset(arena);
+  free(arena->a_blocks);
+  free(arena->a_stack);
+  AMFArena_Init(arena);
+}
 
-  if ((ref & 1) == 0)
-    {				/* object reference, 0xxx */
-      uint32_t objectIndex = (ref >> 1);
+static AMFObjectProperty *
+ArenaAlloc(AMFArena *arena, int n)
+{
+  AMFArenaBlock *b = arena->a_blocks;
+  AMFObjectProperty *ret;
 
-      RTMP_Log(RTMP_LOGDEBUG, "Object reference, index: %d", objectIndex);
+  if (!n)
+    return NULL;
+  if (!b || b->b_size - b->b_used < n)
+    {
+      int size = b ? b->b_size * 2 : ARENA_MIN;
+      if (size < n)
+	size = n;
+      b = malloc(sizeof(AMFArenaBlock) + (size - 1) * sizeof(AMFObjectProperty));
+      if (!b)
+	return NULL;
+      b->b_size = size;
+      b->b_used = 0;
+      b->b_next = arena->a_blocks;
+      arena->a_blocks = b;
     }
-  else				/* object instance */
+  ret = &b->b_props[b->b_used];
+  b->b_used += n;
+  return ret;
+}
+
+/* With an arena, the properties of every object still being decoded
+ * are stacked in a_stack, children above their parent, and an object's
+ * slice is copied into the arena once its length is known.
+ */
+static void
+ObjAdd(AMFObject *obj, const AMFObjectProperty *prop, AMFArena *arena)
+{
+  if (!arena)
     {
-      int32_t classRef = (ref >> 1);
+      AMF_AddProp(obj, prop);
+      return;
+    }
+  if (arena->a_top == arena->a_max)
+    {
+      int max = arena->a_max ? arena->a_max * 2 : ARENA_MIN;
+      AMFObjectProperty *stack = realloc(arena->a_stack,
+					 max * sizeof(AMFObjectProperty));
+      if (!stack)
+	return;
+      arena->a_stack = stack;
+      arena->a_max = max;
+    }
+  arena->a_stack[arena->a_top++] = *prop;
+  obj->o_num++;
+}
+
+static void
+ObjEnd(AMFObject *obj, int base, AMFArena *arena)
+{
+  if (!arena)
+    return;
+  obj->o_num = arena->a_top - base;
+  obj->o_props = ArenaAlloc(arena, obj->o_num);
+  if (obj->o_props)
+    memcpy(obj->o_props, arena->a_stack + base,
+	   obj->o_num * sizeof(AMFObjectProperty));
+  else
+    obj->o_num = 0;
+  arena->a_top = base;
+}
+
+int
+AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize,
+		int nArrayLen, int bDecodeName)
+{
+  return ArrayDecode(obj, pBuffer, nSize, nArrayLen, bDecodeName, NULL);
+}
 
-      AMF3ClassDef cd = { {0, 0}
-      };
+static int
+ArrayDecode(AMFObject *obj, const char *pBuffer, int nSize,
+	    int nArrayLen, int bDecodeName, AMFArena *arena)
+{
+  int nOriginalSize = nSize;
+  int bError = FALSE;
+  int base = arena ? arena->a_top : 0;
+
+  obj->o_num = 0;
+  obj->o_props = NULL;
+  while (nArrayLen > 0)
+    {
       AMFObjectProperty prop;
+      int nRes;
+      nArrayLen--;
 
-      if ((classRef & 0x1) == 0)
-	{			/* class reference */
-	  uint32_t classIndex = (classRef >> 1);
-	  RTMP_Log(RTMP_LOGDEBUG, "Class reference: %d", classIndex);
+      if (nSize <= 0)
+	{
+	  bError = TRUE;
+	  break;
+	}
+      nRes = PropDecode(&prop, pBuffer, nSize, bDecodeName, arena);
+      if (nRes == -1)
+	{
+	  bError = TRUE;
+	  break;
 	}
       else
 	{
-	  int32_t classExtRef = (classRef >> 1);
-	  int i, cdnum;
+	  nSize -= nRes;
+	  pBuffer += nRes;
+	  ObjAdd(obj, &prop, arena);
+	}
+    }
+  ObjEnd(obj, base, arena);
+  if (bError)
+    return -1;
 
-	  cd.cd_externalizable = (classExtRef & 0x1) == 1;
-	  cd.cd_dynamic = ((classExtRef >> 1) & 0x1) == 1;
+  return nOriginalSize - nSize;
+}
 
-	  cdnum = classExtRef >> 2;
+int
+AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData)
+{
+  AMF3Refs refs = { 0 };
+  int nRes = AMF3ObjDecode(obj, pBuffer, nSize, bAMFData, NULL, &refs);
+  AMF3RefsFree(&refs);
+  return nRes;
+}
 
-	  /* class name */
+static int
+AMF3ObjDecode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData,
+	      AMFArena *arena, AMF3Refs *refs)
+{
+  int nOriginalSize = nSize;
+  uint32_t ref;
+  int len, slot, nRes, i;
+  int base = arena ? arena->a_top : 0;
+  AMF3ClassDef cd = { {0, 0} };
+  AMFObjectProperty prop;
 
-	  len = AMF3ReadString(pBuffer, &cd.cd_name);
-	  nSize -= len;
-	  pBuffer += len;
+  obj->o_num = 0;
+  obj->o_props = NULL;
+  if (bAMFData)
+    {
+      if (*pBuffer != AMF3_OBJECT)
+	RTMP_Log(RTMP_LOGERROR,
+	    "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
+      pBuffer++;
+      nSize--;
+    }
 
-	  /*std::string str = className; */
+  if ((len = AMF3ReadU29(pBuffer, nSize, &ref)) < 0)
+    return -1;
+  pBuffer += len;
+  nSize -= len;
 
-	  RTMP_Log(RTMP_LOGDEBUG,
-	      "Class name: %s, externalizable: %d, dynamic: %d, classMembers: %d",
-	      cd.cd_name.av_val, cd.cd_externalizable, cd.cd_dynamic,
-	      cd.cd_num);
+  if ((ref & 1) == 0)
+    {				/* object reference, 0xxx */
+      if (!RefGet(refs, ref >> 1, &prop, arena))
+	return -1;
+      if (prop.p_type == AMF_OBJECT)
+	*obj = prop.p_vu.p_object;
+      else if (prop.p_type == AMF_ECMA_ARRAY || prop.p_type == AMF_STRICT_ARRAY)
+	AMFProp_Reset(&prop);
+      return nOriginalSize - nSize;
+    }
 
-	  for (i = 0; i < cdnum; i++)
-	    {
-	      AVal memberName;
-	      if (nSize <=0)
-		{
-invalid:
-		  RTMP_Log(RTMP_LOGDEBUG, "%s, invalid class encoding!",
-		    __FUNCTION__);
-		  return nOriginalSize;
-		}
-	      len = AMF3ReadString(pBuffer, &memberName);
-	      RTMP_Log(RTMP_LOGDEBUG, "Member: %s", memberName.av_val);
-	      AMF3CD_AddProp(&cd, &memberName);
-	      nSize -= len;
-	      pBuffer += len;
-	    }
+  slot = RefReserve(refs);
+  if ((ref & 2) == 0)
+    {				/* traits reference */
+      uint32_t classIndex = ref >> 2;
+      if (classIndex >= (uint32_t)refs->r_ntraits)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, AMF3 traits reference %u out of range",
+	      __FUNCTION__, classIndex);
+	  return -1;
 	}
+      cd = refs->r_traits[classIndex];
+    }
+  else
+    {
+      uint32_t cdnum = ref >> 4;
+      AVal memberName;
 
-      /* add as referencable object */
-
-      if (cd.cd_externalizable)
-	{
-	  int nRes;
-	  AVal name = AVC("DEFAULT_ATTRIBUTE");
+      cd.cd_externalizable = (ref & 4) != 0;
+      cd.cd_dynamic = (ref & 8) != 0;
 
-	  RTMP_Log(RTMP_LOGDEBUG, "Externalizable, TODO check");
+      if ((len = ReadString3(refs, pBuffer, nSize, &cd.cd_name)) < 0)
+	return -1;
+      nSize -= len;
+      pBuffer += len;
 
-	  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-	  if (nRes == -1)
-	    RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!",
-		__FUNCTION__);
-	  else
+      if (cdnum > (uint32_t)nSize)
+	return -1;
+      for (i = 0; i < (int)cdnum; i++)
+	{
+	  if ((len = ReadString3(refs, pBuffer, nSize, &memberName)) < 0)
 	    {
-	      nSize -= nRes;
-	      pBuffer += nRes;
+	      free(cd.cd_props);
+	      return -1;
 	    }
-
-	  AMFProp_SetName(&prop, &name);
-	  AMF_AddProp(obj, &prop);
+	  AMF3CD_AddProp(&cd, &memberName);
+	  nSize -= len;
+	  pBuffer += len;
 	}
-      else
+      if (!RefsGrow(&refs->r_traits, refs->r_ntraits, sizeof(AMF3ClassDef)))
 	{
-	  int nRes, i;
-	  for (i = 0; i < cd.cd_num; i++)	/* non-dynamic */
-	    {
-	      if (nSize <=0)
-	        goto invalid;
-	      nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-	      if (nRes == -1)
-		RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!",
-		    __FUNCTION__);
-
-	      AMFProp_SetName(&prop, AMF3CD_GetProp(&cd, i));
-	      AMF_AddProp(obj, &prop);
-
-	      pBuffer += nRes;
-	      nSize -= nRes;
-	    }
-	  if (cd.cd_dynamic)
-	    {
-	      int len = 0;
+	  free(cd.cd_props);
+	  return -1;
+	}
+      refs->r_traits[refs->r_ntraits++] = cd;
+    }
 
-	      do
-		{
-		  if (nSize <=0)
-		    goto invalid;
-		  nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, TRUE);
-		  AMF_AddProp(obj, &prop);
+  RTMP_Log(RTMP_LOGDEBUG,
+      "Class name: %.*s, externalizable: %d, dynamic: %d, classMembers: %d",
+      cd.cd_name.av_len, cd.cd_name.av_val, cd.cd_externalizable,
+      cd.cd_dynamic, cd.cd_num);
 
-		  pBuffer += nRes;
-		  nSize -= nRes;
+  if (cd.cd_externalizable)
+    {
+      AVal name = AVC("DEFAULT_ATTRIBUTE");
 
-		  len = prop.p_name.av_len;
-		}
-	      while (len > 0);
-	    }
+      nRes = AMF3PropDecode(&prop, pBuffer, nSize, FALSE, arena, refs);
+      if (nRes == -1)
+	goto invalid;
+      nSize -= nRes;
+      pBuffer += nRes;
+
+      AMFProp_SetName(&prop, &name);
+      ObjAdd(obj, &prop, arena);
+    }
+  else
+    {
+      for (i = 0; i < cd.cd_num; i++)	/* sealed members */
+	{
+	  nRes = AMF3PropDecode(&prop, pBuffer, nSize, FALSE, arena, refs);
+	  if (nRes == -1)
+	    goto invalid;
+	  AMFProp_SetName(&prop, AMF3CD_GetProp(&cd, i));
+	  ObjAdd(obj, &prop, arena);
+	  pBuffer += nRes;
+	  nSize -= nRes;
+	}
+      while (cd.cd_dynamic)	/* name/value pairs up to an empty name */
+	{
+	  AVal name;
+	  if ((len = ReadString3(refs, pBuffer, nSize, &name)) < 0)
+	    goto invalid;
+	  pBuffer += len;
+	  nSize -= len;
+	  if (!name.av_len)
+	    break;
+	  nRes = AMF3PropDecode(&prop, pBuffer, nSize, FALSE, arena, refs);
+	  if (nRes == -1)
+	    goto invalid;
+	  prop.p_name = name;
+	  ObjAdd(obj, &prop, arena);
+	  pBuffer += nRes;
+	  nSize -= nRes;
 	}
-      RTMP_Log(RTMP_LOGDEBUG, "class object!");
     }
+  ObjEnd(obj, base, arena);
+  prop.p_type = AMF_OBJECT;
+  prop.p_vu.p_object = *obj;
+  RefSet(refs, slot, &prop);
   return nOriginalSize - nSize;
+
+invalid:
+  RTMP_Log(RTMP_LOGDEBUG, "%s, invalid class encoding!", __FUNCTION__);
+  ObjEnd(obj, base, arena);
+  if (!arena)
+    AMF_Reset(obj);
+  return -1;
 }
 
 int
 AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
+{
+  return ObjDecode(obj, pBuffer, nSize, bDecodeName, NULL);
+}
+
+/* Like AMF_Decode, but every object's properties come from arena.
+ * Release them with AMFArena_Reset/AMFArena_Free, never AMF_Reset.
+ */
+int
+AMF_DecodeArena(AMFObject *obj, const char *pBuffer, int nSize,
+		int bDecodeName, AMFArena *arena)
+{
+  return ObjDecode(obj, pBuffer, nSize, bDecodeName, arena);
+}
+
+static int
+ObjDecode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName,
+	  AMFArena *arena)
 {
   int nOriginalSize = nSize;
   int bError = FALSE;		/* if there is an error while decoding - try to at least find the end mark AMF_OBJECT_END */
+  int base = arena ? arena->a_top : 0;
 
   obj->o_num = 0;
   obj->o_props = NULL;
@@ -1205,7 +1744,7 @@ AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
 	  continue;
 	}
 
-      nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+      nRes = PropDecode(&prop, pBuffer, nSize, bDecodeName, arena);
       if (nRes == -1)
 	{
 	  bError = TRUE;
@@ -1220,9 +1759,10 @@ AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
 	      break;
 	    }
 	  pBuffer += nRes;
-	  AMF_AddProp(obj, &prop);
+	  ObjAdd(obj, &prop, arena);
 	}
     }
+  ObjEnd(obj, base, arena);
 
   if (bError)
     return -1;
@@ -1233,9 +1773,12 @@ AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
 void
 AMF_AddProp(AMFObject *obj, const AMFObjectProperty *prop)
 {
-  if (!(obj->o_num & 0x0f))
+  /* Capacity is 16, then doubles: regrow when o_num reaches 16 or a
+   * larger power of two. Large arrays no longer realloc every 16 items.
+   */
+  if (!obj->o_num || (obj->o_num >= 16 && !(obj->o_num & (obj->o_num - 1))))
     obj->o_props =
-      realloc(obj->o_props, (obj->o_num + 16) * sizeof(AMFObjectProperty));
+      realloc(obj->o_props, (obj->o_num ? obj->o_num * 2 : 16) * sizeof(AMFObjectProperty));
   memcpy(&obj->o_props[obj->o_num++], prop, sizeof(AMFObjectProperty));
 }
 
@@ -1266,10 +1809,126 @@ AMF_GetProp(AMFObject *obj, const AVal *name, int nIndex)
   return (AMFObjectProperty *)&AMFProp_Invalid;
 }
 
+/* AMFIndex */
+
+#define INDEX_MIN	8	/* below this, a linear scan is as fast */
+
+static unsigned int
+IndexHash(const AVal *name)
+{
+  const unsigned char *c = (const unsigned char *)name->av_val;
+  unsigned int h = 2166136261U;
+  int i;
+
+  for (i = 0; i < name->av_len; i++)
+    h = (h ^ c[i]) * 16777619U;
+  return h;
+}
+
+void
+AMFIndex_Init(AMFIndex *idx)
+{
+  memset(idx, 0, sizeof(AMFIndex));
+}
+
+void
+AMFIndex_Free(AMFIndex *idx)
+{
+  free(idx->x_slots);
+  AMFIndex_Init(idx);
+}
+
+static int
+IndexBuild(AMFIndex *idx, AMFObject *obj)
+{
+  unsigned int size = 16, h;
+  int i, *slot;
+
+  while (size < (unsigned int)obj->o_num * 2)
+    size <<= 1;
+  if (size - 1 != idx->x_mask || !idx->x_slots)
+    {
+      free(idx->x_slots);
+      idx->x_slots = malloc(size * sizeof(int));
+      if (!idx->x_slots)
+	{
+	  AMFIndex_Init(idx);
+	  return FALSE;
+	}
+      idx->x_mask = size - 1;
+    }
+  memset(idx->x_slots, 0, size * sizeof(int));
+
+  for (i = 0; i < obj->o_num; i++)
+    {
+      const AVal *name = &obj->o_props[i].p_name;
+      for (h = IndexHash(name) & idx->x_mask; *(slot = &idx->x_slots[h]);
+	   h = (h + 1) & idx->x_mask)
+	{
+	  /* keep the first of duplicate names, like AMF_GetProp */
+	  if (AVMATCH(&obj->o_props[*slot - 1].p_name, name))
+	    break;
+	}
+      if (!*slot)
+	*slot = i + 1;
+    }
+  idx->x_props = obj->o_props;
+  idx->x_num = obj->o_num;
+  return TRUE;
+}
+
+AMFObjectProperty *
+AMF_GetPropIndexed(AMFObject *obj, AMFIndex *idx, const AVal *name)
+{
+  unsigned int h;
+  int *slot;
+
+  if (obj->o_num < INDEX_MIN)
+    return AMF_GetProp(obj, name, -1);
+
+  if ((idx->x_props != obj->o_props || idx->x_num != obj->o_num ||
+       !idx->x_slots) && !IndexBuild(idx, obj))
+    return AMF_GetProp(obj, name, -1);
+
+  for (h = IndexHash(name) & idx->x_mask; *(slot = &idx->x_slots[h]);
+       h = (h + 1) & idx->x_mask)
+    {
+      if (AVMATCH(&obj->o_props[*slot - 1].p_name, name))
+	return &obj->o_props[*slot - 1];
+    }
+  return (AMFObjectProperty *)&AMFProp_Invalid;
+}
+
+int
+AMF_GetProps(AMFObject *obj, AMFIndex *idx, const AVal *names, int nNames,
+	     AMFObjectProperty **props)
+{
+  AMFIndex tmp;
+  int i, found = 0;
+
+  if (!idx)
+    {
+      AMFIndex_Init(&tmp);
+      idx = &tmp;
+    }
+  for (i = 0; i < nNames; i++)
+    {
+      props[i] = AMF_GetPropIndexed(obj, idx, &names[i]);
+      if (props[i]->p_type != AMF_INVALID)
+	found++;
+    }
+  if (idx == &tmp)
+    AMFIndex_Free(&tmp);
+  return found;
+}
+
 void
 AMF_Dump(AMFObject *obj)
 {
   int n;
+
+  if (!RTMP_LogEnabled(RTMP_LOGDEBUG))
+    return;
   RTMP_Log(RTMP_LOGDEBUG, "(object begin)");
   for (n = 0; n < obj->o_num; n++)
     {
@@ -1292,6 +1951,495 @@ AMF_Reset(AMFObject *obj)
 }
 
 
+/* AMF walker */
+
+#define WALK_MAXDEPTH	64
+#define WALK3_STRINGS	64
+#define WALK3_TRAITS	16
+
+typedef struct AMF3WalkTraits
+{
+  AVal t_name;
+  const char *t_members;	/* first sealed member name */
+  int t_count;
+  int t_dynamic;
+} AMF3WalkTraits;
+
+/* AMF3 reference tables are fixed size so walking never allocates;
+ * references past their end are reported with empty values.
+ */
+typedef struct AMFWalker
+{
+  AMFWalkFunc *w_func;
+  void *w_ctx;
+  int w_stop;
+  int w_nstrings;
+  int w_ntraits;
+  AVal w_strings[WALK3_STRINGS];
+  AMF3WalkTraits w_traits[WALK3_TRAITS];
+} AMFWalker;
+
+static int
+WalkReport(AMFWalker *w, AMFWalkEvent *ev, int report)
+{
+  int act;
+
+  if (!report)
+    return AMF_WALK_SKIP;
+  act = w->w_func(ev, w->w_ctx);
+  if (act == AMF_WALK_STOP)
+    w->w_stop = TRUE;
+  return act;
+}
+
+static int
+WalkString3(AMFWalker *w, const char *data, int nSize, AVal *str, int bRegister)
+{
+  uint32_t ref;
+  int len = AMF3ReadU29(data, nSize, &ref);
+
+  if (len < 0)
+    return -1;
+  if (!(ref & 1))
+    {
+      ref >>= 1;
+      if (ref < WALK3_STRINGS && (int)ref < w->w_nstrings)
+	*str = w->w_strings[ref];
+      else
+	str->av_val = NULL, str->av_len = 0;
+      return len;
+    }
+  ref >>= 1;
+  if (ref > (uint32_t)(nSize - len))
+    return -1;
+  str->av_val = (char *)data + len;
+  str->av_len = ref;
+  if (ref && bRegister)
+    {
+      if (w->w_nstrings < WALK3_STRINGS)
+	w->w_strings[w->w_nstrings] = *str;
+      w->w_nstrings++;
+    }
+  return len + ref;
+}
+
+static int
+Walk3(AMFWalker *w, const char *pBuffer, int nSize, const AVal *name,
+      int depth, int report)
+{
+  const char *p = pBuffer;
+  AMFWalkEvent ev;
+  uint32_t u;
+  int n = nSize, r, sub, i;
+
+  if (n < 1 || depth > WALK_MAXDEPTH)
+    return -1;
+  memset(&ev, 0, sizeof(ev));
+  ev.e_depth = depth;
+  if (name)
+    ev.e_name = *name;
+  ev.e_amf3 = (unsigned char)*p++;
+  n--;
+
+  switch (ev.e_amf3)
+    {
+    case AMF3_UNDEFINED:
+    case AMF3_NULL:
+      ev.e_type = AMF_NULL;
+      break;
+    case AMF3_FALSE:
+    case AMF3_TRUE:
+      ev.e_type = AMF_BOOLEAN;
+      ev.e_number = ev.e_amf3 == AMF3_TRUE;
+      break;
+    case AMF3_INTEGER:
+      if ((r = AMF3ReadU29(p, n, &u)) < 0)
+	return -1;
+      ev.e_type = AMF_NUMBER;
+      ev.e_number = (u & 0x10000000) ? (int32_t)u - (1 << 29) : (int32_t)u;
+      p += r;
+      break;
+    case AMF3_DOUBLE:
+      if (n < 8)
+	return -1;
+      ev.e_type = AMF_NUMBER;
+      ev.e_number = AMF_DecodeNumber(p);
+      p += 8;
+      break;
+    case AMF3_STRING:
+      if ((r = WalkString3(w, p, n, &ev.e_aval, TRUE)) < 0)
+	return -1;
+      ev.e_type = AMF_STRING;
+      p += r;
+      break;
+    case AMF3_XML_DOC:
+    case AMF3_XML:
+    case AMF3_BYTE_ARRAY:
+    case AMF3_DATE:
+      if ((r = AMF3ReadU29(p, n, &u)) < 0)
+	return -1;
+      p += r;
+      n -= r;
+      if (!(u & 1))
+	{
+	  ev.e_type = AMF_REFERENCE;
+	  ev.e_number = u >> 1;
+	}
+      else if (ev.e_amf3 == AMF3_DATE)
+	{
+	  if (n < 8)
+	    return -1;
+	  ev.e_type = AMF_DATE;
+	  ev.e_number = AMF_DecodeNumber(p);
+	  p += 8;
+	}
+      else
+	{
+	  u >>= 1;
+	  if (u > (uint32_t)n)
+	    return -1;
+	  ev.e_type = ev.e_amf3 == AMF3_BYTE_ARRAY ? AMF_UNSUPPORTED : AMF_XML_DOC;
+	  ev.e_aval.av_val = (char *)p;
+	  ev.e_aval.av_len = u;
+	  p += u;
+	}
+      break;
+    case AMF3_ARRAY:
+      {
+	AVal key;
+	int count;
+
+	if ((r = AMF3ReadU29(p, n, &u)) < 0)
+	  return -1;
+	p += r;
+	n -= r;
+	if (!(u & 1))
+	  {
+	    ev.e_type = AMF_REFERENCE;
+	    ev.e_number = u >> 1;
+	    break;
+	  }
+	count = u >> 1;
+	if ((r = WalkString3(w, p, n, &key, TRUE)) < 0)
+	  return -1;
+	p += r;
+	n -= r;
+	ev.e_type = key.av_len ? AMF_ECMA_ARRAY : AMF_STRICT_ARRAY;
+	ev.e_count = count;
+	sub = WalkReport(w, &ev, report) == AMF_WALK_CONTINUE;
+	if (w->w_stop)
+	  return p - pBuffer;
+	while (key.av_len)
+	  {
+	    if ((r = Walk3(w, p, n, &key, depth + 1, sub)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	    if (w->w_stop)
+	      return p - pBuffer;
+	    if ((r = WalkString3(w, p, n, &key, TRUE)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	  }
+	for (i = 0; i < count; i++)
+	  {
+	    if ((r = Walk3(w, p, n, NULL, depth + 1, sub)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	    if (w->w_stop)
+	      return p - pBuffer;
+	  }
+	ev.e_type = AMF_OBJECT_END;
+	WalkReport(w, &ev, sub);
+	return p - pBuffer;
+      }
+    case AMF3_OBJECT:
+      {
+	AMF3WalkTraits t;
+	const char *mp;
+	int mn;
+	AVal key;
+
+	if ((r = AMF3ReadU29(p, n, &u)) < 0)
+	  return -1;
+	p += r;
+	n -= r;
+	if (!(u & 1))
+	  {
+	    ev.e_type = AMF_REFERENCE;
+	    ev.e_number = u >> 1;
+	    break;
+	  }
+	if (!(u & 2))
+	  {
+	    u >>= 2;
+	    if (u >= WALK3_TRAITS || (int)u >= w->w_ntraits)
+	      {
+		RTMP_Log(RTMP_LOGDEBUG, "%s, AMF3 traits reference %u out of range",
+		    __FUNCTION__, u);
+		return -1;
+	      }
+	    t = w->w_traits[u];
+	    ev.e_aval = t.t_name;
+	    /* names are read back from the original definition */
+	    mp = t.t_members;
+	    mn = nSize - (mp - pBuffer);
+	  }
+	else if (u & 4)
+	  {
+	    RTMP_Log(RTMP_LOGDEBUG, "%s, externalizable AMF3 object not supported",
+		__FUNCTION__);
+	    return -1;
+	  }
+	else
+	  {
+	    t.t_dynamic = (u & 8) != 0;
+	    t.t_count = u >> 4;
+	    if ((r = WalkString3(w, p, n, &t.t_name, TRUE)) < 0)
+	      return -1;
+	    ev.e_aval = t.t_name;
+	    p += r;
+	    n -= r;
+	    t.t_members = p;
+	    for (i = 0; i < t.t_count; i++)
+	      {
+		if ((r = WalkString3(w, p, n, &key, TRUE)) < 0)
+		  return -1;
+		p += r;
+		n -= r;
+	      }
+	    if (w->w_ntraits < WALK3_TRAITS)
+	      w->w_traits[w->w_ntraits] = t;
+	    w->w_ntraits++;
+	    mp = t.t_members;
+	    mn = p - mp;
+	  }
+
+	ev.e_type = AMF_OBJECT;
+	ev.e_count = t.t_count;
+	sub = WalkReport(w, &ev, report) == AMF_WALK_CONTINUE;
+	if (w->w_stop)
+	  return p - pBuffer;
+	for (i = 0; i < t.t_count; i++)
+	  {
+	    /* member names were registered when the traits were read */
+	    if ((r = WalkString3(w, mp, mn, &key, FALSE)) < 0)
+	      return -1;
+	    mp += r;
+	    mn -= r;
+	    if ((r = Walk3(w, p, n, &key, depth + 1, sub)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	    if (w->w_stop)
+	      return p - pBuffer;
+	  }
+	while (t.t_dynamic)
+	  {
+	    if ((r = WalkString3(w, p, n, &key, TRUE)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	    if (!key.av_len)
+	      break;
+	    if ((r = Walk3(w, p, n, &key, depth + 1, sub)) < 0)
+	      return -1;
+	    p += r;
+	    n -= r;
+	    if (w->w_stop)
+	      return p - pBuffer;
+	  }
+	ev.e_type = AMF_OBJECT_END;
+	ev.e_aval.av_val = NULL;
+	ev.e_aval.av_len = 0;
+	WalkReport(w, &ev, sub);
+	return p - pBuffer;
+      }
+    default:
+      RTMP_Log(RTMP_LOGDEBUG, "%s, unknown AMF3 datatype 0x%02x", __FUNCTION__,
+	  ev.e_amf3);
+      return -1;
+    }
+
+  WalkReport(w, &ev, report);
+  return p - pBuffer;
+}
+
+static int
+Walk0(AMFWalker *w, const char *pBuffer, int nSize, const AVal *name,
+      int depth, int report)
+{
+  const char *p = pBuffer;
+  AMFWalkEvent ev;
+  unsigned int len;
+  int n = nSize, r, sub, i;
+
+  if (n < 1 || depth > WALK_MAXDEPTH)
+    return -1;
+  memset(&ev, 0, sizeof(ev));
+  ev.e_depth = depth;
+  if (name)
+    ev.e_name = *name;
+  ev.e_amf3 = -1;
+  ev.e_data = pBuffer;
+  ev.e_size = nSize;
+  ev.e_type = (unsigned char)*p++;
+  n--;
+
+  switch (ev.e_type)
+    {
+    case AMF_NUMBER:
+      if (n < 8)
+	return -1;
+      ev.e_number = AMF_DecodeNumber(p);
+      p += 8;
+      break;
+    case AMF_BOOLEAN:
+      if (n < 1)
+	return -1;
+      ev.e_number = *p++ != 0;
+      break;
+    case AMF_STRING:
+      if (n < 2 || (len = AMF_DecodeInt16(p)) > (unsigned int)n - 2)
+	return -1;
+      AMF_DecodeString(p, &ev.e_aval);
+      p += 2 + len;
+      break;
+    case AMF_LONG_STRING:
+    case AMF_XML_DOC:
+      if (n < 4 || (len = AMF_DecodeInt32(p)) > (unsigned int)n - 4)
+	return -1;
+      AMF_DecodeLongString(p, &ev.e_aval);
+      if (ev.e_type == AMF_LONG_STRING)
+	ev.e_type = AMF_STRING;
+      p += 4 + len;
+      break;
+    case AMF_DATE:
+      if (n < 10)
+	return -1;
+      ev.e_number = AMF_DecodeNumber(p);
+      ev.e_UTCoffset = AMF_DecodeInt16(p + 8);
+      p += 10;
+      break;
+    case AMF_NULL:
+    case AMF_UNDEFINED:
+    case AMF_UNSUPPORTED:
+      ev.e_type = AMF_NULL;
+      break;
+    case AMF_REFERENCE:
+      if (n < 2)
+	return -1;
+      ev.e_number = AMF_DecodeInt16(p);
+      p += 2;
+      break;
+    case AMF_AVMPLUS:
+      /* each switch to AMF3 starts with empty reference tables */
+      w->w_nstrings = 0;
+      w->w_ntraits = 0;
+      r = Walk3(w, p, n, name, depth, report);
+      return r < 0 ? -1 : r + 1;
+    case AMF_TYPED_OBJECT:
+    case AMF_OBJECT:
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+      if (ev.e_type == AMF_TYPED_OBJECT)
+	{
+	  if (n < 2 || (len = AMF_DecodeInt16(p)) > (unsigned int)n - 2)
+	    return -1;
+	  AMF_DecodeString(p, &ev.e_aval);
+	  p += 2 + len;
+	  n -= 2 + len;
+	  ev.e_type = AMF_OBJECT;
+	}
+      else if (ev.e_type != AMF_OBJECT)
+	{
+	  if (n < 4)
+	    return -1;
+	  ev.e_count = AMF_DecodeInt32(p);
+	  p += 4;
+	  n -= 4;
+	}
+      sub = WalkReport(w, &ev, report) == AMF_WALK_CONTINUE;
+      if (w->w_stop)
+	return p - pBuffer;
+      if (ev.e_type == AMF_STRICT_ARRAY)
+	{
+	  for (i = 0; i < ev.e_count; i++)
+	    {
+	      if ((r = Walk0(w, p, n, NULL, depth + 1, sub)) < 0)
+		return -1;
+	      p += r;
+	      n -= r;
+	      if (w->w_stop)
+		return p - pBuffer;
+	    }
+	}
+      else
+	{
+	  /* like AMF_Decode, ECMA arrays run to the end marker, not count */
+	  while (n > 0)
+	    {
+	      AVal key;
+
+	      if (n >= 3 && AMF_DecodeInt24(p) == AMF_OBJECT_END)
+		{
+		  p += 3;
+		  n -= 3;
+		  break;
+		}
+	      if (n < 2 || (len = AMF_DecodeInt16(p)) > (unsigned int)n - 2)
+		return -1;
+	      AMF_DecodeString(p, &key);
+	      p += 2 + len;
+	      n -= 2 + len;
+	      if ((r = Walk0(w, p, n, &key, depth + 1, sub)) < 0)
+		return -1;
+	      p += r;
+	      n -= r;
+	      if (w->w_stop)
+		return p - pBuffer;
+	    }
+	}
+      ev.e_type = AMF_OBJECT_END;
+      ev.e_aval.av_val = NULL;
+      ev.e_aval.av_len = 0;
+      WalkReport(w, &ev, sub);
+      return p - pBuffer;
+    default:
+      RTMP_Log(RTMP_LOGDEBUG, "%s, unknown datatype 0x%02x", __FUNCTION__,
+	  ev.e_type);
+      return -1;
+    }
+
+  WalkReport(w, &ev, report);
+  return p - pBuffer;
+}
+
+int
+AMF_Walk(const char *pBuffer, int nSize, AMFWalkFunc *func, void *ctx)
+{
+  AMFWalker w;
+  int nOriginalSize = nSize;
+
+  w.w_func = func;
+  w.w_ctx = ctx;
+  w.w_stop = FALSE;
+  w.w_nstrings = 0;
+  w.w_ntraits = 0;
+
+  while (nSize > 0 && !w.w_stop)
+    {
+      int nRes = Walk0(&w, pBuffer, nSize, NULL, 0, TRUE);
+      if (nRes < 0)
+	return -1;
+      pBuffer += nRes;
+      nSize -= nRes;
+    }
+  return nOriginalSize - nSize;
+}
+
 /* AMF3ClassDefinition */
 
 void
@@ -1309,3 +2457,291 @@ AMF3CD_GetProp(AMF3ClassDef *cd, int nIndex)
     return (AVal *)&AV_empty;
   return &cd->cd_props[nIndex];
 }
+
+/* AMF3 encoder */
+
+typedef struct AMF3EncString
+{
+  AVal s_val;			/* av_val NULL if the slot is free */
+  int s_idx;
+} AMF3EncString;
+
+typedef struct AMF3EncTraits
+{
+  AVal t_name;
+  const AMFObjectProperty *t_props;	/* member names */
+  int t_num;
+} AMF3EncTraits;
+
+void
+AMF3Enc_Init(AMF3Encoder *enc)
+{
+  memset(enc, 0, sizeof(*enc));
+}
+
+void
+AMF3Enc_Reset(AMF3Encoder *enc)
+{
+  free(enc->en_strings);
+  free(enc->en_traits);
+  AMF3Enc_Init(enc);
+}
+
+static char *
+AMF3WriteU29(char *output, char *outend, uint32_t val)
+{
+  int n = val < 0x80 ? 1 : val < 0x4000 ? 2 : val < 0x200000 ? 3 : 4;
+
+  if (val >= 0x20000000 || output + n > outend)
+    return NULL;
+  switch (n)
+    {
+    case 4:
+      *output++ = (val >> 22) | 0x80;
+      *output++ = ((val >> 15) & 0x7f) | 0x80;
+      *output++ = ((val >> 8) & 0x7f) | 0x80;
+      *output++ = val & 0xff;
+      break;
+    case 3:
+      *output++ = (val >> 14) | 0x80;
+      /* FALLTHRU */
+    case 2:
+      *output++ = ((val >> 7) & 0x7f) | 0x80;
+      /* FALLTHRU */
+    case 1:
+      *output++ = val & 0x7f;
+    }
+  return output;
+}
+
+static char *
+AMF3WriteBytes(char *output, char *outend, const AVal *str)
+{
+  if (str->av_len >= 0x10000000)
+    return NULL;
+  output = AMF3WriteU29(output, outend, (str->av_len << 1) | 1);
+  if (!output || output + str->av_len > outend)
+    return NULL;
+  memcpy(output, str->av_val, str->av_len);
+  return output + str->av_len;
+}
+
+/* Write str inline the first time, as a reference after that */
+static char *
+AMF3WriteString(AMF3Encoder *enc, char *output, char *outend, const AVal *str)
+{
+  AMF3EncString *s;
+  unsigned int h;
+
+  if (!str->av_len)
+    return AMF3WriteU29(output, outend, 1);
+
+  if (enc->en_nstrings * 2 >= (int)enc->en_mask)
+    {
+      /* keep the table at most half full */
+      unsigned int i, mask = enc->en_mask ? enc->en_mask * 2 + 1 : 63;
+      AMF3EncString *tab = calloc(mask + 1, sizeof(AMF3EncString));
+
+      if (tab)
+	{
+	  for (i = 0; enc->en_strings && i <= enc->en_mask; i++)
+	    {
+	      if (!enc->en_strings[i].s_val.av_val)
+		continue;
+	      for (h = IndexHash(&enc->en_strings[i].s_val) & mask;
+		   tab[h].s_val.av_val; h = (h + 1) & mask) ;
+	      tab[h] = enc->en_strings[i];
+	    }
+	  free(enc->en_strings);
+	  enc->en_strings = tab;
+	  enc->en_mask = mask;
+	}
+    }
+  if (!enc->en_strings)
+    return AMF3WriteBytes(output, outend, str);
+
+  for (h = IndexHash(str) & enc->en_mask; (s = &enc->en_strings[h])->s_val.av_val;
+       h = (h + 1) & enc->en_mask)
+    {
+      if (AVMATCH(&s->s_val, str))
+	return AMF3WriteU29(output, outend, s->s_idx << 1);
+    }
+  /* a full table just stops adding references */
+  if (enc->en_nstrings * 2 < (int)enc->en_mask)
+    {
+      s->s_val = *str;
+      s->s_idx = enc->en_nstrings++;
+    }
+  return AMF3WriteBytes(output, outend, str);
+}
+
+/* AVMATCH that also accepts two empty names with NULL pointers */
+#define AVEQUAL(a1,a2)	((a1)->av_len == (a2)->av_len && \
+			 (!(a1)->av_len || !memcmp((a1)->av_val,(a2)->av_val,(a1)->av_len)))
+
+static int
+TraitsFind(AMF3Encoder *enc, const AVal *name, const AMFObject *obj)
+{
+  int i, j;
+
+  for (i = 0; i < enc->en_ntraits; i++)
+    {
+      AMF3EncTraits *t = &enc->en_traits[i];
+      if (t->t_num != obj->o_num || !AVEQUAL(&t->t_name, name))
+	continue;
+      for (j = 0; j < t->t_num; j++)
+	if (!AVEQUAL(&t->t_props[j].p_name, &obj->o_props[j].p_name))
+	  break;
+      if (j == t->t_num)
+	return i;
+    }
+  return -1;
+}
+
+char *
+AMF3_Encode(AMF3Encoder *enc, const AMFObject *obj, const AVal *className,
+	    char *pBuffer, char *pBufEnd)
+{
+  int i, idx;
+
+  if (!className)
+    className = &AV_empty;
+  if (pBuffer + 1 > pBufEnd)
+    return NULL;
+  *pBuffer++ = AMF3_OBJECT;
+
+  idx = TraitsFind(enc, className, obj);
+  if (idx >= 0)
+    {
+      /* instance, traits by reference */
+      pBuffer = AMF3WriteU29(pBuffer, pBufEnd, (idx << 2) | 1);
+    }
+  else
+    {
+      /* instance, inline sealed traits, all members sealed */
+      if (obj->o_num >= 0x1000000)
+	return NULL;
+      pBuffer = AMF3WriteU29(pBuffer, pBufEnd, (obj->o_num << 4) | 3);
+      if (pBuffer)
+	pBuffer = AMF3WriteString(enc, pBuffer, pBufEnd, className);
+      for (i = 0; i < obj->o_num && pBuffer; i++)
+	pBuffer = AMF3WriteString(enc, pBuffer, pBufEnd,
+				  &obj->o_props[i].p_name);
+      if (RefsGrow(&enc->en_traits, enc->en_ntraits, sizeof(AMF3EncTraits)))
+	{
+	  AMF3EncTraits *t = &enc->en_traits[enc->en_ntraits++];
+	  t->t_name = *className;
+	  t->t_props = obj->o_props;
+	  t->t_num = obj->o_num;
+	}
+      else
+	return NULL;	/* reference numbering would be off */
+    }
+
+  for (i = 0; i < obj->o_num && pBuffer; i++)
+    pBuffer = AMF3Prop_Encode(enc, &obj->o_props[i], pBuffer, pBufEnd);
+  return pBuffer;
+}
+
+/* Named members go in the associative part, unnamed ones are the
+ * dense items; strict arrays have only the latter.
+ */
+static char *
+AMF3EncodeArray(AMF3Encoder *enc, const AMFObject *obj, char *pBuffer,
+		char *pBufEnd)
+{
+  uint32_t dense = 0;
+  int i;
+
+  for (i = 0; i < obj->o_num; i++)
+    if (!obj->o_props[i].p_name.av_len)
+      dense++;
+  if (pBuffer + 1 > pBufEnd || dense >= 0x10000000)
+    return NULL;
+  *pBuffer++ = AMF3_ARRAY;
+  pBuffer = AMF3WriteU29(pBuffer, pBufEnd, (dense << 1) | 1);
+  for (i = 0; i < obj->o_num && pBuffer; i++)
+    {
+      const AMFObjectProperty *prop = &obj->o_props[i];
+      if (!prop->p_name.av_len)
+	continue;
+      pBuffer = AMF3WriteString(enc, pBuffer, pBufEnd, &prop->p_name);
+      pBuffer = AMF3Prop_Encode(enc, prop, pBuffer, pBufEnd);
+    }
+  if (pBuffer)
+    pBuffer = AMF3WriteU29(pBuffer, pBufEnd, 1);	/* end of keys */
+  for (i = 0; i < obj->o_num && pBuffer; i++)
+    if (!obj->o_props[i].p_name.av_len)
+      pBuffer = AMF3Prop_Encode(enc, &obj->o_props[i], pBuffer, pBufEnd);
+  return pBuffer;
+}
+
+char *
+AMF3Prop_Encode(AMF3Encoder *enc, const AMFObjectProperty *prop,
+		char *pBuffer, char *pBufEnd)
+{
+  double d;
+
+  if (!pBuffer || pBuffer + 1 > pBufEnd)
+    return NULL;
+
+  switch (prop->p_type)
+    {
+    case AMF_NUMBER:
+      d = prop->p_vu.p_number;
+      if (d >= AMF3_INTEGER_MIN && d <= AMF3_INTEGER_MAX && d == (int32_t)d)
+	{
+	  *pBuffer++ = AMF3_INTEGER;
+	  return AMF3WriteU29(pBuffer, pBufEnd, (int32_t)d & 0x1fffffff);
+	}
+      if (pBuffer + 8 >= pBufEnd)
+	return NULL;
+      *pBuffer++ = AMF3_DOUBLE;
+      NumberPut(pBuffer, d);
+      return pBuffer + 8;
+
+    case AMF_BOOLEAN:
+      *pBuffer++ = prop->p_vu.p_number != 0 ? AMF3_TRUE : AMF3_FALSE;
+      return pBuffer;
+
+    case AMF_STRING:
+      *pBuffer++ = AMF3_STRING;
+      return AMF3WriteString(enc, pBuffer, pBufEnd, &prop->p_vu.p_aval);
+
+    case AMF_NULL:
+      *pBuffer++ = AMF3_NULL;
+      return pBuffer;
+
+    case AMF_UNDEFINED:
+      *pBuffer++ = AMF3_UNDEFINED;
+      return pBuffer;
+
+    case AMF_DATE:
+      if (pBuffer + 9 >= pBufEnd)
+	return NULL;
+      *pBuffer++ = AMF3_DATE;
+      *pBuffer++ = 1;		/* inline, no reference */
+      NumberPut(pBuffer, prop->p_vu.p_number);
+      return pBuffer + 8;
+
+    case AMF_XML_DOC:
+      *pBuffer++ = AMF3_XML_DOC;
+      return AMF3WriteBytes(pBuffer, pBufEnd, &prop->p_vu.p_aval);
+
+    case AMF_UNSUPPORTED:		/* ByteArray, as decoded */
+      *pBuffer++ = AMF3_BYTE_ARRAY;
+      return AMF3WriteBytes(pBuffer, pBufEnd, &prop->p_vu.p_aval);
+
+    case AMF_OBJECT:
+      return AMF3_Encode(enc, &prop->p_vu.p_object, NULL, pBuffer, pBufEnd);
+
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+      return AMF3EncodeArray(enc, &prop->p_vu.p_object, pBuffer, pBufEnd);
+
+    default:
+      RTMP_Log(RTMP_LOGERROR, "%s, can't encode type %d as AMF3", __FUNCTION__,
+	  prop->p_type);
+      return NULL;
+    }
+}
@@ -94,6 +94,8 @@ extern "C"
   char *AMF_EncodeNamedString(char *output, char *outend, const AVal * name, const AVal * value);
   char *AMF_EncodeNamedNumber(char *output, char *outend, const AVal * name, double dVal);
   char *AMF_EncodeNamedBoolean(char *output, char *outend, const AVal * name, int bVal);
+  char *AMF_EncodeNamedNumberArray(char *output, char *outend, const AVal * name,
+				   const double *vals, int nVals);
 
   unsigned short AMF_DecodeInt16(const char *data);
   unsigned int AMF_DecodeInt24(const char *data);
@@ -106,21 +108,74 @@ extern "C"
   char *AMF_Encode(AMFObject * obj, char *pBuffer, char *pBufEnd);
   char *AMF_EncodeEcmaArray(AMFObject *obj, char *pBuffer, char *pBufEnd);
   char *AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd);
+  /* Strict arrays of numbers to and from a plain double[], without
+   * going through AMFObjectProperty. */
+  char *AMF_EncodeNumberArray(char *output, char *outend, const double *vals,
+			      int nVals);
 
   int AMF_Decode(AMFObject * obj, const char *pBuffer, int nSize,
 		 int bDecodeName);
   int AMF_DecodeArray(AMFObject * obj, const char *pBuffer, int nSize,
 		      int nArrayLen, int bDecodeName);
+  /* Decode a strict or ECMA array, marker included, into vals[]; the
+   * names of ECMA array members are dropped. Returns the bytes used and
+   * the count in *nVals, or -1 if it is malformed, holds anything but
+   * numbers, or has more than nMax items. With vals NULL the items are
+   * only counted and nMax is ignored. */
+  int AMF_DecodeNumberArray(const char *pBuffer, int nSize, double *vals,
+			    int nMax, int *nVals);
   int AMF3_Decode(AMFObject * obj, const char *pBuffer, int nSize,
 		  int bDecodeName);
   void AMF_Dump(AMFObject * obj);
   void AMF_Reset(AMFObject * obj);
 
+  /* Property storage for AMF_DecodeArena(): all objects of a message
+   * share a few large blocks that are released in one go.
+   */
+  typedef struct AMFArenaBlock AMFArenaBlock;
+  typedef struct AMFArena
+  {
+    AMFArenaBlock *a_blocks;
+    struct AMFObjectProperty *a_stack;	/* props of open objects */
+    int a_top;
+    int a_max;
+  } AMFArena;
+
+  void AMFArena_Init(AMFArena * arena);
+  void AMFArena_Reset(AMFArena * arena);
+  void AMFArena_Free(AMFArena * arena);
+  int AMF_DecodeArena(AMFObject * obj, const char *pBuffer, int nSize,
+		      int bDecodeName, AMFArena * arena);
+
   void AMF_AddProp(AMFObject * obj, const AMFObjectProperty * prop);
   int AMF_CountProp(AMFObject * obj);
   AMFObjectProperty *AMF_GetProp(AMFObject * obj, const AVal * name,
 				 int nIndex);
 
+  /* Hash index over an object's property names, for large objects or
+   * many lookups. It is built on first use and rebuilt when the object
+   * has grown since (AMF_AddProp) or is pointed at another object. It
+   * lives beside the object so the AMFObject layout stays as is; zero
+   * it or AMFIndex_Init() it before use, and AMFIndex_Free() it when
+   * the object is reset.
+   */
+  typedef struct AMFIndex
+  {
+    const struct AMFObjectProperty *x_props;	/* indexed array */
+    int x_num;
+    unsigned int x_mask;
+    int *x_slots;		/* property number + 1, 0 if free */
+  } AMFIndex;
+
+  void AMFIndex_Init(AMFIndex * idx);
+  void AMFIndex_Free(AMFIndex * idx);
+  AMFObjectProperty *AMF_GetPropIndexed(AMFObject * obj, AMFIndex * idx,
+					const AVal * name);
+  /* Look up nNames names at once, storing each match (or an invalid
+   * property) in props[]. idx may be NULL. Returns the number found. */
+  int AMF_GetProps(AMFObject * obj, AMFIndex * idx, const AVal * names,
+		   int nNames, AMFObjectProperty ** props);
+
   AMFDataType AMFProp_GetType(AMFObjectProperty * prop);
   void AMFProp_SetNumber(AMFObjectProperty * prop, double dval);
   void AMFProp_SetBoolean(AMFObjectProperty * prop, int bflag);
@@ -145,6 +200,37 @@ extern "C"
   void AMFProp_Dump(AMFObjectProperty * prop);
   void AMFProp_Reset(AMFObjectProperty * prop);
 
+  /* Streaming decoder: AMF_Walk() reports each value to the callback
+   * in order, without building an AMFObject and without allocating.
+   * Containers (AMF_OBJECT, AMF_ECMA_ARRAY, AMF_STRICT_ARRAY) are
+   * reported at their start, and again with AMF_OBJECT_END after
+   * their last member. AMF3 values (after an AMF_AVMPLUS marker) are
+   * mapped onto the AMF0 types, with e_amf3 holding the original type.
+   */
+  typedef struct AMFWalkEvent
+  {
+    int e_depth;		/* 0 for top level values */
+    AVal e_name;		/* property name, empty for array items */
+    AMFDataType e_type;
+    int e_amf3;			/* AMF3DataType, or -1 for AMF0 values */
+    double e_number;		/* number, boolean, date, reference index */
+    AVal e_aval;		/* string, or class name of typed objects */
+    int e_count;		/* array length if known */
+    int16_t e_UTCoffset;
+    const char *e_data;		/* AMF0 value, marker included; NULL for AMF3 */
+    int e_size;			/* bytes left in the buffer from e_data */
+  } AMFWalkEvent;
+
+#define AMF_WALK_CONTINUE	0
+#define AMF_WALK_SKIP	1	/* don't report this container's members */
+#define AMF_WALK_STOP	2
+
+  typedef int (AMFWalkFunc)(const AMFWalkEvent *ev, void *ctx);
+
+  /* Returns the bytes consumed up to where the walk ended, or -1 if the
+   * data is malformed. */
+  int AMF_Walk(const char *pBuffer, int nSize, AMFWalkFunc *func, void *ctx);
+
   typedef struct AMF3ClassDef
   {
     AVal cd_name;
@@ -157,6 +243,34 @@ extern "C"
   void AMF3CD_AddProp(AMF3ClassDef * cd, AVal * prop);
   AVal *AMF3CD_GetProp(AMF3ClassDef * cd, int idx);
 
+  /* AMF3 encoder. Within one context, strings and object traits that
+   * were already written are sent as references. They are remembered
+   * by pointer, so the values encoded must stay valid until
+   * AMF3Enc_Reset(), which frees the tables and starts a new context.
+   * To embed AMF3 in AMF0, write an AMF_AVMPLUS marker and then one
+   * value, with a fresh context for each such value.
+   */
+  struct AMF3EncString;
+  struct AMF3EncTraits;
+  typedef struct AMF3Encoder
+  {
+    struct AMF3EncString *en_strings;	/* hash of strings written */
+    unsigned int en_mask;
+    int en_nstrings;
+    struct AMF3EncTraits *en_traits;
+    int en_ntraits;
+  } AMF3Encoder;
+
+  void AMF3Enc_Init(AMF3Encoder * enc);
+  void AMF3Enc_Reset(AMF3Encoder * enc);
+  /* The property name is not written. Objects are sent with sealed
+   * anonymous traits, ECMA and strict arrays as AMF3 arrays. */
+  char *AMF3Prop_Encode(AMF3Encoder * enc, const AMFObjectProperty * prop,
+			char *pBuffer, char *pBufEnd);
+  /* Encode obj as an instance of className, NULL for anonymous */
+  char *AMF3_Encode(AMF3Encoder * enc, const AMFObject * obj,
+		    const AVal * className, char *pBuffer, char *pBufEnd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,9 +27,17 @@
 #include <assert.h>
 #include <ctype.h>
 
+#define RTMP_LOG_NOMACROS	/* the real functions are defined here */
 #include "rtmp_sys.h"
 #include "log.h"
 
+#if !defined(_WIN32) && defined(__GNUC__)
+#define LOG_ASYNC	1
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#endif
+
 #define MAX_PRINT_LEN	2048
 
 RTMP_LogLevel RTMP_debuglevel = RTMP_LOGERROR;
@@ -40,6 +48,15 @@ static FILE *fmsg;
 
 static RTMP_LogCallback rtmp_log_default, *cb = rtmp_log_default;
 
+/* fmsg and neednl are shared with the async writer thread */
+#ifdef LOG_ASYNC
+#define LOCKOUT()	flockfile(fmsg)
+#define UNLOCKOUT()	funlockfile(fmsg)
+#else
+#define LOCKOUT()
+#define UNLOCKOUT()
+#endif
+
 static const char *levels[] = {
   "CRIT", "ERROR", "WARNING", "INFO",
   "DEBUG", "DEBUG2"
@@ -58,6 +75,7 @@ static void rtmp_log_default(int level, const char *format, va_list vl)
 	if ( !fmsg ) fmsg = stderr;
 
 	if ( level <= RTMP_debuglevel ) {
+		LOCKOUT();
 		if (neednl) {
 			putc('\n', fmsg);
 			neednl = 0;
@@ -66,7 +84,299 @@ static void rtmp_log_default(int level, const char *format, va_list vl)
 #ifdef _DEBUG
 		fflush(fmsg);
 #endif
+		UNLOCKOUT();
+	}
+}
+
+#ifdef LOG_ASYNC
+/* Async output: every thread that logs owns a ring of records, which
+ * it fills without locks; the writer thread is the only reader. The
+ * text is formatted by the caller, since %s arguments often point into
+ * buffers that are gone by the time the writer runs, but all stdio
+ * happens on the writer thread.
+ */
+typedef struct LogRec {
+	uint32_t lr_size;	/* whole record; 0 means wrap to the start */
+	int32_t lr_conn;	/* first 8 bytes: fit any gap at the end */
+	int64_t lr_msec;	/* wall clock */
+	int32_t lr_level;
+} LogRec;			/* followed by the text, padded to 8 bytes */
+
+typedef struct LogRing {
+	struct LogRing *lg_next;
+	char *lg_buf;
+	uint32_t lg_size;	/* power of 2 */
+	uint32_t lg_head;	/* advanced by the owner */
+	uint32_t lg_tail;	/* advanced by the writer */
+	uint32_t lg_dropped;	/* records lost to a full ring */
+	uint32_t lg_reported;
+	int lg_owned;		/* 0 once the owning thread exited */
+} LogRing;
+
+static LogRing *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_t writer;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int async_on, async_stop;
+static int writer_idle;		/* writer is, or is about to be, waiting */
+static uint32_t ring_bytes;
+
+static __thread LogRing *my_ring;
+static __thread int my_conn;
+
+static void RingRelease(void *arg)
+{
+	LogRing *lg = arg;
+	__atomic_store_n(&lg->lg_owned, 0, __ATOMIC_RELEASE);
+}
+
+static void RingKeyInit(void)
+{
+	pthread_key_create(&ring_key, RingRelease);
+}
+
+/* Find this thread a ring: reuse one left by an exited thread, or add
+ * a new one. Only done on a thread's first message. */
+static LogRing *RingClaim(void)
+{
+	LogRing *lg;
+
+	pthread_mutex_lock(&rings_lock);
+	for (lg = rings; lg; lg = lg->lg_next)
+		if ( !__atomic_load_n(&lg->lg_owned, __ATOMIC_ACQUIRE) )
+			break;
+	if ( !lg ) {
+		lg = calloc(1, sizeof(LogRing));
+		if ( lg && !(lg->lg_buf = malloc(ring_bytes)) ) {
+			free(lg);
+			lg = NULL;
+		}
+		if ( lg ) {
+			lg->lg_size = ring_bytes;
+			lg->lg_next = rings;
+			__atomic_store_n(&rings, lg, __ATOMIC_RELEASE);
+		}
+	}
+	if ( lg ) {
+		lg->lg_owned = 1;
+		pthread_setspecific(ring_key, lg);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	my_ring = lg;
+	return lg;
+}
+
+static void LogEnqueue(int level, const char *format, va_list vl)
+{
+	char str[MAX_PRINT_LEN];
+	LogRing *lg = my_ring;
+	LogRec *rec;
+	struct timespec ts;
+	uint32_t head, tail, off, need, skip = 0;
+	int len;
+
+	if ( !lg && !(lg = RingClaim()) ) {
+		rtmp_log_default(level, format, vl);
+		return;
+	}
+
+	len = vsnprintf(str, sizeof(str), format, vl);
+	if ( len < 0 )
+		return;
+	if ( len >= (int)sizeof(str) )
+		len = sizeof(str) - 1;
+	/* Filter out 'no-name' */
+	if ( RTMP_debuglevel<RTMP_LOGALL && strstr(str, "no-name" ) != NULL )
+		return;
+
+	need = (sizeof(LogRec) + len + 1 + 7) & ~7U;
+	head = lg->lg_head;
+	tail = __atomic_load_n(&lg->lg_tail, __ATOMIC_ACQUIRE);
+	off = head & (lg->lg_size - 1);
+	if ( lg->lg_size - off < need )
+		skip = lg->lg_size - off;	/* no room before the end */
+	if ( lg->lg_size - (head - tail) < skip + need ) {
+		/* never stall the caller; the writer reports the loss */
+		__atomic_store_n(&lg->lg_dropped, lg->lg_dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if ( skip ) {
+		((LogRec *)(lg->lg_buf + off))->lr_size = 0;
+		off = 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec = (LogRec *)(lg->lg_buf + off);
+	rec->lr_msec = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	rec->lr_size = need;
+	rec->lr_conn = my_conn;
+	rec->lr_level = level;
+	memcpy(rec + 1, str, len + 1);
+	head += skip + need;
+	__atomic_store_n(&lg->lg_head, head, __ATOMIC_SEQ_CST);
+
+	/* Only take the lock to wake an idle writer. The seq_cst pair of
+	 * head store / idle load here and idle store / head load in
+	 * LogWriter means one side always sees the other. */
+	if ( __atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST) ) {
+		pthread_mutex_lock(&wake_lock);
+		__atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+		pthread_cond_signal(&wake_cond);
+		pthread_mutex_unlock(&wake_lock);
+	}
+}
+
+static int RingsPending(void)
+{
+	LogRing *lg;
+
+	for (lg = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); lg; lg = lg->lg_next)
+		if ( __atomic_load_n(&lg->lg_head, __ATOMIC_SEQ_CST) != lg->lg_tail )
+			return 1;
+	return 0;
+}
+
+/* Write out whatever the rings hold; returns the records written */
+static int LogDrain(void)
+{
+	LogRing *lg;
+	int n = 0;
+
+	LOCKOUT();
+	for (lg = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); lg; lg = lg->lg_next) {
+		uint32_t head = __atomic_load_n(&lg->lg_head, __ATOMIC_ACQUIRE);
+		uint32_t tail = lg->lg_tail, dropped;
+
+		while ( tail != head ) {
+			LogRec *rec = (LogRec *)(lg->lg_buf + (tail & (lg->lg_size - 1)));
+			time_t sec;
+			struct tm tm;
+
+			if ( !rec->lr_size ) {
+				tail += lg->lg_size - (tail & (lg->lg_size - 1));
+				continue;
+			}
+			if (neednl) {
+				putc('\n', fmsg);
+				neednl = 0;
+			}
+			sec = rec->lr_msec / 1000;
+			localtime_r(&sec, &tm);
+			if ( rec->lr_conn )
+				fprintf(fmsg, "%02d:%02d:%02d.%03d %s: [%d] %s\n",
+					tm.tm_hour, tm.tm_min, tm.tm_sec,
+					(int)(rec->lr_msec % 1000), levels[rec->lr_level],
+					rec->lr_conn, (char *)(rec + 1));
+			else
+				fprintf(fmsg, "%02d:%02d:%02d.%03d %s: %s\n",
+					tm.tm_hour, tm.tm_min, tm.tm_sec,
+					(int)(rec->lr_msec % 1000), levels[rec->lr_level],
+					(char *)(rec + 1));
+			tail += rec->lr_size;
+			n++;
+		}
+		__atomic_store_n(&lg->lg_tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&lg->lg_dropped, __ATOMIC_RELAXED);
+		if ( dropped != lg->lg_reported ) {
+			fprintf(fmsg, "WARNING: %u log messages dropped\n",
+				dropped - lg->lg_reported);
+			lg->lg_reported = dropped;
+		}
 	}
+	if ( n )
+		fflush(fmsg);
+	UNLOCKOUT();
+	return n;
+}
+
+static void *LogWriter(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		LogDrain();
+		pthread_mutex_lock(&wake_lock);
+		if ( async_stop ) {
+			pthread_mutex_unlock(&wake_lock);
+			break;
+		}
+		__atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+		/* sleep until a logger or RTMP_LogAsyncStop wakes us */
+		if ( !RingsPending() )
+			while ( __atomic_load_n(&writer_idle, __ATOMIC_RELAXED) && !async_stop )
+				pthread_cond_wait(&wake_cond, &wake_lock);
+		__atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&wake_lock);
+	}
+	return NULL;
+}
+#endif
+
+/* Called with fmsg locked: write out the queued records first, so a
+ * direct write doesn't overtake them. */
+static void LogFlushQueued(void)
+{
+#ifdef LOG_ASYNC
+	if ( __atomic_load_n(&async_on, __ATOMIC_ACQUIRE) )
+		LogDrain();
+#endif
+}
+
+int RTMP_LogAsyncStart(int ringSize)
+{
+#ifdef LOG_ASYNC
+	uint32_t size = 4096;
+
+	if ( async_on )
+		return TRUE;
+	if ( ringSize <= 0 )
+		ringSize = 65536;
+	while ( size < (uint32_t)ringSize && size < (1U << 30) )
+		size <<= 1;
+	ring_bytes = size;
+	if ( !fmsg ) fmsg = stderr;
+
+	pthread_once(&ring_once, RingKeyInit);
+	async_stop = 0;
+	__atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+	if ( pthread_create(&writer, NULL, LogWriter, NULL) )
+		return FALSE;
+	__atomic_store_n(&async_on, 1, __ATOMIC_RELEASE);
+	return TRUE;
+#else
+	(void)ringSize;
+	return FALSE;
+#endif
+}
+
+void RTMP_LogAsyncStop(void)
+{
+#ifdef LOG_ASYNC
+	if ( !async_on )
+		return;
+	__atomic_store_n(&async_on, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&wake_lock);
+	async_stop = 1;
+	pthread_cond_signal(&wake_cond);
+	pthread_mutex_unlock(&wake_lock);
+	pthread_join(writer, NULL);
+	/* pick up anything queued after the writer's last pass */
+	LogDrain();
+	/* The rings are kept for a later restart, so a thread still in
+	 * the middle of queueing a message never touches freed memory. */
+#endif
+}
+
+void RTMP_LogSetConnId(int id)
+{
+#ifdef LOG_ASYNC
+	my_conn = id;
+#else
+	(void)id;
+#endif
 }
 
 void RTMP_LogSetOutput(FILE *file)
@@ -97,6 +407,11 @@ void RTMP_Log(int level, const char *format, ...)
 		return;
 
 	va_start(args, format);
+#ifdef LOG_ASYNC
+	if ( cb == rtmp_log_default && __atomic_load_n(&async_on, __ATOMIC_ACQUIRE) )
+		LogEnqueue(level, format, args);
+	else
+#endif
 	cb(level, format, args);
 	va_end(args);
 }
@@ -193,6 +508,8 @@ void RTMP_LogPrintf(const char *format, ...)
 
 	if ( !fmsg ) fmsg = stderr;
 
+	LOCKOUT();
+	LogFlushQueued();
 	if (neednl) {
 		putc('\n', fmsg);
 		neednl = 0;
@@ -203,6 +520,7 @@ void RTMP_LogPrintf(const char *format, ...)
 	fprintf(fmsg, "%s", str);
     if (str[len-1] == '\n')
 		fflush(fmsg);
+	UNLOCKOUT();
 }
 
 void RTMP_LogStatus(const char *format, ...)
@@ -218,7 +536,10 @@ void RTMP_LogStatus(const char *format, ...)
 
 	if ( !fmsg ) fmsg = stderr;
 
+	LOCKOUT();
+	LogFlushQueued();
 	fprintf(fmsg, "%s", str);
 	fflush(fmsg);
 	neednl = 1;
+	UNLOCKOUT();
 }
@@ -62,6 +62,46 @@ void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len);
 void RTMP_LogSetLevel(RTMP_LogLevel lvl);
 RTMP_LogLevel RTMP_LogGetLevel(void);
 
+/* Asynchronous output for multi-threaded programs: with the default
+ * callback, messages are queued in a lock-free ring per thread (of
+ * ringSize bytes, 0 for the default) and written with a timestamp by a
+ * background thread. A thread whose ring is full drops the message
+ * rather than wait; the loss is reported. Returns FALSE if not
+ * supported on this platform. RTMP_LogAsyncStop() writes out what is
+ * queued and goes back to synchronous output.
+ */
+int RTMP_LogAsyncStart(int ringSize);
+void RTMP_LogAsyncStop(void);
+/* Tag this thread's async messages with a connection id, 0 for none */
+void RTMP_LogSetConnId(int id);
+
+/* Most verbose level compiled in; e.g. build with
+ * XDEF=-DRTMP_LOG_MAXLEVEL=RTMP_LOGDEBUG to strip all DEBUG2 output.
+ */
+#ifndef RTMP_LOG_MAXLEVEL
+#define RTMP_LOG_MAXLEVEL	RTMP_LOGALL
+#endif
+
+/* True if a message at level would be printed. Test it before doing
+ * work that is only needed for logging.
+ */
+#define RTMP_LogEnabled(level) \
+	((level) <= RTMP_LOG_MAXLEVEL && (level) <= RTMP_debuglevel)
+
+/* The logging calls check the level first, so their arguments are not
+ * evaluated when the level is off.
+ */
+#ifndef RTMP_LOG_NOMACROS
+#if defined(__GNUC__) || (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
+#define RTMP_Log(level, ...) \
+	do { if (RTMP_LogEnabled(level)) RTMP_Log(level, __VA_ARGS__); } while (0)
+#endif
+#define RTMP_LogHex(level, data, len) \
+	do { if (RTMP_LogEnabled(level)) RTMP_LogHex(level, data, len); } while (0)
+#define RTMP_LogHexString(level, data, len) \
+	do { if (RTMP_LogEnabled(level)) RTMP_LogHexString(level, data, len); } while (0)
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,7 @@
 
 #include "rtmp_sys.h"
 #include "log.h"
+#include "timer.h"
 
 #ifdef CRYPTO
 #ifdef USE_POLARSSL
@@ -108,7 +109,6 @@ typedef enum {
   RTMPT_OPEN=0, RTMPT_SEND, RTMPT_IDLE, RTMPT_CLOSE
 } RTMPTCmd;
 
-static int DumpMetaData(AMFObject *obj);
 static int HandShake(RTMP *r, int FP9HandShake);
 static int SocksNegotiate(RTMP *r);
 
@@ -119,6 +119,7 @@ static int SendDeleteStream(RTMP *r, double dStreamId);
 static int SendFCSubscribe(RTMP *r, AVal *subscribepath);
 static int SendPlay(RTMP *r);
 static int SendBytesReceived(RTMP *r);
+static void CallAdd(RTMP *r, RTMP_NAME id, const AVal *av, int txn);
 static int SendUsherToken(RTMP *r, AVal *usherToken);
 
 #if 0				/* unused */
@@ -159,6 +160,17 @@ RTMP_GetTime()
   return 0;
 #elif defined(_WIN32)
   return timeGetTime();
+#elif defined(CLOCK_MONOTONIC)
+  /* monotonic, and millisecond resolution unlike times() */
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  else
+    {
+      struct tms t;
+      if (!clk_tck) clk_tck = sysconf(_SC_CLK_TCK);
+      return times(&t) * 1000 / clk_tck;
+    }
 #else
   struct tms t;
   if (!clk_tck) clk_tck = sysconf(_SC_CLK_TCK);
@@ -224,6 +236,108 @@ RTMP_LibVersion()
   return RTMP_LIB_VERSION;
 }
 
+#if defined(CRYPTO) && !defined(NO_SSL) && !defined(USE_POLARSSL) && !defined(USE_GNUTLS) \
+    && OPENSSL_VERSION_NUMBER >= 0x10101000L
+/* Client session cache for resumption, keyed by host:port. OpenSSL's
+ * own client cache is not keyed by server, so we keep sessions here
+ * and offer the matching one before each handshake. With TLS 1.3 the
+ * tickets arrive after the handshake, hence the new-session callback.
+ * SSL_SESSION_is_resumable needs OpenSSL 1.1.1; older ones don't resume.
+ */
+#define TLS_SESSION_CACHE	1
+#define TLS_SCACHE_SIZE	32
+
+#ifdef _WIN32
+static CRITICAL_SECTION tls_scache_lock;
+#define TLS_SCACHE_LOCK()	EnterCriticalSection(&tls_scache_lock)
+#define TLS_SCACHE_UNLOCK()	LeaveCriticalSection(&tls_scache_lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t tls_scache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TLS_SCACHE_LOCK()	pthread_mutex_lock(&tls_scache_lock)
+#define TLS_SCACHE_UNLOCK()	pthread_mutex_unlock(&tls_scache_lock)
+#endif
+
+static struct {
+  char key[264];
+  SSL_SESSION *sess;
+  uint32_t used;
+} tls_scache[TLS_SCACHE_SIZE];
+static uint32_t tls_scache_clock;
+static int tls_scache_idx = -1;
+
+static void
+TLS_FreeKey(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+	    long argl, void *argp)
+{
+  free(ptr);
+}
+
+static int
+TLS_NewSession(SSL *ssl, SSL_SESSION *sess)
+{
+  const char *key = SSL_get_ex_data(ssl, tls_scache_idx);
+  int i, slot = 0;
+
+  if (!key || !SSL_SESSION_is_resumable(sess))
+    return 0;
+
+  TLS_SCACHE_LOCK();
+  for (i = 0; i < TLS_SCACHE_SIZE; i++)
+    {
+      if (!strcmp(tls_scache[i].key, key))
+	{
+	  slot = i;
+	  break;
+	}
+      if (tls_scache[i].used < tls_scache[slot].used)
+	slot = i;
+    }
+  if (tls_scache[slot].sess)
+    SSL_SESSION_free(tls_scache[slot].sess);
+  strcpy(tls_scache[slot].key, key);
+  tls_scache[slot].sess = sess;
+  tls_scache[slot].used = ++tls_scache_clock;
+  TLS_SCACHE_UNLOCK();
+  RTMP_Log(RTMP_LOGDEBUG, "%s, cached TLS session for %s", __FUNCTION__, key);
+  return 1;			/* we keep the reference */
+}
+#endif
+
+/* Tag a new client TLS session with its server and, if we have a
+ * cached session for it, ask for resumption. Call between TLS_client
+ * and TLS_connect.
+ */
+void
+RTMP_TLS_Resume(void *ssl, const char *host, int hlen, int port)
+{
+#ifdef TLS_SESSION_CACHE
+  char key[sizeof(tls_scache[0].key)];
+  int i;
+
+  if (!ssl || tls_scache_idx < 0)
+    return;
+  if (hlen > (int)sizeof(key) - 8)
+    hlen = sizeof(key) - 8;
+  snprintf(key, sizeof(key), "%.*s:%d", hlen, host, port);
+  SSL_set_ex_data(ssl, tls_scache_idx, strdup(key));
+
+  TLS_SCACHE_LOCK();
+  for (i = 0; i < TLS_SCACHE_SIZE; i++)
+    {
+      if (tls_scache[i].sess && !strcmp(tls_scache[i].key, key))
+	{
+	  SSL_set_session(ssl, tls_scache[i].sess);
+	  tls_scache[i].used = ++tls_scache_clock;
+	  RTMP_Log(RTMP_LOGDEBUG, "%s, resuming TLS session for %s",
+	      __FUNCTION__, key);
+	  break;
+	}
+    }
+  TLS_SCACHE_UNLOCK();
+#endif
+}
+
 void
 RTMP_TLS_Init()
 {
@@ -251,6 +365,15 @@ RTMP_TLS_Init()
   RTMP_TLS_ctx = SSL_CTX_new(SSLv23_method());
   SSL_CTX_set_options(RTMP_TLS_ctx, SSL_OP_ALL);
   SSL_CTX_set_default_verify_paths(RTMP_TLS_ctx);
+#ifdef TLS_SESSION_CACHE
+#ifdef _WIN32
+  InitializeCriticalSection(&tls_scache_lock);
+#endif
+  tls_scache_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, TLS_FreeKey);
+  SSL_CTX_set_session_cache_mode(RTMP_TLS_ctx,
+    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(RTMP_TLS_ctx, TLS_NewSession);
+#endif
 #endif
 #endif
 }
@@ -595,6 +718,10 @@ static struct urlopt {
         "Publisher username" },
   { AVC("pubPasswd"), OFF(Link.pubPasswd),     OPT_STR, 0,
         "Publisher password" },
+  { AVC("ktls"),      OFF(Link.lFlags),        OPT_BOOL, RTMP_LF_KTLS,
+  	"Use kernel TLS offload for RTMPS if available" },
+  { AVC("tfo"),       OFF(Link.lFlags),        OPT_BOOL, RTMP_LF_TFO,
+  	"Send the handshake in the SYN with TCP Fast Open" },
   { {NULL,0}, 0, 0}
 };
 
@@ -913,6 +1040,18 @@ RTMP_Connect0(RTMP *r, struct sockaddr * service)
   r->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (r->m_sb.sb_socket != -1)
     {
+#ifdef TCP_FASTOPEN_CONNECT
+      /* connect() returns at once and the first write, i.e. C0+C1 (or
+       * the SOCKS/TLS/HTTP request), rides in the SYN if the kernel
+       * holds a TFO cookie for this server; otherwise it is a normal
+       * 3-way handshake.
+       */
+      if ((r->Link.lFlags & RTMP_LF_TFO) &&
+          setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	    (char *) &on, sizeof(on)))
+	RTMP_Log(RTMP_LOGWARNING, "%s, TCP Fast Open not available",
+	    __FUNCTION__);
+#endif
       if (connect(r->m_sb.sb_socket, service, sizeof(struct sockaddr)) < 0)
 	{
 	  int err = GetSockError();
@@ -981,12 +1120,20 @@ RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 #if defined(CRYPTO) && !defined(NO_SSL)
       TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
       TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+      RTMP_TLS_Resume(r->m_sb.sb_ssl, r->Link.hostname.av_val,
+        r->Link.hostname.av_len, r->Link.port);
+      if (r->Link.lFlags & RTMP_LF_KTLS)
+	TLS_ktls_enable(r->m_sb.sb_ssl);
       if (TLS_connect(r->m_sb.sb_ssl) < 0)
 	{
 	  RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed", __FUNCTION__);
 	  RTMP_Close(r);
 	  return FALSE;
 	}
+      if (r->Link.lFlags & RTMP_LF_KTLS)
+	RTMP_Log(RTMP_LOGDEBUG, "%s, kernel TLS: send %s, recv %s", __FUNCTION__,
+	    RTMPSockBuf_KTLS(&r->m_sb) ? "on" : "off",
+	    TLS_ktls_recv(r->m_sb.sb_ssl) ? "on" : "off");
 #else
       RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
       RTMP_Close(r);
@@ -1558,29 +1705,71 @@ WriteN(RTMP *r, const char *buffer, int n)
 
 #define SAVC(x)	static const AVal av_##x = AVC(#x)
 
+/* Invoke templates: the method name and the txn number are laid out at
+ * compile time, followed by the first argument byte (the null command
+ * object, or the connect object). A send copies the template and only
+ * patches in the txn.
+ */
+#define INVOKE2(x,str,next) \
+  static const struct { char s[3]; char n[sizeof(str)-1]; char txn[9]; char next; } \
+    inv_##x = { { AMF_STRING, 0, sizeof(str)-1 }, str, { AMF_NUMBER }, next }
+#define INVOKE(x,next)	INVOKE2(x,#x,next)
+
+#define InvokeStart(enc,x,txn)	InvokeCopy(enc, &inv_##x, sizeof(inv_##x), txn)
+
+static char *
+InvokeCopy(char *enc, const void *tmpl, int len, double txn)
+{
+  memcpy(enc, tmpl, len);
+  /* the txn sits right before the trailing argument byte */
+  AMF_EncodeNumber(enc + len - 10, enc + len, txn);
+  return enc + len;
+}
+
+/* Send an invoke and queue it by name id, without decoding the name
+ * back out of the packet unless it is not a well-known one.
+ */
+static int
+InvokeSend(RTMP *r, RTMPPacket *packet, RTMP_NAME id, int txn)
+{
+  AVal method = { 0, 0 };
+
+  if (!RTMP_SendPacket(r, packet, FALSE))
+    return FALSE;
+  if (id == RTMP_NAME_UNKNOWN)
+    AMF_DecodeString(packet->m_body + 1, &method);
+  CallAdd(r, id, &method, txn);
+  return TRUE;
+}
+
 SAVC(app);
-SAVC(connect);
+INVOKE(connect, AMF_OBJECT);
 SAVC(flashVer);
 SAVC(swfUrl);
 SAVC(pageUrl);
 SAVC(tcUrl);
-SAVC(fpad);
-SAVC(capabilities);
 SAVC(audioCodecs);
 SAVC(videoCodecs);
-SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(secureToken);
-SAVC(secureTokenResponse);
+INVOKE(secureTokenResponse, AMF_NULL);
 SAVC(type);
 SAVC(nonprivate);
 
+/* Constant members of the connect object, pre-encoded */
+static const char conn_fpad_caps[] =
+  "\x00\x04" "fpad" "\x01" "\x00"
+  "\x00\x0c" "capabilities" "\x00" "\x40\x2e\x00\x00\x00\x00\x00\x00";
+static const char conn_videoFunction[] =
+  "\x00\x0d" "videoFunction" "\x00" "\x3f\xf0\x00\x00\x00\x00\x00\x00";
+
 static int
 SendConnectPacket(RTMP *r, RTMPPacket *cp)
 {
   RTMPPacket packet;
   char pbuf[4096], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
 
   if (cp)
     return RTMP_SendPacket(r, cp, TRUE);
@@ -1593,10 +1782,8 @@ SendConnectPacket(RTMP *r, RTMPPacket *cp)
   packet.m_hasAbsTimestamp = 0;
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_connect);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_OBJECT;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(packet.m_body, connect, txn);
 
   enc = AMF_EncodeNamedString(enc, pend, &av_app, &r->Link.app);
   if (!enc)
@@ -1627,21 +1814,20 @@ SendConnectPacket(RTMP *r, RTMPPacket *cp)
     }
   if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
     {
-      enc = AMF_EncodeNamedBoolean(enc, pend, &av_fpad, FALSE);
-      if (!enc)
-	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_capabilities, 15.0);
-      if (!enc)
+      if (enc + sizeof(conn_fpad_caps) - 1 > pend)
 	return FALSE;
+      memcpy(enc, conn_fpad_caps, sizeof(conn_fpad_caps) - 1);
+      enc += sizeof(conn_fpad_caps) - 1;
       enc = AMF_EncodeNamedNumber(enc, pend, &av_audioCodecs, r->m_fAudioCodecs);
       if (!enc)
 	return FALSE;
       enc = AMF_EncodeNamedNumber(enc, pend, &av_videoCodecs, r->m_fVideoCodecs);
       if (!enc)
 	return FALSE;
-      enc = AMF_EncodeNamedNumber(enc, pend, &av_videoFunction, 1.0);
-      if (!enc)
+      if (enc + sizeof(conn_videoFunction) - 1 > pend)
 	return FALSE;
+      memcpy(enc, conn_videoFunction, sizeof(conn_videoFunction) - 1);
+      enc += sizeof(conn_videoFunction) - 1;
       if (r->Link.pageUrl.av_len)
 	{
 	  enc = AMF_EncodeNamedString(enc, pend, &av_pageUrl, &r->Link.pageUrl);
@@ -1683,7 +1869,7 @@ SendConnectPacket(RTMP *r, RTMPPacket *cp)
     }
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_CONNECT, txn);
 }
 
 #if 0				/* unused */
@@ -1719,14 +1905,15 @@ SendBGHasStream(RTMP *r, double dId, AVal *playpath)
 }
 #endif
 
-SAVC(createStream);
+INVOKE(createStream, AMF_NULL);
 
 int
 RTMP_SendCreateStream(RTMP *r)
 {
   RTMPPacket packet;
-  char pbuf[256], *pend = pbuf + sizeof(pbuf);
+  char pbuf[256];
   char *enc;
+  int txn;
 
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
@@ -1737,16 +1924,15 @@ RTMP_SendCreateStream(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_createStream);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;		/* NULL */
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, createStream, txn);
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_CREATESTREAM, txn);
 }
 
-SAVC(FCSubscribe);
+INVOKE(FCSubscribe, AMF_NULL);
 
 static int
 SendFCSubscribe(RTMP *r, AVal *subscribepath)
@@ -1754,6 +1940,7 @@ SendFCSubscribe(RTMP *r, AVal *subscribepath)
   RTMPPacket packet;
   char pbuf[512], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
   packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
@@ -1764,9 +1951,8 @@ SendFCSubscribe(RTMP *r, AVal *subscribepath)
 
   RTMP_Log(RTMP_LOGDEBUG, "FCSubscribe: %s", subscribepath->av_val);
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_FCSubscribe);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, FCSubscribe, txn);
   enc = AMF_EncodeString(enc, pend, subscribepath);
 
   if (!enc)
@@ -1774,11 +1960,11 @@ SendFCSubscribe(RTMP *r, AVal *subscribepath)
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_UNKNOWN, txn);
 }
 
 /* Justin.tv specific authentication */
-static const AVal av_NetStream_Authenticate_UsherToken = AVC("NetStream.Authenticate.UsherToken");
+INVOKE2(usherToken, "NetStream.Authenticate.UsherToken", AMF_NULL);
 
 static int
 SendUsherToken(RTMP *r, AVal *usherToken)
@@ -1796,9 +1982,7 @@ SendUsherToken(RTMP *r, AVal *usherToken)
 
   RTMP_Log(RTMP_LOGDEBUG, "UsherToken: %s", usherToken->av_val);
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_NetStream_Authenticate_UsherToken);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, usherToken, ++r->m_numInvokes);
   enc = AMF_EncodeString(enc, pend, usherToken);
 
   if (!enc)
@@ -1810,7 +1994,7 @@ SendUsherToken(RTMP *r, AVal *usherToken)
 }
 /******************************************/
 
-SAVC(releaseStream);
+INVOKE(releaseStream, AMF_NULL);
 
 static int
 SendReleaseStream(RTMP *r)
@@ -1828,9 +2012,7 @@ SendReleaseStream(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
  enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_releaseStream);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, releaseStream, ++r->m_numInvokes);
   enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
   if (!enc)
     return FALSE;
@@ -1840,7 +2022,7 @@ SendReleaseStream(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(FCPublish);
+INVOKE(FCPublish, AMF_NULL);
 
 static int
 SendFCPublish(RTMP *r)
@@ -1858,9 +2040,7 @@ SendFCPublish(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_FCPublish);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, FCPublish, ++r->m_numInvokes);
   enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
   if (!enc)
     return FALSE;
@@ -1870,7 +2050,7 @@ SendFCPublish(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(FCUnpublish);
+INVOKE(FCUnpublish, AMF_NULL);
 
 static int
 SendFCUnpublish(RTMP *r)
@@ -1888,9 +2068,7 @@ SendFCUnpublish(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, FCUnpublish, ++r->m_numInvokes);
   enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
   if (!enc)
     return FALSE;
@@ -1900,7 +2078,7 @@ SendFCUnpublish(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(publish);
+INVOKE(publish, AMF_NULL);
 SAVC(live);
 SAVC(record);
 
@@ -1910,6 +2088,7 @@ SendPublish(RTMP *r)
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
 
   packet.m_nChannel = 0x04;	/* source channel (invoke) */
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
@@ -1920,9 +2099,8 @@ SendPublish(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_publish);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, publish, txn);
   enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
   if (!enc)
     return FALSE;
@@ -1934,10 +2112,10 @@ SendPublish(RTMP *r)
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_PUBLISH, txn);
 }
 
-SAVC(deleteStream);
+INVOKE(deleteStream, AMF_NULL);
 
 static int
 SendDeleteStream(RTMP *r, double dStreamId)
@@ -1955,9 +2133,7 @@ SendDeleteStream(RTMP *r, double dStreamId)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_deleteStream);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, deleteStream, ++r->m_numInvokes);
   enc = AMF_EncodeNumber(enc, pend, dStreamId);
 
   packet.m_nBodySize = enc - packet.m_body;
@@ -1966,7 +2142,7 @@ SendDeleteStream(RTMP *r, double dStreamId)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(pause);
+INVOKE(pause, AMF_NULL);
 
 int
 RTMP_SendPause(RTMP *r, int DoPause, int iTime)
@@ -1974,6 +2150,7 @@ RTMP_SendPause(RTMP *r, int DoPause, int iTime)
   RTMPPacket packet;
   char pbuf[256], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
 
   packet.m_nChannel = 0x08;	/* video channel */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
@@ -1984,16 +2161,15 @@ RTMP_SendPause(RTMP *r, int DoPause, int iTime)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_pause);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, pause, txn);
   enc = AMF_EncodeBoolean(enc, pend, DoPause);
   enc = AMF_EncodeNumber(enc, pend, (double)iTime);
 
   packet.m_nBodySize = enc - packet.m_body;
 
   RTMP_Log(RTMP_LOGDEBUG, "%s, %d, pauseTime=%d", __FUNCTION__, DoPause, iTime);
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_UNKNOWN, txn);
 }
 
 int RTMP_Pause(RTMP *r, int DoPause)
@@ -2004,7 +2180,7 @@ int RTMP_Pause(RTMP *r, int DoPause)
   return RTMP_SendPause(r, DoPause, r->m_pauseStamp);
 }
 
-SAVC(seek);
+INVOKE(seek, AMF_NULL);
 
 int
 RTMP_SendSeek(RTMP *r, int iTime)
@@ -2012,6 +2188,7 @@ RTMP_SendSeek(RTMP *r, int iTime)
   RTMPPacket packet;
   char pbuf[256], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
 
   packet.m_nChannel = 0x08;	/* video channel */
   packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
@@ -2022,9 +2199,8 @@ RTMP_SendSeek(RTMP *r, int iTime)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_seek);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, seek, txn);
   enc = AMF_EncodeNumber(enc, pend, (double)iTime);
 
   packet.m_nBodySize = enc - packet.m_body;
@@ -2032,7 +2208,7 @@ RTMP_SendSeek(RTMP *r, int iTime)
   r->m_read.flags |= RTMP_READ_SEEKING;
   r->m_read.nResumeTS = 0;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_UNKNOWN, txn);
 }
 
 int
@@ -2099,13 +2275,13 @@ SendBytesReceived(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(_checkbw);
+INVOKE(_checkbw, AMF_NULL);
 
 static int
 SendCheckBW(RTMP *r)
 {
   RTMPPacket packet;
-  char pbuf[256], *pend = pbuf + sizeof(pbuf);
+  char pbuf[256];
   char *enc;
 
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
@@ -2117,9 +2293,7 @@ SendCheckBW(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av__checkbw);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, _checkbw, ++r->m_numInvokes);
 
   packet.m_nBodySize = enc - packet.m_body;
 
@@ -2127,7 +2301,7 @@ SendCheckBW(RTMP *r)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(_result);
+INVOKE(_result, AMF_NULL);
 
 static int
 SendCheckBWResult(RTMP *r, double txn)
@@ -2145,9 +2319,7 @@ SendCheckBWResult(RTMP *r, double txn)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av__result);
-  enc = AMF_EncodeNumber(enc, pend, txn);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, _result, txn);
   enc = AMF_EncodeNumber(enc, pend, (double)r->m_nBWCheckCounter++);
 
   packet.m_nBodySize = enc - packet.m_body;
@@ -2155,14 +2327,13 @@ SendCheckBWResult(RTMP *r, double txn)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(ping);
-SAVC(pong);
+INVOKE(pong, AMF_NULL);
 
 static int
 SendPong(RTMP *r, double txn)
 {
   RTMPPacket packet;
-  char pbuf[256], *pend = pbuf + sizeof(pbuf);
+  char pbuf[256];
   char *enc;
 
   packet.m_nChannel = 0x03;	/* control channel (invoke) */
@@ -2174,16 +2345,14 @@ SendPong(RTMP *r, double txn)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_pong);
-  enc = AMF_EncodeNumber(enc, pend, txn);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, pong, txn);
 
   packet.m_nBodySize = enc - packet.m_body;
 
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-SAVC(play);
+INVOKE(play, AMF_NULL);
 
 static int
 SendPlay(RTMP *r)
@@ -2191,6 +2360,7 @@ SendPlay(RTMP *r)
   RTMPPacket packet;
   char pbuf[1024], *pend = pbuf + sizeof(pbuf);
   char *enc;
+  int txn;
 
   packet.m_nChannel = 0x08;	/* we make 8 our stream channel */
   packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
@@ -2201,9 +2371,8 @@ SendPlay(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_play);
-  enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-  *enc++ = AMF_NULL;
+  txn = ++r->m_numInvokes;
+  enc = InvokeStart(enc, play, txn);
 
   RTMP_Log(RTMP_LOGDEBUG, "%s, seekTime=%d, stopTime=%d, sending play: %s",
       __FUNCTION__, r->Link.seekTime, r->Link.stopTime,
@@ -2247,10 +2416,10 @@ SendPlay(RTMP *r)
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return InvokeSend(r, &packet, RTMP_NAME_PLAY, txn);
 }
 
-SAVC(set_playlist);
+INVOKE(set_playlist, AMF_NULL);
 SAVC(0);
 
 static int
@@ -2269,9 +2438,7 @@ SendPlaylist(RTMP *r)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_set_playlist);
-  enc = AMF_EncodeNumber(enc, pend, 0);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, set_playlist, 0);
   *enc++ = AMF_ECMA_ARRAY;
   *enc++ = 0;
   *enc++ = 0;
@@ -2288,7 +2455,7 @@ SendPlaylist(RTMP *r)
 
   packet.m_nBodySize = enc - packet.m_body;
 
-  return RTMP_SendPacket(r, &packet, TRUE);
+  return RTMP_SendPacket(r, &packet, FALSE);
 }
 
 static int
@@ -2307,9 +2474,7 @@ SendSecureTokenResponse(RTMP *r, AVal *resp)
   packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
   enc = packet.m_body;
-  enc = AMF_EncodeString(enc, pend, &av_secureTokenResponse);
-  enc = AMF_EncodeNumber(enc, pend, 0.0);
-  *enc++ = AMF_NULL;
+  enc = InvokeStart(enc, secureTokenResponse, 0.0);
   enc = AMF_EncodeString(enc, pend, resp);
   if (!enc)
     return FALSE;
@@ -2389,50 +2554,371 @@ RTMP_SendCtrl(RTMP *r, short nType, unsigned int nObject, unsigned int nTime)
   return RTMP_SendPacket(r, &packet, FALSE);
 }
 
+/* The candidate is chosen by length and one character that differs
+ * among names of that length; only that one is compared in full.
+ */
+#define NAMEIS(s, id)	(!memcmp(p, s, sizeof(s) - 1) ? id : RTMP_NAME_UNKNOWN)
+
+RTMP_NAME
+RTMP_NameLookup(const AVal *name)
+{
+  const char *p = name->av_val;
+
+  if (!p)
+    return RTMP_NAME_UNKNOWN;
+
+  switch (name->av_len)
+    {
+    case 4:
+      if (p[1] == 'i')
+	return NAMEIS("ping", RTMP_NAME_PING);
+      return NAMEIS("play", RTMP_NAME_PLAY);
+    case 5:
+      return NAMEIS("close", RTMP_NAME_CLOSE);
+    case 6:
+      return NAMEIS("_error", RTMP_NAME_ERROR);
+    case 7:
+      if (p[0] == '_')
+	return NAMEIS("_result", RTMP_NAME_RESULT);
+      if (p[0] == 'c')
+	return NAMEIS("connect", RTMP_NAME_CONNECT);
+      return NAMEIS("publish", RTMP_NAME_PUBLISH);
+    case 8:
+      if (p[0] == '_')
+	return NAMEIS("_checkbw", RTMP_NAME__CHECKBW);
+      if (p[2] == 'S')
+	return NAMEIS("onStatus", RTMP_NAME_ONSTATUS);
+      return NAMEIS("onBWDone", RTMP_NAME_ONBWDONE);
+    case 9:
+      return NAMEIS("_onbwdone", RTMP_NAME__ONBWDONE);
+    case 10:
+      return NAMEIS("_onbwcheck", RTMP_NAME__ONBWCHECK);
+    case 11:
+      return NAMEIS("closeStream", RTMP_NAME_CLOSESTREAM);
+    case 12:
+      if (p[0] == 'c')
+	return NAMEIS("createStream", RTMP_NAME_CREATESTREAM);
+      if (p[0] == 'd')
+	return NAMEIS("deleteStream", RTMP_NAME_DELETESTREAM);
+      return NAMEIS("set_playlist", RTMP_NAME_SET_PLAYLIST);
+    case 13:
+      return NAMEIS("onFCSubscribe", RTMP_NAME_ONFCSUBSCRIBE);
+    case 14:
+      return NAMEIS("playlist_ready", RTMP_NAME_PLAYLIST_READY);
+    case 15:
+      if (p[0] == 'g')
+	return NAMEIS("getStreamLength", RTMP_NAME_GETSTREAMLENGTH);
+      return NAMEIS("onFCUnsubscribe", RTMP_NAME_ONFCUNSUBSCRIBE);
+    case 16:
+      return NAMEIS("NetStream.Failed", RTMP_NAME_NS_FAILED);
+    case 19:
+      return NAMEIS("NetStream.Play.Stop", RTMP_NAME_NS_PLAY_STOP);
+    case 20:
+      return NAMEIS("NetStream.Play.Start", RTMP_NAME_NS_PLAY_START);
+    case 21:
+      if (p[10] == 'S')
+	return NAMEIS("NetStream.Seek.Notify", RTMP_NAME_NS_SEEK_NOTIFY);
+      return NAMEIS("NetStream.Play.Failed", RTMP_NAME_NS_PLAY_FAILED);
+    case 22:
+      return NAMEIS("NetStream.Pause.Notify", RTMP_NAME_NS_PAUSE_NOTIFY);
+    case 23:
+      if (p[11] == 'u')
+	return NAMEIS("NetStream.Publish.Start", RTMP_NAME_NS_PUBLISH_START);
+      return NAMEIS("NetStream.Play.Complete", RTMP_NAME_NS_PLAY_COMPLETE);
+    case 28:
+      return NAMEIS("NetStream.Play.PublishNotify",
+		    RTMP_NAME_NS_PLAY_PUBLISHNOTIFY);
+    case 29:
+      return NAMEIS("NetStream.Play.StreamNotFound",
+		    RTMP_NAME_NS_PLAY_STREAMNOTFOUND);
+    case 30:
+      if (p[3] == 'C')
+	return NAMEIS("NetConnection.Connect.Rejected",
+		      RTMP_NAME_NC_CONNECT_REJECTED);
+      return NAMEIS("NetStream.Play.UnpublishNotify",
+		    RTMP_NAME_NS_PLAY_UNPUBLISHNOTIFY);
+    case 32:
+      return NAMEIS("NetConnection.Connect.InvalidApp",
+		    RTMP_NAME_NC_CONNECT_INVALIDAPP);
+    case 33:
+      return NAMEIS("NetStream.Authenticate.UsherToken",
+		    RTMP_NAME_USHERTOKEN);
+    }
+  return RTMP_NAME_UNKNOWN;
+}
+
+#undef NAMEIS
+
+/* Indexed by RTMP_NAME */
+static const AVal NameStrings[] = {
+  AVC(""),
+  AVC("_result"),
+  AVC("_error"),
+  AVC("connect"),
+  AVC("close"),
+  AVC("createStream"),
+  AVC("deleteStream"),
+  AVC("closeStream"),
+  AVC("play"),
+  AVC("publish"),
+  AVC("ping"),
+  AVC("onStatus"),
+  AVC("onBWDone"),
+  AVC("onFCSubscribe"),
+  AVC("onFCUnsubscribe"),
+  AVC("_onbwcheck"),
+  AVC("_onbwdone"),
+  AVC("_checkbw"),
+  AVC("set_playlist"),
+  AVC("playlist_ready"),
+  AVC("getStreamLength"),
+  AVC("NetStream.Authenticate.UsherToken"),
+  AVC("NetStream.Failed"),
+  AVC("NetStream.Play.Failed"),
+  AVC("NetStream.Play.StreamNotFound"),
+  AVC("NetStream.Play.Start"),
+  AVC("NetStream.Play.Stop"),
+  AVC("NetStream.Play.Complete"),
+  AVC("NetStream.Play.PublishNotify"),
+  AVC("NetStream.Play.UnpublishNotify"),
+  AVC("NetStream.Publish.Start"),
+  AVC("NetStream.Seek.Notify"),
+  AVC("NetStream.Pause.Notify"),
+  AVC("NetConnection.Connect.InvalidApp"),
+  AVC("NetConnection.Connect.Rejected"),
+};
+
+/* Per-connection state that doesn't fit in RTMP without changing its
+ * layout. r->m_methodCalls points at c_calls, so the public array of
+ * pending remote calls keeps its layout: m_numCalls entries, each with
+ * a malloc'd name. c_slot maps txn & (RTMP_MAX_CALLS-1) to its entry;
+ * a txn whose slot is already taken is found by scanning instead.
+ */
+#define RTMP_MAX_CALLS	64	/* power of 2 */
+
+typedef struct RTMP_PRIV
+{
+  RTMP_METHOD c_calls[RTMP_MAX_CALLS];	/* must be first */
+  RTMP_NAME c_id[RTMP_MAX_CALLS];
+  uint32_t c_sent[RTMP_MAX_CALLS];	/* RTMP_GetTime() when sent */
+  RTMP_TIMER c_timer[RTMP_MAX_CALLS];	/* Link.timeout after c_sent */
+  unsigned char c_slot[RTMP_MAX_CALLS];	/* entry + 1, 0 if none */
+  RTMP_TIMERWHEEL c_wheel;		/* advanced as calls are added */
+  int c_rtt;				/* round trip of last answer, ms */
+
+  /* a packet's chunks, gathered by RTMP_SendPacket; grown as needed */
+  struct iovec *c_iov;
+  int c_niov;
+  char *c_wbuf;				/* copied together for TLS/RTMPE/RTMPT */
+  int c_wsize;
+} RTMP_PRIV;
+
+#define PRIV(r)	((RTMP_PRIV *)(r)->m_methodCalls)
+
+static void CallTimeout(RTMP_TIMER *t, void *arg);
+
+/* r's private state, allocated on first use */
+static RTMP_PRIV *
+PrivGet(RTMP *r)
+{
+  RTMP_PRIV *c;
+  int i;
+
+  if (r->m_methodCalls)
+    return PRIV(r);
+  c = calloc(1, sizeof(RTMP_PRIV));
+  if (!c)
+    return NULL;
+  for (i = 0; i < RTMP_MAX_CALLS; i++)
+    RTMP_TimerInit(&c->c_timer[i], CallTimeout, r);
+  RTMP_TimerWheelInit(&c->c_wheel, RTMP_GetTime());
+  r->m_methodCalls = c->c_calls;
+  r->m_numCalls = 0;
+  return c;
+}
+
 static void
-AV_erase(RTMP_METHOD *vals, int *num, int i, int freeit)
+CallFree(RTMP_METHOD *m)
 {
-  if (freeit)
-    free(vals[i].name.av_val);
-  (*num)--;
-  for (; i < *num; i++)
+  free(m->name.av_val);
+  m->name.av_val = NULL;
+  m->name.av_len = 0;
+  m->num = 0;
+}
+
+/* Take entry i out of the array, moving the last entry into its place */
+static void
+CallRemove(RTMP *r, int i)
+{
+  RTMP_PRIV *c = PRIV(r);
+  int last = --r->m_numCalls;
+  int s = c->c_calls[i].num & (RTMP_MAX_CALLS - 1);
+
+  if (c->c_slot[s] == i + 1)
+    c->c_slot[s] = 0;
+  RTMP_TimerCancel(&c->c_wheel, &c->c_timer[i]);
+  if (i != last)
+    {
+      c->c_calls[i] = c->c_calls[last];
+      c->c_id[i] = c->c_id[last];
+      c->c_sent[i] = c->c_sent[last];
+      s = c->c_calls[i].num & (RTMP_MAX_CALLS - 1);
+      if (c->c_slot[s] == last + 1)
+	c->c_slot[s] = i + 1;
+      /* the timer goes with the entry, due when it was */
+      if (RTMP_TimerPending(&c->c_timer[last]))
+	{
+	  int32_t left = c->c_timer[last].t_expire - c->c_wheel.tw_now;
+	  RTMP_TimerCancel(&c->c_wheel, &c->c_timer[last]);
+	  RTMP_TimerSet(&c->c_wheel, &c->c_timer[i], left > 0 ? left : 0);
+	}
+    }
+  c->c_calls[last].name.av_val = NULL;
+  c->c_calls[last].name.av_len = 0;
+  c->c_calls[last].num = 0;
+}
+
+static void
+CallDrop(RTMP *r, int i, const char *why)
+{
+  RTMP_METHOD *m = &r->m_methodCalls[i];
+
+  RTMP_Log(RTMP_LOGWARNING, "%s, dropping call <%.*s> txn %d: %s",
+      __FUNCTION__, m->name.av_len, m->name.av_val, m->num, why);
+  free(m->name.av_val);
+  CallRemove(r, i);
+}
+
+static int
+CallFind(RTMP *r, int txn)
+{
+  RTMP_PRIV *c = PRIV(r);
+  int i = c->c_slot[txn & (RTMP_MAX_CALLS - 1)] - 1;
+
+  if (i >= 0 && c->c_calls[i].num == txn)
+    return i;
+  for (i = 0; i < r->m_numCalls; i++)
+    if (c->c_calls[i].num == txn)
+      return i;
+  return -1;
+}
+
+static void
+CallTimeout(RTMP_TIMER *t, void *arg)
+{
+  RTMP *r = arg;
+
+  CallDrop(r, t - PRIV(r)->c_timer, "timed out");
+}
+
+/* av is only used when id is RTMP_NAME_UNKNOWN */
+static void
+CallAdd(RTMP *r, RTMP_NAME id, const AVal *av, int txn)
+{
+  RTMP_PRIV *c;
+  uint32_t now;
+  int i, s, timeout = r->Link.timeout * 1000;
+
+  /* txn 0 means no reply is expected */
+  if (!txn)
+    return;
+  now = RTMP_GetTime();
+  if (!(c = PrivGet(r)))
+    return;
+  RTMP_TimerAdvance(&c->c_wheel, now);
+
+  if (r->m_numCalls == RTMP_MAX_CALLS)
     {
-      vals[i] = vals[i + 1];
+      int oldest = 0;
+      for (i = 1; i < r->m_numCalls; i++)
+	{
+	  int32_t d = c->c_sent[i] - c->c_sent[oldest];
+	  if (d < 0 || (!d && c->c_calls[i].num < c->c_calls[oldest].num))
+	    oldest = i;
+	}
+      CallDrop(r, oldest, "too many calls pending");
     }
-  vals[i].name.av_val = NULL;
-  vals[i].name.av_len = 0;
-  vals[i].num = 0;
+
+  if (id != RTMP_NAME_UNKNOWN)
+    av = &NameStrings[id];
+  i = r->m_numCalls;
+  c->c_calls[i].name.av_val = malloc(av->av_len + 1);
+  if (!c->c_calls[i].name.av_val)
+    return;
+  memcpy(c->c_calls[i].name.av_val, av->av_val, av->av_len);
+  c->c_calls[i].name.av_val[av->av_len] = '\0';
+  c->c_calls[i].name.av_len = av->av_len;
+  c->c_calls[i].num = txn;
+  c->c_id[i] = id;
+  c->c_sent[i] = now;
+  if (timeout > 0)
+    RTMP_TimerSet(&c->c_wheel, &c->c_timer[i], timeout);
+  s = txn & (RTMP_MAX_CALLS - 1);
+  if (!c->c_slot[s])
+    c->c_slot[s] = i + 1;
+  r->m_numCalls++;
 }
 
-void
-RTMP_DropRequest(RTMP *r, int i, int freeit)
+/* Remove the call answered by txn into *out; release it with CallFree */
+static int
+CallTake(RTMP *r, int txn, RTMP_METHOD *out, RTMP_NAME *id)
 {
-  AV_erase(r->m_methodCalls, &r->m_numCalls, i, freeit);
+  RTMP_PRIV *c = PRIV(r);
+  int i;
+
+  if (!txn || !r->m_numCalls)
+    return FALSE;
+  i = CallFind(r, txn);
+  if (i < 0)
+    return FALSE;
+  *out = c->c_calls[i];
+  *id = c->c_id[i];
+  c->c_rtt = RTMP_GetTime() - c->c_sent[i];
+  CallRemove(r, i);
+  return TRUE;
 }
 
+/* Forget a pending call answered by onStatus rather than _result */
 static void
-AV_queue(RTMP_METHOD **vals, int *num, AVal *av, int txn)
+CallDropName(RTMP *r, RTMP_NAME id)
 {
-  char *tmp;
-  if (!(*num & 0x0f))
-    *vals = realloc(*vals, (*num + 16) * sizeof(RTMP_METHOD));
-  tmp = malloc(av->av_len + 1);
-  memcpy(tmp, av->av_val, av->av_len);
-  tmp[av->av_len] = '\0';
-  (*vals)[*num].num = txn;
-  (*vals)[*num].name.av_len = av->av_len;
-  (*vals)[(*num)++].name.av_val = tmp;
+  int i;
+  for (i = 0; i < r->m_numCalls; i++)
+    {
+      if (PRIV(r)->c_id[i] == id)
+	{
+	  free(r->m_methodCalls[i].name.av_val);
+	  CallRemove(r, i);
+	  break;
+	}
+    }
 }
 
 static void
-AV_clear(RTMP_METHOD *vals, int num)
+PrivFree(RTMP *r)
 {
   int i;
-  for (i = 0; i < num; i++)
-    free(vals[i].name.av_val);
-  free(vals);
+  if (r->m_methodCalls)
+    {
+      for (i = 0; i < r->m_numCalls; i++)
+	free(r->m_methodCalls[i].name.av_val);
+      free(PRIV(r)->c_iov);
+      free(PRIV(r)->c_wbuf);
+      free(PRIV(r));
+    }
+  r->m_methodCalls = NULL;
+  r->m_numCalls = 0;
 }
 
+void
+RTMP_DropRequest(RTMP *r, int i, int freeit)
+{
+  if (i < 0 || i >= r->m_numCalls)
+    return;
+  if (freeit)
+    free(r->m_methodCalls[i].name.av_val);
+  CallRemove(r, i);
+}
 
 #ifdef CRYPTO
 static int
@@ -2876,45 +3362,75 @@ PublisherAuth(RTMP *r, AVal *description)
 #endif
 
 
-SAVC(onBWDone);
-SAVC(onFCSubscribe);
-SAVC(onFCUnsubscribe);
-SAVC(_onbwcheck);
-SAVC(_onbwdone);
-SAVC(_error);
-SAVC(close);
 SAVC(code);
-SAVC(level);
 SAVC(description);
-SAVC(onStatus);
-SAVC(playlist_ready);
-static const AVal av_NetStream_Failed = AVC("NetStream.Failed");
-static const AVal av_NetStream_Play_Failed = AVC("NetStream.Play.Failed");
-static const AVal av_NetStream_Play_StreamNotFound =
-AVC("NetStream.Play.StreamNotFound");
-static const AVal av_NetConnection_Connect_InvalidApp =
-AVC("NetConnection.Connect.InvalidApp");
-static const AVal av_NetStream_Play_Start = AVC("NetStream.Play.Start");
-static const AVal av_NetStream_Play_Complete = AVC("NetStream.Play.Complete");
-static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
-static const AVal av_NetStream_Seek_Notify = AVC("NetStream.Seek.Notify");
-static const AVal av_NetStream_Pause_Notify = AVC("NetStream.Pause.Notify");
-static const AVal av_NetStream_Play_PublishNotify =
-AVC("NetStream.Play.PublishNotify");
-static const AVal av_NetStream_Play_UnpublishNotify =
-AVC("NetStream.Play.UnpublishNotify");
-static const AVal av_NetStream_Publish_Start = AVC("NetStream.Publish.Start");
-static const AVal av_NetConnection_Connect_Rejected =
-AVC("NetConnection.Connect.Rejected");
+
+/* What HandleInvoke() needs from an invoke: the method, the txn id and
+ * the fourth value, which is the stream id of a createStream result or
+ * the info object of onStatus and _error. Read with AMF_Walk() so most
+ * invokes never build an AMFObject.
+ */
+typedef struct InvokeWalk
+{
+  int iw_n;			/* top level values seen */
+  AVal iw_method;
+  double iw_txn;
+  double iw_arg;		/* fourth value, if a number */
+  AVal iw_code;			/* members of the fourth value, if an object */
+  AVal iw_description;
+} InvokeWalk;
+
+static int
+WalkInvoke(const AMFWalkEvent *ev, void *ctx)
+{
+  InvokeWalk *w = ctx;
+
+  if (ev->e_depth == 0)
+    {
+      if (ev->e_type == AMF_OBJECT_END)
+	return w->iw_n == 4 ? AMF_WALK_STOP : AMF_WALK_CONTINUE;
+      switch (w->iw_n++)
+	{
+	case 0:
+	  if (ev->e_type != AMF_STRING)
+	    return AMF_WALK_STOP;
+	  w->iw_method = ev->e_aval;
+	  return AMF_WALK_CONTINUE;
+	case 1:
+	  if (ev->e_type == AMF_NUMBER)
+	    w->iw_txn = ev->e_number;
+	  return AMF_WALK_CONTINUE;
+	case 2:
+	  return AMF_WALK_SKIP;
+	default:
+	  if (ev->e_type == AMF_OBJECT || ev->e_type == AMF_ECMA_ARRAY)
+	    return AMF_WALK_CONTINUE;
+	  if (ev->e_type == AMF_NUMBER)
+	    w->iw_arg = ev->e_number;
+	  return AMF_WALK_STOP;
+	}
+    }
+  if (w->iw_n < 4 || ev->e_depth > 1 || ev->e_type == AMF_OBJECT_END)
+    return AMF_WALK_CONTINUE;
+  if (ev->e_type != AMF_STRING)
+    return AMF_WALK_SKIP;
+  /* the first member so named, like AMF_GetProp() */
+  if (!w->iw_code.av_val && AVMATCH(&ev->e_name, &av_code))
+    w->iw_code = ev->e_aval;
+  else if (!w->iw_description.av_val
+	   && AVMATCH(&ev->e_name, &av_description))
+    w->iw_description = ev->e_aval;
+  return AMF_WALK_CONTINUE;
+}
 
 /* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete' */
 static int
 HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 {
-  AMFObject obj;
-  AVal method;
+  InvokeWalk w;
+  RTMP_NAME id;
   double txn;
-  int ret = 0, nRes;
+  int ret = 0;
   if (body[0] != 0x02)		/* make sure it is a string method name we start with */
     {
       RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet",
@@ -2922,48 +3438,56 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
       return 0;
     }
 
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
+  memset(&w, 0, sizeof(w));
+  if (AMF_Walk(body, nBodySize, WalkInvoke, &w) < 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%s>", __FUNCTION__, method.av_val);
+  if (RTMP_LogEnabled(RTMP_LOGDEBUG))
+    {
+      AMFObject obj;
+      if (AMF_Decode(&obj, body, nBodySize, FALSE) >= 0)
+	{
+	  AMF_Dump(&obj);
+	  AMF_Reset(&obj);
+	}
+    }
+  txn = w.iw_txn;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%.*s>", __FUNCTION__,
+      w.iw_method.av_len, w.iw_method.av_val);
+  id = RTMP_NameLookup(&w.iw_method);
 
-  if (AVMATCH(&method, &av__result))
+  if (id == RTMP_NAME_RESULT)
     {
-      AVal methodInvoked = {0};
-      int i;
+      RTMP_METHOD call;
+      RTMP_NAME invoked;
 
-      for (i=0; i<r->m_numCalls; i++) {
-	if (r->m_methodCalls[i].num == (int)txn) {
-	  methodInvoked = r->m_methodCalls[i].name;
-	  AV_erase(r->m_methodCalls, &r->m_numCalls, i, FALSE);
-	  break;
-	}
-      }
-      if (!methodInvoked.av_val) {
+      if (!CallTake(r, (int)txn, &call, &invoked)) {
         RTMP_Log(RTMP_LOGDEBUG, "%s, received result id %f without matching request",
 	  __FUNCTION__, txn);
 	goto leave;
       }
 
-      RTMP_Log(RTMP_LOGDEBUG, "%s, received result for method call <%s>", __FUNCTION__,
-	  methodInvoked.av_val);
+      RTMP_Log(RTMP_LOGDEBUG, "%s, received result for method call <%s> after %d ms",
+	  __FUNCTION__, call.name.av_val, PRIV(r)->c_rtt);
 
-      if (AVMATCH(&methodInvoked, &av_connect))
+      if (invoked == RTMP_NAME_CONNECT)
 	{
 	  if (r->Link.token.av_len)
 	    {
+	      /* the token may sit anywhere in the reply, search the tree */
+	      AMFObject obj;
 	      AMFObjectProperty p;
-	      if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+	      if (AMF_Decode(&obj, body, nBodySize, FALSE) >= 0)
 		{
-		  DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
-		  SendSecureTokenResponse(r, &p.p_vu.p_aval);
+		  if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+		    {
+		      DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
+		      SendSecureTokenResponse(r, &p.p_vu.p_aval);
+		    }
+		  AMF_Reset(&obj);
 		}
 	    }
 	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
@@ -2990,9 +3514,9 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	        SendFCSubscribe(r, &r->Link.playpath);
 	    }
 	}
-      else if (AVMATCH(&methodInvoked, &av_createStream))
+      else if (invoked == RTMP_NAME_CREATESTREAM)
 	{
-	  r->m_stream_id = (int)AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+	  r->m_stream_id = (int)w.iw_arg;
 
 	  if (r->Link.protocol & RTMP_FEATURE_WRITE)
 	    {
@@ -3006,63 +3530,48 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	      RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
 	    }
 	}
-      else if (AVMATCH(&methodInvoked, &av_play) ||
-      	AVMATCH(&methodInvoked, &av_publish))
+      else if (invoked == RTMP_NAME_PLAY ||
+      	invoked == RTMP_NAME_PUBLISH)
 	{
 	  r->m_bPlaying = TRUE;
 	}
-      free(methodInvoked.av_val);
+      CallFree(&call);
     }
-  else if (AVMATCH(&method, &av_onBWDone))
+  else if (id == RTMP_NAME_ONBWDONE)
     {
 	  if (!r->m_nBWCheckCounter)
         SendCheckBW(r);
     }
-  else if (AVMATCH(&method, &av_onFCSubscribe))
+  else if (id == RTMP_NAME_ONFCSUBSCRIBE)
     {
       /* SendOnFCSubscribe(); */
     }
-  else if (AVMATCH(&method, &av_onFCUnsubscribe))
+  else if (id == RTMP_NAME_ONFCUNSUBSCRIBE)
     {
       RTMP_Close(r);
       ret = 1;
     }
-  else if (AVMATCH(&method, &av_ping))
+  else if (id == RTMP_NAME_PING)
     {
       SendPong(r, txn);
     }
-  else if (AVMATCH(&method, &av__onbwcheck))
+  else if (id == RTMP_NAME__ONBWCHECK)
     {
       SendCheckBWResult(r, txn);
     }
-  else if (AVMATCH(&method, &av__onbwdone))
+  else if (id == RTMP_NAME__ONBWDONE)
     {
-      int i;
-      for (i = 0; i < r->m_numCalls; i++)
-	if (AVMATCH(&r->m_methodCalls[i].name, &av__checkbw))
-	  {
-	    AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-	    break;
-	  }
+      CallDropName(r, RTMP_NAME__CHECKBW);
     }
-  else if (AVMATCH(&method, &av__error))
+  else if (id == RTMP_NAME_ERROR)
     {
 #ifdef CRYPTO
-      AVal methodInvoked = {0};
-      int i;
+      RTMP_METHOD call = {{0}};
+      RTMP_NAME invoked;
 
       if (r->Link.protocol & RTMP_FEATURE_WRITE)
         {
-          for (i=0; i<r->m_numCalls; i++)
-            {
-              if (r->m_methodCalls[i].num == txn)
-                {
-                  methodInvoked = r->m_methodCalls[i].name;
-                  AV_erase(r->m_methodCalls, &r->m_numCalls, i, FALSE);
-                  break;
-                }
-            }
-          if (!methodInvoked.av_val)
+          if (!CallTake(r, (int)txn, &call, &invoked))
             {
               RTMP_Log(RTMP_LOGDEBUG, "%s, received result id %f without matching request",
                     __FUNCTION__, txn);
@@ -3070,17 +3579,13 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
             }
 
           RTMP_Log(RTMP_LOGDEBUG, "%s, received error for method call <%s>", __FUNCTION__,
-          methodInvoked.av_val);
+          call.name.av_val);
 
-          if (AVMATCH(&methodInvoked, &av_connect))
+          if (invoked == RTMP_NAME_CONNECT)
             {
-              AMFObject obj2;
-              AVal code, level, description;
-              AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
-              AMFProp_GetString(AMF_GetProp(&obj2, &av_description, -1), &description);
-              RTMP_Log(RTMP_LOGDEBUG, "%s, error description: %s", __FUNCTION__, description.av_val);
+              AVal description = w.iw_description;
+              RTMP_Log(RTMP_LOGDEBUG, "%s, error description: %.*s", __FUNCTION__,
+                    description.av_len, description.av_val);
               /* if PublisherAuth returns 1, then reconnect */
               if (PublisherAuth(r, &description) == 1)
               {
@@ -3094,79 +3599,63 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
         {
           RTMP_Log(RTMP_LOGERROR, "rtmp server sent error");
         }
-      free(methodInvoked.av_val);
+      CallFree(&call);
 #else
       RTMP_Log(RTMP_LOGERROR, "rtmp server sent error");
 #endif
     }
-  else if (AVMATCH(&method, &av_close))
+  else if (id == RTMP_NAME_CLOSE)
     {
       RTMP_Log(RTMP_LOGERROR, "rtmp server requested close");
       RTMP_Close(r);
     }
-  else if (AVMATCH(&method, &av_onStatus))
+  else if (id == RTMP_NAME_ONSTATUS)
     {
-      AMFObject obj2;
-      AVal code, level;
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
+      AVal code = w.iw_code;
+      RTMP_NAME status;
 
-      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
-      if (AVMATCH(&code, &av_NetStream_Failed)
-	  || AVMATCH(&code, &av_NetStream_Play_Failed)
-	  || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
-	  || AVMATCH(&code, &av_NetConnection_Connect_InvalidApp))
+      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %.*s", __FUNCTION__,
+	  code.av_len, code.av_val);
+      status = RTMP_NameLookup(&code);
+      if (status == RTMP_NAME_NS_FAILED
+	  || status == RTMP_NAME_NS_PLAY_FAILED
+	  || status == RTMP_NAME_NS_PLAY_STREAMNOTFOUND
+	  || status == RTMP_NAME_NC_CONNECT_INVALIDAPP)
 	{
 	  r->m_stream_id = -1;
 	  RTMP_Close(r);
-	  RTMP_Log(RTMP_LOGERROR, "Closing connection: %s", code.av_val);
+	  RTMP_Log(RTMP_LOGERROR, "Closing connection: %.*s", code.av_len,
+	      code.av_val);
 	}
 
-      else if (AVMATCH(&code, &av_NetStream_Play_Start)
-           || AVMATCH(&code, &av_NetStream_Play_PublishNotify))
+      else if (status == RTMP_NAME_NS_PLAY_START
+           || status == RTMP_NAME_NS_PLAY_PUBLISHNOTIFY)
 	{
-	  int i;
 	  r->m_bPlaying = TRUE;
-	  for (i = 0; i < r->m_numCalls; i++)
-	    {
-	      if (AVMATCH(&r->m_methodCalls[i].name, &av_play))
-		{
-		  AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-		  break;
-		}
-	    }
+	  CallDropName(r, RTMP_NAME_PLAY);
 	}
 
-      else if (AVMATCH(&code, &av_NetStream_Publish_Start))
+      else if (status == RTMP_NAME_NS_PUBLISH_START)
 	{
-	  int i;
 	  r->m_bPlaying = TRUE;
-	  for (i = 0; i < r->m_numCalls; i++)
-	    {
-	      if (AVMATCH(&r->m_methodCalls[i].name, &av_publish))
-		{
-		  AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-		  break;
-		}
-	    }
+	  CallDropName(r, RTMP_NAME_PUBLISH);
 	}
 
       /* Return 1 if this is a Play.Complete or Play.Stop */
-      else if (AVMATCH(&code, &av_NetStream_Play_Complete)
-	  || AVMATCH(&code, &av_NetStream_Play_Stop)
-	  || AVMATCH(&code, &av_NetStream_Play_UnpublishNotify))
+      else if (status == RTMP_NAME_NS_PLAY_COMPLETE
+	  || status == RTMP_NAME_NS_PLAY_STOP
+	  || status == RTMP_NAME_NS_PLAY_UNPUBLISHNOTIFY)
 	{
 	  RTMP_Close(r);
 	  ret = 1;
 	}
 
-      else if (AVMATCH(&code, &av_NetStream_Seek_Notify))
+      else if (status == RTMP_NAME_NS_SEEK_NOTIFY)
         {
 	  r->m_read.flags &= ~RTMP_READ_SEEKING;
 	}
 
-      else if (AVMATCH(&code, &av_NetStream_Pause_Notify))
+      else if (status == RTMP_NAME_NS_PAUSE_NOTIFY)
         {
 	  if (r->m_pausing == 1 || r->m_pausing == 2)
 	  {
@@ -3175,24 +3664,15 @@ HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 	  }
 	}
     }
-  else if (AVMATCH(&method, &av_playlist_ready))
+  else if (id == RTMP_NAME_PLAYLIST_READY)
     {
-      int i;
-      for (i = 0; i < r->m_numCalls; i++)
-        {
-          if (AVMATCH(&r->m_methodCalls[i].name, &av_set_playlist))
-	    {
-	      AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-	      break;
-	    }
-        }
+      CallDropName(r, RTMP_NAME_SET_PLAYLIST);
     }
   else
     {
 
     }
 leave:
-  AMF_Reset(&obj);
   return ret;
 }
 
@@ -3247,98 +3727,131 @@ RTMP_FindPrefixProperty(AMFObject *obj, const AVal *name,
   return FALSE;
 }
 
+SAVC(onMetaData);
+SAVC(duration);
+SAVC(video);
+SAVC(audio);
+
+/* State for walking an onMetaData message. The hide depths mark the
+ * container whose members the duration and video/audio searches don't
+ * look into, matching RTMP_FindFirstMatchingProperty() and
+ * RTMP_FindPrefixProperty(); -1 when searching.
+ */
+typedef struct MetaWalk
+{
+  int mw_ok;			/* first value was onMetaData */
+  int mw_durHide;
+  int mw_preHide;
+  int mw_gotDur;
+  double mw_duration;
+  int mw_dataType;
+} MetaWalk;
+
 static int
-DumpMetaData(AMFObject *obj)
+WalkMetaData(const AMFWalkEvent *ev, void *ctx)
 {
-  AMFObjectProperty *prop;
-  int n, len;
-  for (n = 0; n < obj->o_num; n++)
+  MetaWalk *m = ctx;
+  const AVal *name = &ev->e_name;
+  char str[256] = "";
+  int len;
+
+  if (ev->e_type == AMF_OBJECT_END)
     {
-      char str[256] = "";
-      prop = AMF_GetProp(obj, NULL, n);
-      switch (prop->p_type)
-	{
-	case AMF_OBJECT:
-	case AMF_ECMA_ARRAY:
-	case AMF_STRICT_ARRAY:
-	  if (prop->p_name.av_len)
-	    RTMP_Log(RTMP_LOGINFO, "%.*s:", prop->p_name.av_len, prop->p_name.av_val);
-	  DumpMetaData(&prop->p_vu.p_object);
-	  break;
-	case AMF_NUMBER:
-	  snprintf(str, 255, "%.2f", prop->p_vu.p_number);
-	  break;
-	case AMF_BOOLEAN:
-	  snprintf(str, 255, "%s",
-		   prop->p_vu.p_number != 0. ? "TRUE" : "FALSE");
-	  break;
-	case AMF_STRING:
-	  len = snprintf(str, 255, "%.*s", prop->p_vu.p_aval.av_len,
-		   prop->p_vu.p_aval.av_val);
-	  if (len >= 1 && str[len-1] == '\n')
-	    str[len-1] = '\0';
-	  break;
-	case AMF_DATE:
-	  snprintf(str, 255, "timestamp:%.2f", prop->p_vu.p_number);
-	  break;
-	default:
-	  snprintf(str, 255, "INVALID TYPE 0x%02x",
-		   (unsigned char)prop->p_type);
-	}
-      if (str[0] && prop->p_name.av_len)
-	{
-	  RTMP_Log(RTMP_LOGINFO, "  %-22.*s%s", prop->p_name.av_len,
-		    prop->p_name.av_val, str);
-	}
+      if (ev->e_depth == m->mw_durHide)
+	m->mw_durHide = -1;
+      if (ev->e_depth == m->mw_preHide)
+	m->mw_preHide = -1;
+      return AMF_WALK_CONTINUE;
+    }
+  if (!m->mw_ok)
+    {
+      if (ev->e_type != AMF_STRING || !AVMATCH(&ev->e_aval, &av_onMetaData))
+	return AMF_WALK_STOP;
+      m->mw_ok = TRUE;
+      /* Show metadata */
+      RTMP_Log(RTMP_LOGINFO, "Metadata:");
+      return AMF_WALK_CONTINUE;
     }
-  return FALSE;
-}
 
-SAVC(onMetaData);
-SAVC(duration);
-SAVC(video);
-SAVC(audio);
+  /* keep duration or filesize to make a nice progress bar */
+  if (m->mw_durHide < 0 && !m->mw_gotDur && AVMATCH(name, &av_duration))
+    {
+      m->mw_duration = ev->e_number;
+      m->mw_gotDur = TRUE;
+    }
+  /* Search for audio or video tags */
+  if (m->mw_preHide < 0)
+    {
+      if (name->av_len > av_video.av_len &&
+	  !memcmp(name->av_val, av_video.av_val, av_video.av_len))
+	m->mw_dataType |= 1;
+      if (name->av_len > av_audio.av_len &&
+	  !memcmp(name->av_val, av_audio.av_val, av_audio.av_len))
+	m->mw_dataType |= 4;
+    }
+
+  switch (ev->e_type)
+    {
+    case AMF_OBJECT:
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+      if (name->av_len)
+	RTMP_Log(RTMP_LOGINFO, "%.*s:", name->av_len, name->av_val);
+      if (m->mw_durHide < 0 && ev->e_type == AMF_STRICT_ARRAY)
+	m->mw_durHide = ev->e_depth;
+      if (m->mw_preHide < 0 && ev->e_type != AMF_OBJECT)
+	m->mw_preHide = ev->e_depth;
+      return AMF_WALK_CONTINUE;
+    case AMF_NUMBER:
+      snprintf(str, 255, "%.2f", ev->e_number);
+      break;
+    case AMF_BOOLEAN:
+      snprintf(str, 255, "%s", ev->e_number != 0. ? "TRUE" : "FALSE");
+      break;
+    case AMF_STRING:
+      len = snprintf(str, 255, "%.*s", ev->e_aval.av_len, ev->e_aval.av_val);
+      if (len >= 1 && str[len-1] == '\n')
+	str[len-1] = '\0';
+      break;
+    case AMF_DATE:
+      snprintf(str, 255, "timestamp:%.2f", ev->e_number);
+      break;
+    default:
+      snprintf(str, 255, "INVALID TYPE 0x%02x", (unsigned char)ev->e_type);
+    }
+  if (str[0] && name->av_len)
+    {
+      RTMP_Log(RTMP_LOGINFO, "  %-22.*s%s", name->av_len, name->av_val, str);
+    }
+  return AMF_WALK_CONTINUE;
+}
 
 static int
 HandleMetadata(RTMP *r, char *body, unsigned int len)
 {
   /* allright we get some info here, so parse it and print it */
-  /* also keep duration or filesize to make a nice progress bar */
+  /* keyframe index arrays can hold thousands of entries; walk them
+   * instead of building the whole tree */
+  MetaWalk m;
 
-  AMFObject obj;
-  AVal metastring;
-  int ret = FALSE;
-
-  int nRes = AMF_Decode(&obj, body, len, FALSE);
-  if (nRes < 0)
+  memset(&m, 0, sizeof(m));
+  m.mw_durHide = -1;
+  m.mw_preHide = -1;
+  if (AMF_Walk(body, len, WalkMetaData, &m) < 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
       return FALSE;
     }
+  if (!m.mw_ok)
+    return FALSE;
 
-  AMF_Dump(&obj);
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &metastring);
-
-  if (AVMATCH(&metastring, &av_onMetaData))
+  if (m.mw_gotDur)
     {
-      AMFObjectProperty prop;
-      /* Show metadata */
-      RTMP_Log(RTMP_LOGINFO, "Metadata:");
-      DumpMetaData(&obj);
-      if (RTMP_FindFirstMatchingProperty(&obj, &av_duration, &prop))
-	{
-	  r->m_fDuration = prop.p_vu.p_number;
-	  /*RTMP_Log(RTMP_LOGDEBUG, "Set duration: %.2f", m_fDuration); */
-	}
-      /* Search for audio or video tags */
-      if (RTMP_FindPrefixProperty(&obj, &av_video, &prop))
-        r->m_read.dataType |= 1;
-      if (RTMP_FindPrefixProperty(&obj, &av_audio, &prop))
-        r->m_read.dataType |= 4;
-      ret = TRUE;
-    }
-  AMF_Reset(&obj);
-  return ret;
+      r->m_fDuration = m.mw_duration;
+      /*RTMP_Log(RTMP_LOGDEBUG, "Set duration: %.2f", m_fDuration); */
+    }
+  r->m_read.dataType |= m.mw_dataType;
+  return TRUE;
 }
 
 static void
@@ -3892,6 +4405,81 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
   return wrote;
 }
 
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
+/* Write the cnt parts in iov, which may be changed. A plain socket takes
+ * them with writev(); TLS, RTMPE and RTMPT need them in one buffer.
+ */
+static int
+WriteV(RTMP *r, struct iovec *iov, int cnt)
+{
+  RTMP_PRIV *c;
+  char *ptr;
+  int i, len = 0;
+
+#ifndef _WIN32
+  if (!r->m_sb.sb_ssl && !(r->Link.protocol & RTMP_FEATURE_HTTP)
+#ifdef CRYPTO
+      && !r->Link.rc4keyOut
+#endif
+      )
+    {
+#ifdef _DEBUG
+      for (i = 0; i < cnt; i++)
+	fwrite(iov[i].iov_base, 1, iov[i].iov_len, netstackdump);
+#endif
+      while (cnt > 0)
+	{
+	  int nBytes = writev(r->m_sb.sb_socket, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+
+	  if (nBytes < 0)
+	    {
+	      int sockerr = GetSockError();
+	      RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d", __FUNCTION__,
+		  sockerr);
+
+	      if (sockerr == EINTR && !RTMP_ctrlC)
+		continue;
+
+	      RTMP_Close(r);
+	      return FALSE;
+	    }
+	  if (nBytes == 0)
+	    return FALSE;
+
+	  for (; cnt > 0 && nBytes >= (int)iov->iov_len; iov++, cnt--)
+	    nBytes -= iov->iov_len;
+	  if (cnt > 0)
+	    {
+	      iov->iov_base = (char *)iov->iov_base + nBytes;
+	      iov->iov_len -= nBytes;
+	    }
+	}
+      return TRUE;
+    }
+#endif
+
+  for (i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+  c = PRIV(r);
+  if (len > c->c_wsize)
+    {
+      ptr = realloc(c->c_wbuf, len);
+      if (!ptr)
+	return FALSE;
+      c->c_wbuf = ptr;
+      c->c_wsize = len;
+    }
+  for (i = 0, ptr = c->c_wbuf; i < cnt; i++)
+    {
+      memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+      ptr += iov[i].iov_len;
+    }
+  return WriteN(r, c->c_wbuf, len);
+}
+
 int
 RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 {
@@ -3900,10 +4488,12 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
   int nSize;
   int hSize, cSize;
   char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+  char cbuf[1 + 2 + 4];		/* continuation chunks' header */
   uint32_t t;
-  char *buffer, *tbuf = NULL, *toff = NULL;
+  char *buffer;
   int nChunkSize;
-  int tlen;
+  struct iovec *iov = NULL;
+  int niov = 0;
 
   if (packet->m_nChannel >= r->m_channelsAllocatedOut)
     {
@@ -4019,19 +4609,31 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
   RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_sb.sb_socket,
       nSize);
-  /* send all chunks in one HTTP request */
-  if (r->Link.protocol & RTMP_FEATURE_HTTP)
-    {
-      int chunks = (nSize+nChunkSize-1) / nChunkSize;
-      if (chunks > 1)
-        {
-	  tlen = chunks * (cSize + 1) + nSize + hSize;
-	  tbuf = malloc(tlen);
-	  if (!tbuf)
-	    return FALSE;
-	  toff = tbuf;
-	}
-    }
+  /* Send all chunks in one HTTP request, or in one write on a plain
+   * socket: with the default 128 byte chunk size a single video frame
+   * would otherwise cost dozens of send() calls. The parts are gathered
+   * in place, the body isn't copied.
+   */
+  {
+    int chunks = (nSize+nChunkSize-1) / nChunkSize;
+    if (chunks > 1)
+      {
+	RTMP_PRIV *p = PrivGet(r);
+	int need = 2 * chunks - 1;
+
+	if (!p)
+	  return FALSE;
+	if (need > p->c_niov)
+	  {
+	    iov = realloc(p->c_iov, need * sizeof(struct iovec));
+	    if (!iov)
+	      return FALSE;
+	    p->c_iov = iov;
+	    p->c_niov = need;
+	  }
+	iov = p->c_iov;
+      }
+  }
   while (nSize + hSize)
     {
       int wrote;
@@ -4041,10 +4643,20 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)header, hSize);
       RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)buffer, nChunkSize);
-      if (tbuf)
+      if (iov)
         {
-	  memcpy(toff, header, nChunkSize + hSize);
-	  toff += nChunkSize + hSize;
+	  if (header + hSize == buffer)
+	    {
+	      iov[niov].iov_base = header;
+	      iov[niov++].iov_len = hSize + nChunkSize;
+	    }
+	  else
+	    {
+	      iov[niov].iov_base = header;
+	      iov[niov++].iov_len = hSize;
+	      iov[niov].iov_base = buffer;
+	      iov[niov++].iov_len = nChunkSize;
+	    }
 	}
       else
         {
@@ -4058,18 +4670,13 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
       if (nSize > 0)
 	{
-	  header = buffer - 1;
+	  /* the same for every chunk, kept apart from the body */
+	  header = cbuf;
 	  hSize = 1;
 	  if (cSize)
-	    {
-	      header -= cSize;
-	      hSize += cSize;
-	    }
+	    hSize += cSize;
           if (t >= 0xffffff)
-            {
-              header -= 4;
-              hSize += 4;
-            }
+            hSize += 4;
 	  *header = (0xc0 | c);
 	  if (cSize)
 	    {
@@ -4085,17 +4692,12 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             }
 	}
     }
-  if (tbuf)
-    {
-      int wrote = WriteN(r, tbuf, toff-tbuf);
-      free(tbuf);
-      tbuf = NULL;
-      if (!wrote)
-        return FALSE;
-    }
+  if (iov && !WriteV(r, iov, niov))
+    return FALSE;
 
   /* we invoked a remote method */
-  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE)
+  if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE &&
+      (queue || RTMP_LogEnabled(RTMP_LOGDEBUG)))
     {
       AVal method;
       char *ptr;
@@ -4107,7 +4709,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
         int txn;
         ptr += 3 + method.av_len;
         txn = (int)AMF_DecodeNumber(ptr);
-	AV_queue(&r->m_methodCalls, &r->m_numCalls, &method, txn);
+	CallAdd(r, RTMP_NameLookup(&method), &method, txn);
       }
     }
 
@@ -4199,9 +4801,7 @@ CloseInternal(RTMP *r, int reconnect)
   free(r->m_vecChannelsOut);
   r->m_vecChannelsOut = NULL;
   r->m_channelsAllocatedOut = 0;
-  AV_clear(r->m_methodCalls, r->m_numCalls);
-  r->m_methodCalls = NULL;
-  r->m_numCalls = 0;
+  PrivFree(r);
   r->m_numInvokes = 0;
 
   r->m_bPlaying = FALSE;
@@ -4331,6 +4931,19 @@ RTMPSockBuf_Close(RTMPSockBuf *sb)
   return 0;
 }
 
+/* Returns TRUE if TLS records on this socket are encrypted by the kernel,
+ * so sendfile() or splice() may write to it directly.
+ */
+int
+RTMPSockBuf_KTLS(RTMPSockBuf *sb)
+{
+#if defined(CRYPTO) && !defined(NO_SSL)
+  if (sb->sb_ssl)
+    return TLS_ktls_send(sb->sb_ssl) ? TRUE : FALSE;
+#endif
+  return FALSE;
+}
+
 #define HEX2BIN(a)	(((a)&0x40)?((a)&0xf)+9:((a)&0xf))
 
 static void
@@ -4495,6 +5108,17 @@ restart:
 
 #define MAX_IGNORED_FRAMES	50
 
+/* AMF_Walk callback: fetch the leading string of a message, i.e. the
+ * method name of an invoke or notify, without decoding the rest.
+ */
+static int
+WalkFirstString(const AMFWalkEvent *ev, void *ctx)
+{
+  if (ev->e_type == AMF_STRING)
+    *(AVal *)ctx = ev->e_aval;
+  return AMF_WALK_STOP;
+}
+
 /* Read from the stream until we get a media packet.
  * Returns -3 if Play.Close/Stop, -2 if fatal error, -1 if no more media
  * packets, 0 if ignorable error, >0 if there is a media packet
@@ -4568,15 +5192,11 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 	      if (r->m_read.nMetaHeaderSize > 0
 		  && packet.m_packetType == RTMP_PACKET_TYPE_INFO)
 		{
-		  AMFObject metaObj;
-		  int nRes =
-		    AMF_Decode(&metaObj, packetBody, nPacketLen, FALSE);
+		  AVal metastring = { 0, 0 };
+		  int nRes = AMF_Walk(packetBody, nPacketLen, WalkFirstString,
+				      &metastring);
 		  if (nRes >= 0)
 		    {
-		      AVal metastring;
-		      AMFProp_GetString(AMF_GetProp(&metaObj, NULL, 0),
-					&metastring);
-
 		      if (AVMATCH(&metastring, &av_onMetaData))
 			{
 			  /* compare */
@@ -4588,7 +5208,6 @@ Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
 			      ret = RTMP_READ_ERROR;
 			    }
 			}
-		      AMF_Reset(&metaObj);
 		      if (ret == RTMP_READ_ERROR)
 			break;
 		    }
@@ -172,6 +172,8 @@ extern "C"
 #define RTMP_LF_BUFX	0x0010	/* toggle stream on BufferEmpty msg */
 #define RTMP_LF_FTCU	0x0020	/* free tcUrl on close */
 #define RTMP_LF_FAPU	0x0040	/* free app on close */
+#define RTMP_LF_KTLS	0x0080	/* offload TLS records to the kernel */
+#define RTMP_LF_TFO	0x0100	/* use TCP Fast Open */
     int lFlags;
 
     int swfAge;
@@ -339,6 +341,8 @@ extern "C"
 
   void *RTMP_TLS_AllocServerContext(const char* cert, const char* key);
   void RTMP_TLS_FreeServerContext(void *ctx);
+  /* offer a cached session for host:port on a new client TLS session */
+  void RTMP_TLS_Resume(void *ssl, const char *host, int hlen, int port);
 
   int RTMP_LibVersion(void);
   void RTMP_UserInterrupt(void);	/* user typed Ctrl-C */
@@ -355,9 +359,37 @@ extern "C"
   int RTMP_FindFirstMatchingProperty(AMFObject *obj, const AVal *name,
 				      AMFObjectProperty * p);
 
+  /* Well-known invoke method names and onStatus codes */
+  typedef enum
+  {
+    RTMP_NAME_UNKNOWN = 0,
+    /* methods */
+    RTMP_NAME_RESULT, RTMP_NAME_ERROR, RTMP_NAME_CONNECT, RTMP_NAME_CLOSE,
+    RTMP_NAME_CREATESTREAM, RTMP_NAME_DELETESTREAM, RTMP_NAME_CLOSESTREAM,
+    RTMP_NAME_PLAY, RTMP_NAME_PUBLISH, RTMP_NAME_PING,
+    RTMP_NAME_ONSTATUS, RTMP_NAME_ONBWDONE, RTMP_NAME_ONFCSUBSCRIBE,
+    RTMP_NAME_ONFCUNSUBSCRIBE, RTMP_NAME__ONBWCHECK, RTMP_NAME__ONBWDONE,
+    RTMP_NAME__CHECKBW, RTMP_NAME_SET_PLAYLIST, RTMP_NAME_PLAYLIST_READY,
+    RTMP_NAME_GETSTREAMLENGTH, RTMP_NAME_USHERTOKEN,
+    /* status codes */
+    RTMP_NAME_NS_FAILED, RTMP_NAME_NS_PLAY_FAILED,
+    RTMP_NAME_NS_PLAY_STREAMNOTFOUND, RTMP_NAME_NS_PLAY_START,
+    RTMP_NAME_NS_PLAY_STOP, RTMP_NAME_NS_PLAY_COMPLETE,
+    RTMP_NAME_NS_PLAY_PUBLISHNOTIFY, RTMP_NAME_NS_PLAY_UNPUBLISHNOTIFY,
+    RTMP_NAME_NS_PUBLISH_START, RTMP_NAME_NS_SEEK_NOTIFY,
+    RTMP_NAME_NS_PAUSE_NOTIFY, RTMP_NAME_NC_CONNECT_INVALIDAPP,
+    RTMP_NAME_NC_CONNECT_REJECTED
+  } RTMP_NAME;
+
+  /* Map a name to its RTMP_NAME, or RTMP_NAME_UNKNOWN. Dispatches on
+   * length and one distinguishing character, then does a single memcmp.
+   */
+  RTMP_NAME RTMP_NameLookup(const AVal *name);
+
   int RTMPSockBuf_Fill(RTMPSockBuf *sb);
   int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len);
   int RTMPSockBuf_Close(RTMPSockBuf *sb);
+  int RTMPSockBuf_KTLS(RTMPSockBuf *sb);
 
   int RTMP_SendCreateStream(RTMP *r);
   int RTMP_SendSeek(RTMP *r, int dTime);
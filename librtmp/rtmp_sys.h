@@ -41,9 +41,12 @@
 #define sleep(n)	Sleep(n*1000)
 #define msleep(n)	Sleep(n)
 #define SET_RCVTIMEO(tv,s)	int tv = s*1000
+/* no writev(), gathered writes are copied into one buffer */
+struct iovec { void *iov_base; size_t iov_len; };
 #else /* !_WIN32 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/times.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -124,6 +127,9 @@ typedef struct tls_ctx {
 #define TLS_close(s)	gnutls_deinit(s)
 
 #else	/* USE_OPENSSL */
+#ifndef NO_CRYPTO
+#include <openssl/ssl.h>
+#endif
 #define TLS_CTX	SSL_CTX *
 #define TLS_client(ctx,s)	s = SSL_new(ctx)
 #define TLS_server(ctx,s)	s = SSL_new(ctx)
@@ -134,6 +140,20 @@ typedef struct tls_ctx {
 #define TLS_write(s,b,l)	SSL_write(s,b,l)
 #define TLS_shutdown(s)	SSL_shutdown(s)
 #define TLS_close(s)	SSL_free(s)
+#ifdef SSL_OP_ENABLE_KTLS
+/* OpenSSL 3 installs the session keys in the kernel (TCP_ULP "tls")
+ * itself once the handshake is done, if both the library and the
+ * kernel support it.
+ */
+#define TLS_ktls_enable(s)	SSL_set_options(s, SSL_OP_ENABLE_KTLS)
+#define TLS_ktls_send(s)	BIO_get_ktls_send(SSL_get_wbio(s))
+#define TLS_ktls_recv(s)	BIO_get_ktls_recv(SSL_get_rbio(s))
+#endif
 
+#endif
+#ifndef TLS_ktls_enable
+#define TLS_ktls_enable(s)
+#define TLS_ktls_send(s)	0
+#define TLS_ktls_recv(s)	0
 #endif
 #endif
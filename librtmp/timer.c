@@ -0,0 +1,189 @@
+/*
+ *      Copyright (C) 2009-2010 Howard Chu
+ *
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include <string.h>
+
+#include "timer.h"
+
+/* tw_now is the next tick that has not been run yet. A timer lives on
+ * level 0 if it is due within 64 ticks, otherwise on the lowest level
+ * whose span covers it; upper slots are cascaded down as tw_now crosses
+ * their boundary.
+ */
+
+static void
+TimerLink(RTMP_TIMER **head, RTMP_TIMER *t)
+{
+  t->t_next = *head;
+  if (t->t_next)
+    t->t_next->t_pprev = &t->t_next;
+  t->t_pprev = head;
+  *head = t;
+}
+
+static void
+TimerUnlink(RTMP_TIMER *t)
+{
+  if (t->t_next)
+    t->t_next->t_pprev = t->t_pprev;
+  *t->t_pprev = t->t_next;
+  t->t_next = NULL;
+  t->t_pprev = NULL;
+}
+
+static void
+TimerPlace(RTMP_TIMERWHEEL *tw, RTMP_TIMER *t)
+{
+  uint32_t delta = t->t_expire - tw->tw_now;
+  int level;
+
+  if ((int32_t)delta < 0)
+    {
+      /* already due, run on the next tick */
+      TimerLink(&tw->tw_slots[0][tw->tw_now & RTMP_TW_MASK], t);
+      return;
+    }
+  for (level = 0; level < RTMP_TW_LEVELS - 1; level++)
+    if (delta < (1U << (RTMP_TW_BITS * (level + 1))))
+      break;
+  TimerLink(&tw->tw_slots[level]
+	    [(t->t_expire >> (RTMP_TW_BITS * level)) & RTMP_TW_MASK], t);
+}
+
+static void
+TimerCascade(RTMP_TIMERWHEEL *tw, int level, int idx)
+{
+  RTMP_TIMER *t = tw->tw_slots[level][idx], *next;
+
+  tw->tw_slots[level][idx] = NULL;
+  for (; t; t = next)
+    {
+      next = t->t_next;
+      TimerPlace(tw, t);
+    }
+}
+
+void
+RTMP_TimerWheelInit(RTMP_TIMERWHEEL *tw, uint32_t now)
+{
+  memset(tw, 0, sizeof(*tw));
+  tw->tw_now = now;
+}
+
+void
+RTMP_TimerInit(RTMP_TIMER *t, RTMP_TimerFunc *func, void *arg)
+{
+  t->t_next = NULL;
+  t->t_pprev = NULL;
+  t->t_expire = 0;
+  t->t_func = func;
+  t->t_arg = arg;
+}
+
+void
+RTMP_TimerSet(RTMP_TIMERWHEEL *tw, RTMP_TIMER *t, uint32_t delay)
+{
+  if (t->t_pprev)
+    TimerUnlink(t);
+  else
+    tw->tw_count++;
+  if (delay > RTMP_TW_MAXDELAY)
+    delay = RTMP_TW_MAXDELAY;
+  t->t_expire = tw->tw_now + delay;
+  TimerPlace(tw, t);
+}
+
+void
+RTMP_TimerCancel(RTMP_TIMERWHEEL *tw, RTMP_TIMER *t)
+{
+  if (!t->t_pprev)
+    return;
+  TimerUnlink(t);
+  tw->tw_count--;
+}
+
+int
+RTMP_TimerAdvance(RTMP_TIMERWHEEL *tw, uint32_t now)
+{
+  RTMP_TIMER *pending, *t;
+  int fired = 0;
+
+  while ((int32_t)(now - tw->tw_now) >= 0)
+    {
+      int idx = tw->tw_now & RTMP_TW_MASK;
+
+      if (!tw->tw_count)
+	{
+	  /* nothing armed, no need to walk the ticks */
+	  tw->tw_now = now + 1;
+	  break;
+	}
+
+      if (!idx)
+	{
+	  int level;
+	  for (level = 1; level < RTMP_TW_LEVELS; level++)
+	    {
+	      int i = (tw->tw_now >> (RTMP_TW_BITS * level)) & RTMP_TW_MASK;
+	      TimerCascade(tw, level, i);
+	      if (i)
+		break;
+	    }
+	}
+
+      /* Move the slot to a local list so callbacks can cancel or
+       * re-arm any timer, including ones still waiting to fire here.
+       */
+      pending = tw->tw_slots[0][idx];
+      tw->tw_slots[0][idx] = NULL;
+      if (pending)
+	pending->t_pprev = &pending;
+      tw->tw_now++;
+
+      while (pending)
+	{
+	  t = pending;
+	  TimerUnlink(t);
+	  tw->tw_count--;
+	  fired++;
+	  t->t_func(t, t->t_arg);
+	}
+    }
+  return fired;
+}
+
+int
+RTMP_TimerNextDelay(RTMP_TIMERWHEEL *tw)
+{
+  int i, idx;
+
+  if (!tw->tw_count)
+    return -1;
+
+  idx = tw->tw_now & RTMP_TW_MASK;
+  for (i = idx; i < RTMP_TW_SIZE; i++)
+    if (tw->tw_slots[0][i])
+      return i - idx;
+
+  /* Level 0 is empty up to its wrap; the next cascade happens there. */
+  return RTMP_TW_SIZE - idx;
+}
@@ -0,0 +1,87 @@
+#ifndef __RTMP_TIMER_H__
+#define __RTMP_TIMER_H__
+/*
+ *      Copyright (C) 2009-2010 Howard Chu
+ *
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /* Hierarchical timer wheel. Times are in milliseconds of
+   * RTMP_GetTime(), which is monotonic. Each level has 64 slots;
+   * level 0 covers 64ms at 1ms resolution, level 3 covers ~4.6
+   * hours. Longer delays are clamped to the top level's range.
+   */
+#define RTMP_TW_BITS	6
+#define RTMP_TW_SIZE	(1 << RTMP_TW_BITS)
+#define RTMP_TW_MASK	(RTMP_TW_SIZE - 1)
+#define RTMP_TW_LEVELS	4
+#define RTMP_TW_MAXDELAY	((1U << (RTMP_TW_BITS * RTMP_TW_LEVELS)) - 1)
+
+  struct RTMP_TIMER;
+  typedef void (RTMP_TimerFunc)(struct RTMP_TIMER *t, void *arg);
+
+  /* Embed one of these in the object owning the deadline; the wheel
+   * never allocates. Zero it (or call RTMP_TimerInit) before first use.
+   */
+  typedef struct RTMP_TIMER
+  {
+    struct RTMP_TIMER *t_next;
+    struct RTMP_TIMER **t_pprev;	/* NULL when not armed */
+    uint32_t t_expire;
+    RTMP_TimerFunc *t_func;
+    void *t_arg;
+  } RTMP_TIMER;
+
+  typedef struct RTMP_TIMERWHEEL
+  {
+    uint32_t tw_now;		/* last time processed */
+    int tw_count;		/* armed timers */
+    RTMP_TIMER *tw_slots[RTMP_TW_LEVELS][RTMP_TW_SIZE];
+  } RTMP_TIMERWHEEL;
+
+  void RTMP_TimerWheelInit(RTMP_TIMERWHEEL *tw, uint32_t now);
+  void RTMP_TimerInit(RTMP_TIMER *t, RTMP_TimerFunc *func, void *arg);
+
+  /* Arm t to fire delay ms after the wheel's current time. Re-arming
+   * an already pending timer moves it. */
+  void RTMP_TimerSet(RTMP_TIMERWHEEL *tw, RTMP_TIMER *t, uint32_t delay);
+  void RTMP_TimerCancel(RTMP_TIMERWHEEL *tw, RTMP_TIMER *t);
+#define RTMP_TimerPending(t)	((t)->t_pprev != NULL)
+
+  /* Run all timers due at or before now. Callbacks may arm or cancel
+   * any timer, including the one firing. Returns the number fired. */
+  int RTMP_TimerAdvance(RTMP_TIMERWHEEL *tw, uint32_t now);
+
+  /* Milliseconds until the next timer may fire, suitable for a
+   * select/poll timeout; -1 if none are armed. The value may be
+   * early for timers still on an upper level, never late. */
+  int RTMP_TimerNextDelay(RTMP_TIMERWHEEL *tw);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -244,9 +244,21 @@ OpenResumeFile(const char *flvFile,	// file name [in]
 		  *metaHeader = (char *) malloc(*nMetaHeaderSize);
 		  memcpy(*metaHeader, buffer, *nMetaHeaderSize);
 
-		  // get duration
-		  AMFObjectProperty prop;
-		  if (RTMP_FindFirstMatchingProperty
+		  // get duration, normally a member of the onMetaData object;
+		  // look it up there by name before searching the whole tree,
+		  // which would walk through the keyframe arrays
+		  AMFObjectProperty prop, *p = AMF_GetProp(&metaObj, NULL, 1);
+		  int found = FALSE;
+		  if (p->p_type == AMF_OBJECT || p->p_type == AMF_ECMA_ARRAY)
+		    {
+		      AMFIndex idx;
+		      AMFIndex_Init(&idx);
+		      p = AMF_GetPropIndexed(&p->p_vu.p_object, &idx, &av_duration);
+		      AMFIndex_Free(&idx);
+		      if ((found = p->p_type == AMF_NUMBER))
+			prop = *p;
+		    }
+		  if (found || RTMP_FindFirstMatchingProperty
 		      (&metaObj, &av_duration, &prop))
 		    {
 		      *duration = AMFProp_GetNumber(&prop);
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <ctype.h>
+#include <time.h>
 
 #include <signal.h>
 #include <getopt.h>
@@ -31,15 +33,33 @@
 
 #include "librtmp/rtmp_sys.h"
 #include "librtmp/log.h"
+#include "librtmp/timer.h"
 
 #include "thread.h"
 
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#elif !defined(WIN32)
+#include <poll.h>
+#endif
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef WIN32
+#include <io.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY	0
+#endif
+
 #define RD_SUCCESS		0
 #define RD_FAILED		1
 #define RD_INCOMPLETE		2
 
-#define PACKET_SIZE 1024*1024
-
 #ifdef WIN32
 #define InitSockets()	{\
         WORD version;			\
@@ -54,25 +74,103 @@
 #define	CleanupSockets()
 #endif
 
+#ifdef WIN32
+#define SockAgain(e)	((e) == WSAEWOULDBLOCK)
+#define poll(f,n,t)	WSAPoll(f,n,t)
+#else
+#define SockAgain(e)	((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+#endif
+
+#ifdef MSG_MORE
+#define GW_MSG_MORE	MSG_MORE	// more follows, don't push a short segment
+#else
+#define GW_MSG_MORE	0
+#endif
+
 enum
 {
   STREAMING_ACCEPTING,
-  STREAMING_IN_PROGRESS,
   STREAMING_STOPPING,
   STREAMING_STOPPED
 };
 
+/* Readiness notification: epoll on Linux, poll() elsewhere */
+#define EV_READ		1
+#define EV_WRITE	2
+
+typedef struct
+{
+#ifdef USE_EPOLL
+  int epfd;
+#else
+  struct pollfd *fds;
+  void **ptrs;
+  int num;
+  int max;
+#endif
+} GW_EVENTS;
+
+typedef struct
+{
+  void *ptr;
+  int events;
+} GW_EVENT;
+
+struct GW_CLIENT;
+struct GW_STREAM;
+struct GW_INDEX;
+struct GW_CACHE;
+struct GW_HLS;
+
+/* What is known about VOD streams, shared by all shards */
 typedef struct
+{
+  TMUTEX lock;			// everything below
+  struct GW_INDEX *index;	// keyframe indexes, most recent first
+  int nindex;
+  struct GW_CACHE *cache;	// VOD cache files, most recently used first
+  int64_t cachesize;		// bytes in them
+  struct GW_HLS *hls;		// live streams segmented for HLS
+
+  char *cachedir;		// NULL if VOD streams aren't cached
+  int64_t cachemax;
+} GW_STORE;
+
+/* One shard: a listening socket and the event loop serving it. With
+ * SO_REUSEPORT, each shard has its own socket on the same port and the
+ * kernel spreads connections over them; shards share only the store.
+ */
+typedef struct STREAMING_SERVER
 {
   int socket;
-  int state;
+  volatile int state;
+  struct STREAMING_SERVER *next;	// next shard
+  int shard;
+  int nshards;
+
+  GW_EVENTS ev;
+  int wake[2];			// pipe to interrupt EvWait from other threads
+  RTMP_TIMERWHEEL timers;
+  struct GW_CLIENT *clients;	// all open clients, event loop only
+  int nextid;
 
+  struct GW_STREAM *streams;	// shared live streams, event loop only
+
+  TMUTEX lock;			// protects ready and sessions
+  struct GW_STREAM *ready;	// streams with new data to send
+  int sessions;			// running upstream session threads
+
+  GW_STORE *store;
 } STREAMING_SERVER;
 
 STREAMING_SERVER *httpServer = 0;	// server structure pointer
+char *cacheDir = NULL;		// VOD cache directory
+int64_t cacheMax = (int64_t) 1024 * 1024 * 1024;	// and its size cap
 
-STREAMING_SERVER *startStreaming(const char *address, int port);
+STREAMING_SERVER *startStreaming(const char *address, int port, int shards);
 void stopStreaming(STREAMING_SERVER * server);
+void freeStreaming(STREAMING_SERVER * server);
+static void ServersStop(void);
 
 typedef struct
 {
@@ -112,6 +210,276 @@ typedef struct
 #endif
 } RTMP_REQUEST;
 
+typedef struct GW_CHUNK
+{
+  struct GW_CHUNK *next;	// client's own queue
+  int refs;			// ring slot and readers, under stream lock
+  int len;
+  int off;			// own queue: bytes already sent
+  struct GW_SEGMENT *seg;	// own queue: send its data, not ours
+  uint32_t ts;			// FLV tag timestamp
+  char data[1];
+} GW_CHUNK;
+
+#define GW_CHUNK_SIZE	(64*1024)	// one RTMP_Read
+#define GW_RING_SLOTS	1024	// FLV tags kept per stream, power of 2
+
+/* How far a live client may fall behind the best lag it had, in ms of
+ * stream time, before it is sent only keyframes and audio, moved up to
+ * the last keyframe, or disconnected. */
+#define GW_LAG_DROP	3000
+#define GW_LAG_SKIP	8000
+#define GW_LAG_MAX	20000
+#define GW_SNDBUF	(128*1024)	// kernel queue per client, so lag shows here
+#define GW_REQ_TIMEOUT	5000	// ms to receive the request header
+#define GW_IDLE_TIMEOUT	15000	// ms a kept-alive connection may idle
+#define GW_INDEX_MAX	64	// VOD keyframe indexes kept
+#define GW_PATH_MAX	1024	// cache file paths
+#define GW_KEY_MAX	8192	// longest key read back from a cache file
+#define GW_HLS_TARGET	4000	// ms per HLS segment, cut at the next keyframe
+#define GW_HLS_LIST	5	// segments in the playlist
+#define GW_HLS_KEEP	8	// segments kept, a few more for late fetches
+#define GW_HLS_IDLE	30000	// ms without requests before HLS stops
+#define GW_HLS_WAIT	15000	// ms a playlist request waits for a segment
+#define GW_HLS_MAXAGE	3600	// s a segment may be cached for
+#define GW_HLS_MAXSEG	(32*1024*1024)	// a segment this big without a keyframe is dropped
+#define GW_WS_GUID	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"	// RFC 6455
+
+/* Where the keyframes of a VOD stream are, to turn a byte offset a
+ * player asks for into a seek. Taken from onMetaData's keyframes
+ * object, else counted on a download from start to end, when the
+ * offsets are those of the FLV we sent.
+ */
+typedef struct GW_INDEX
+{
+  struct GW_INDEX *next;
+  char *key;			// normalized URL
+  int frommeta;
+  int n;
+  int max;
+  double *pos;			// byte offsets, ascending
+  double *times;		// seconds
+  char *meta;			// onMetaData tag, sent first after a seek
+  int metalen;
+} GW_INDEX;
+
+/* A VOD download kept on disk as the FLV its clients were sent, named
+ * by a hash of the stream's key. The file starts with the key itself,
+ * its length in 4 bytes then the bytes, so a hash collision is caught
+ * rather than served. The session writes it as a partial file and
+ * renames it once the download is complete; until then, later clients
+ * read it as it grows. Whole files are dropped least recently used
+ * first to stay under the size cap.
+ */
+typedef struct GW_CACHE
+{
+  struct GW_CACHE *next;
+  char name[17];		// hex FNV-1a of the key
+  char *key;			// the stream's key
+  int hlen;			// header bytes before the FLV
+  int id;			// writing stream, names the partial file
+  int64_t size;			// FLV bytes written
+  int done;			// renamed to name.flv
+  int listed;			// on the server's list
+  struct GW_STREAM *writer;	// still downloading it
+  int refs;			// list, writer and partial file readers
+} GW_CACHE;
+
+/* One HLS segment, under the store lock */
+typedef struct GW_SEGMENT
+{
+  int refs;			// playlist slot and queued answers
+  int len;
+  uint32_t dur;			// ms
+  char data[1];
+} GW_SEGMENT;
+
+enum
+{
+  TS_CC_PAT,			// continuity counters, one per PID
+  TS_CC_PMT,
+  TS_CC_VIDEO,
+  TS_CC_AUDIO,
+  TS_CC_MAX
+};
+
+/* A live stream remuxed to MPEG-TS segments for HLS, once for viewers
+ * on all shards. Its session thread muxes the tags it reads and
+ * publishes a segment at each keyframe past the target duration; the
+ * last few are kept in memory for the playlist and segment requests.
+ * The stream keeps running while the playlist is asked for.
+ */
+typedef struct GW_HLS
+{
+  struct GW_HLS *next;		// store's list
+  char name[17];		// hex FNV-1a of the key, as for the cache
+  char tag[32];			// names its segments, unique to this run
+  int lists;			// times listed, makes the tag unique
+  struct GW_STREAM *stream;	// segmenting it, while listed
+
+  int listed;			// everything here under the store lock
+  int ended;			// the stream did
+  uint32_t touched;		// last asked for
+  uint32_t nseg;		// segments published
+  uint32_t maxdur;		// longest, ms
+  GW_SEGMENT *seg[GW_HLS_KEEP];
+
+  int primed;			// session thread only from here on
+  int open;			// a segment is being muxed
+  char *buf;			// into here
+  int len;
+  int size;
+  char *es;			// one frame as a PES packet
+  int essize;
+  uint32_t t0;			// timestamp the segment starts at
+  uint32_t tlast;
+  uint32_t tbase;		// timestamp muxed as 0
+  int based;
+  unsigned char cc[TS_CC_MAX];
+  char *sps;			// SPS and PPS, Annex B
+  int spslen;
+  int nalsize;			// bytes in NALU lengths, 0 without an avcC
+  int aacprofile, aacrate, aacchans;
+  int hasaudio;			// have an AudioSpecificConfig
+} GW_HLS;
+
+/* A request as parsed, handed to the stream it starts */
+typedef struct GW_REQUEST
+{
+  int hlen;
+  char header[2048];		// req strings point into it
+  char *target;			// request line's path and query
+  double offset;		// byte offset asked for by start=
+  int headonly;			// HEAD request
+  int http11;
+  int keepalive;		// client may send another request
+  int hls;			// asks for the HLS playlist
+  int websocket;		// asks to upgrade to a WebSocket
+  int connupgrade;		// Connection: has the Upgrade token
+  char *wskey;			// its Sec-WebSocket-Key
+  int wsversion;
+  RTMP_REQUEST req;
+  char tcUrl[512];
+  int ownextras;		// req.extras is ours, not the defaults'
+} GW_REQUEST;
+
+/* Tags a client joining mid-stream is sent before the ring */
+enum
+{
+  GW_INIT_FLV,			// FLV file header
+  GW_INIT_META,			// onMetaData
+  GW_INIT_VIDEO,		// AVC sequence header
+  GW_INIT_AUDIO,		// AAC sequence header
+  GW_INIT_MAX
+};
+
+/* One upstream RTMP session. The session thread appends the FLV tags
+ * it reads to a ring of refcounted chunks; each attached client sends
+ * from its own position in it. Live streams are shared by all clients
+ * asking for the same URL, others have a single client and the
+ * session waits for it rather than overwrite what it hasn't sent.
+ * Clients joining a live stream start at its last keyframe, after the
+ * init tags, so they can decode right away.
+ */
+typedef struct GW_STREAM
+{
+  struct GW_STREAM *next;	// server's shared streams, event loop only
+  struct GW_STREAM **pprev;
+  struct GW_STREAM *rnext;	// ready list, under server lock
+  int ready;			// on the ready list, under server lock
+  STREAMING_SERVER *server;
+  GW_REQUEST *rq;
+  char *key;			// normalized URL if shared
+  int id;
+  struct GW_CLIENT *clients;	// attached, event loop only
+
+  TMUTEX lock;			// everything below
+  TCOND cond;			// reader moved on
+  int refs;			// session, and event loop while attached
+  int closing;			// no clients left, session should stop
+  int eof;			// session has ended
+  int rtmpfd;			// upstream socket, shut down on close
+  GW_CHUNK *init[GW_INIT_MAX];
+  GW_CHUNK *ring[GW_RING_SLOTS];
+  uint64_t head;		// tags appended so far
+  uint64_t gopseq;		// last video keyframe
+  int havegop;
+  uint32_t lastts;		// newest tag's timestamp
+  uint64_t rseq;		// single client's position
+  int paced;			// session waits for rseq
+
+  char *ikey;			// VOD: key of its keyframe index
+  int seek;			// started past the beginning
+  int ntags;			// tags read, session thread only
+  double outpos;		// FLV bytes read so far
+  GW_INDEX *built;		// keyframes counted from the start
+  GW_CACHE *cache;		// file it writes, holds a ref
+  int cfd;			// session thread only
+
+  GW_HLS *hls;			// segments it, set once under lock
+  int hlsopen;			// listed, event loop only
+  RTMP_TIMER hlstimer;		// stops HLS once no one asks
+} GW_STREAM;
+
+enum
+{
+  CLIENT_READING,		// waiting for the request header
+  CLIENT_ANSWERING,		// sending a response from its own queue
+  CLIENT_STREAMING,		// attached to a stream
+  CLIENT_CLOSED
+};
+
+/* One HTTP client, owned by the event loop */
+typedef struct GW_CLIENT
+{
+  struct GW_CLIENT *next;
+  struct GW_CLIENT **pprev;
+  struct GW_CLIENT *snext;	// stream's clients
+  struct GW_CLIENT **spprev;
+  STREAMING_SERVER *server;
+  int sockfd;
+  int id;
+  int state;
+  int events;			// EV_ mask registered for sockfd
+  RTMP_TIMER timer;
+  GW_REQUEST *rq;		// until handed to a stream
+  char in[2048];		// read ahead of the current request
+  int inlen;
+  int nreq;			// requests taken
+  int http11;
+  int keepalive;		// read another request after this one
+
+  GW_CHUNK *head;		// response header or error
+  GW_CHUNK *tail;
+  int eof;			// close once that is sent
+
+  GW_STREAM *stream;
+  uint64_t seq;			// next ring tag to send
+  GW_CHUNK *cur;		// chunk being sent, holds a ref
+  int off;
+  int ninit;			// init tags taken
+  int initend;			// init tags to take before the ring
+  uint32_t ts;			// last ring tag taken
+  int32_t minlag;		// least it was behind the head, ms
+  int skipping;			// dropping video until a keyframe
+  unsigned int dropped;		// tags skipped to keep up
+  int more;			// another tag is ready after cur
+  int chunked;			// body in HTTP/1.1 chunks
+  int ws;			// body in WebSocket binary frames
+  int sent;			// chunks sent so far
+  char pre[24];			// chunk or frame header for cur
+  int plen;
+  int poff;
+
+  int cfd;			// cache file sent instead of a stream
+  GW_CACHE *cache;		// its entry while partial, holds a ref
+  int64_t coff;			// sent so far
+  int64_t cend;			// written so far
+  int64_t clen;			// left of the current chunk
+
+  int hlswait;			// playlist request waiting for a segment
+} GW_CLIENT;
+
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
 
 int
@@ -205,6 +573,24 @@ parseAMF(AMFObject *obj, const char *arg, int *depth)
   return 0;
 }
 
+/* deep copy of the property tree; strings are shared */
+static void
+copyAMF(AMFObject *dst, const AMFObject *src)
+{
+  AMFObjectProperty prop;
+  int i;
+
+  dst->o_num = 0;
+  dst->o_props = NULL;
+  for (i = 0; i < src->o_num; i++)
+    {
+      prop = src->o_props[i];
+      if (prop.p_type == AMF_OBJECT)
+	copyAMF(&prop.p_vu.p_object, &src->o_props[i].p_vu.p_object);
+      AMF_AddProp(dst, &prop);
+    }
+}
+
 /* this request is formed from the parameters and used to initialize a new request,
  * thus it is a default settings list. All settings can be overriden by specifying the
  * parameters in the GET request. */
@@ -278,10 +664,10 @@ controlServerThread(void *unused)
       switch (ich)
 	{
 	case 'q':
+	  // main frees the shards once they stopped, and exits
 	  RTMP_LogPrintf("Exiting\n");
-	  stopStreaming(httpServer);
-	  exit(0);
-	  break;
+	  ServersStop();
+	  TFRET();
 	default:
 	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
 	}
@@ -289,410 +675,3652 @@ controlServerThread(void *unused)
   TFRET();
 }
 
-/*
-ssize_t readHTTPLine(int sockfd, char *buffer, size_t length)
+static const char srvhead[] =
+  "\r\nServer: HTTP-RTMP Stream Server " RTMPDUMP_VERSION "\r\n";
+
+static void
+SetNonBlock(int sockfd)
+{
+#ifdef WIN32
+  u_long on = 1;
+  ioctlsocket(sockfd, FIONBIO, &on);
+#else
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+static int
+EvInit(GW_EVENTS *ev)
+{
+#ifdef USE_EPOLL
+  ev->epfd = epoll_create(64);
+  return ev->epfd != -1;
+#else
+  memset(ev, 0, sizeof(GW_EVENTS));
+  return TRUE;
+#endif
+}
+
+static void
+EvFree(GW_EVENTS *ev)
 {
-	size_t i=0;
+#ifdef USE_EPOLL
+  close(ev->epfd);
+#else
+  free(ev->fds);
+  free(ev->ptrs);
+  memset(ev, 0, sizeof(GW_EVENTS));
+#endif
+}
 
-	while(i < length-1) {
-		char c;
-		int n = read(sockfd, &c, 1);
+/* Watch fd for events; old is the mask set before, 0 if none */
+static int
+EvSet(GW_EVENTS *ev, int fd, int events, int old, void *ptr)
+{
+#ifdef USE_EPOLL
+  struct epoll_event e;
 
-		if(n == 0)
-			break;
+  e.events = ((events & EV_READ) ? EPOLLIN : 0) |
+    ((events & EV_WRITE) ? EPOLLOUT : 0);
+  e.data.ptr = ptr;
+  return epoll_ctl(ev->epfd, old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &e) == 0;
+#else
+  int i;
 
-		buffer[i] = c;
-		i++;
+  for (i = 0; i < ev->num; i++)
+    if (ev->fds[i].fd == fd)
+      break;
+  if (i == ev->num)
+    {
+      if (ev->num == ev->max)
+	{
+	  int max = ev->max ? ev->max * 2 : 64;
+	  struct pollfd *fds = realloc(ev->fds, max * sizeof(struct pollfd));
+	  void **ptrs;
 
-		if(c == '\n')
-			break;
+	  if (!fds)
+	    return FALSE;
+	  ev->fds = fds;
+	  ptrs = realloc(ev->ptrs, max * sizeof(void *));
+	  if (!ptrs)
+	    return FALSE;
+	  ev->ptrs = ptrs;
+	  ev->max = max;
 	}
-	buffer[i]='\0';
-	i++;
+      ev->fds[i].fd = fd;
+      ev->num++;
+    }
+  ev->fds[i].events = ((events & EV_READ) ? POLLIN : 0) |
+    ((events & EV_WRITE) ? POLLOUT : 0);
+  ev->fds[i].revents = 0;
+  ev->ptrs[i] = ptr;
+  return TRUE;
+#endif
+}
+
+static void
+EvDel(GW_EVENTS *ev, int fd)
+{
+#ifdef USE_EPOLL
+  struct epoll_event e = { 0 };
+  epoll_ctl(ev->epfd, EPOLL_CTL_DEL, fd, &e);
+#else
+  int i;
+
+  for (i = 0; i < ev->num; i++)
+    if (ev->fds[i].fd == fd)
+      {
+	ev->num--;
+	ev->fds[i] = ev->fds[ev->num];
+	ev->ptrs[i] = ev->ptrs[ev->num];
+	break;
+      }
+#endif
+}
 
-	return i;
+/* Errors and hangups are reported as EV_READ; the read sees them */
+static int
+EvWait(GW_EVENTS *ev, GW_EVENT *out, int max, int timeout)
+{
+#ifdef USE_EPOLL
+  struct epoll_event e[64];
+  int i, n;
+
+  if (max > 64)
+    max = 64;
+  n = epoll_wait(ev->epfd, e, max, timeout);
+  for (i = 0; i < n; i++)
+    {
+      out[i].ptr = e[i].data.ptr;
+      out[i].events =
+	((e[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? EV_READ : 0) |
+	((e[i].events & EPOLLOUT) ? EV_WRITE : 0);
+    }
+  return n < 0 ? 0 : n;
+#else
+  int i, n, j = 0;
+
+  n = poll(ev->fds, ev->num, timeout);
+  for (i = 0; i < ev->num && j < n && j < max; i++)
+    {
+      int re = ev->fds[i].revents;
+      if (!re)
+	continue;
+      out[j].ptr = ev->ptrs[i];
+      out[j].events = ((re & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) ? EV_READ : 0) |
+	((re & POLLOUT) ? EV_WRITE : 0);
+      j++;
+    }
+  return j;
+#endif
 }
 
-int isHTTPRequestEOF(char *line, size_t length)
+static void
+ServerWake(STREAMING_SERVER *server)
 {
-	if(length < 2)
-		return TRUE;
+#ifndef WIN32
+  char c = 0;
+  if (write(server->wake[1], &c, 1) < 0)
+    return;			// full pipe: a wakeup is pending anyway
+#endif
+}
 
-	if(line[0]=='\r' && line[1]=='\n')
-		return TRUE;
+/* Connection and stream ids, unique across shards */
+static int
+ServerId(STREAMING_SERVER *server)
+{
+  return ++server->nextid * server->nshards + server->shard;
+}
 
-	return FALSE;
+static GW_CHUNK *
+ChunkNew(const char *data, int len)
+{
+  GW_CHUNK *ch = malloc(offsetof(GW_CHUNK, data) + len);
+
+  if (!ch)
+    return NULL;
+  ch->next = NULL;
+  ch->refs = 1;
+  ch->len = len;
+  ch->off = 0;
+  ch->seg = NULL;
+  ch->ts = 0;
+  memcpy(ch->data, data, len);
+  return ch;
 }
-*/
 
-void processTCPrequest(STREAMING_SERVER * server,	// server socket and state (our listening socket)
-		       int sockfd	// client connection socket
-  )
+/* called with the owning stream's lock held */
+static void
+ChunkRelease(GW_CHUNK *ch)
 {
-  char buf[512] = { 0 };	// answer buffer
-  char header[2048] = { 0 };	// request header
-  char *filename = NULL;	// GET request: file name //512 not enuf
-  char *buffer = NULL;		// stream buffer
-  char *ptr = NULL;		// header pointer
-  int len;
+  if (--ch->refs == 0)
+    free(ch);
+}
+
+/* called with the store lock held */
+static void
+SegmentRelease(GW_SEGMENT *seg)
+{
+  if (seg && --seg->refs == 0)
+    free(seg);
+}
 
-  size_t nRead = 0;
+static void
+RequestFree(GW_REQUEST *rq)
+{
+  if (!rq)
+    return;
+  if (rq->ownextras)
+    AMF_Reset(&rq->req.extras);
+  free(rq);
+}
 
-  char srvhead[] = "\r\nServer: HTTP-RTMP Stream Server " RTMPDUMP_VERSION "\r\n";
+static GW_INDEX *
+IndexNew(const char *key)
+{
+  GW_INDEX *ix = calloc(1, sizeof(GW_INDEX));
 
-  char *status = "404 Not Found";
+  if (ix && !(ix->key = strdup(key)))
+    {
+      free(ix);
+      ix = NULL;
+    }
+  return ix;
+}
 
-  server->state = STREAMING_IN_PROGRESS;
+static void
+IndexFree(GW_INDEX *ix)
+{
+  if (!ix)
+    return;
+  free(ix->key);
+  free(ix->pos);
+  free(ix->times);
+  free(ix->meta);
+  free(ix);
+}
 
-  RTMP rtmp = { 0 };
-  uint32_t dSeek = 0;		// can be used to start from a later point in the stream
+static int
+IndexAdd(GW_INDEX *ix, double pos, double t)
+{
+  double *p;
+  int max;
 
-  // reset RTMP options to defaults specified upon invokation of streams
-  RTMP_REQUEST req;
-  memcpy(&req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
+  if (ix->n && pos <= ix->pos[ix->n - 1])
+    return FALSE;		// offsets must ascend for IndexSeek
+  if (ix->n == ix->max)
+    {
+      max = ix->max ? ix->max * 2 : 256;
+      if (!(p = realloc(ix->pos, max * sizeof(double))))
+	return FALSE;
+      ix->pos = p;
+      if (!(p = realloc(ix->times, max * sizeof(double))))
+	return FALSE;
+      ix->times = p;
+      ix->max = max;
+    }
+  ix->pos[ix->n] = pos;
+  ix->times[ix->n] = t;
+  ix->n++;
+  return TRUE;
+}
+
+static void
+IndexSetMeta(GW_INDEX *ix, const char *tag, int len)
+{
+  if (!ix->meta && (ix->meta = malloc(len)))
+    {
+      memcpy(ix->meta, tag, len);
+      ix->metalen = len;
+    }
+}
+
+/* Publish ix, taking it over. One from metadata is not replaced by one
+ * counted on a download, as players seek by the offsets it lists.
+ */
+static void
+IndexPut(GW_STORE *store, GW_INDEX *ix)
+{
+  GW_INDEX **prev, *old, *drop = NULL;
+
+  TMutexLock(&store->lock);
+  for (prev = &store->index; (old = *prev); prev = &old->next)
+    if (!strcmp(old->key, ix->key))
+      break;
+  if (old && old->frommeta && !ix->frommeta)
+    drop = ix;
+  else
+    {
+      if (old)
+	{
+	  *prev = old->next;
+	  store->nindex--;
+	  drop = old;
+	}
+      ix->next = store->index;
+      store->index = ix;
+      if (++store->nindex > GW_INDEX_MAX)
+	{
+	  // drop the least recently used
+	  for (prev = &store->index; (*prev)->next; prev = &(*prev)->next);
+	  IndexFree(*prev);
+	  *prev = NULL;
+	  store->nindex--;
+	}
+    }
+  TMutexUnlock(&store->lock);
+  IndexFree(drop);
+}
+
+/* The time in ms of the last keyframe at or before byte offset pos in
+ * the stream with this key, 0 if pos is before the first; -1 if the
+ * stream has no index.
+ */
+static int
+IndexSeek(GW_STORE *store, const char *key, double pos)
+{
+  GW_INDEX **prev, *ix;
+  int lo, hi, mid, ms = -1;
+
+  TMutexLock(&store->lock);
+  for (prev = &store->index; (ix = *prev); prev = &ix->next)
+    if (!strcmp(ix->key, key))
+      break;
+  if (ix)
+    {
+      ms = 0;
+      if (pos >= ix->pos[0])
+	{
+	  for (lo = 0, hi = ix->n - 1; lo < hi;)
+	    {
+	      mid = (lo + hi + 1) / 2;
+	      if (ix->pos[mid] <= pos)
+		lo = mid;
+	      else
+		hi = mid - 1;
+	    }
+	  ms = (int) (ix->times[lo] * 1000.0);
+	}
+      *prev = ix->next;
+      ix->next = store->index;
+      store->index = ix;
+    }
+  TMutexUnlock(&store->lock);
+  return ms;
+}
 
-  // timeout for http requests
-  fd_set fds;
-  struct timeval tv;
+/* A copy of the onMetaData tag kept with the stream's index, or NULL */
+static GW_CHUNK *
+IndexMeta(GW_STORE *store, const char *key)
+{
+  GW_INDEX *ix;
+  GW_CHUNK *ch = NULL;
 
-  memset(&tv, 0, sizeof(struct timeval));
-  tv.tv_sec = 5;
+  TMutexLock(&store->lock);
+  for (ix = store->index; ix; ix = ix->next)
+    if (!strcmp(ix->key, key))
+      break;
+  if (ix && ix->meta)
+    ch = ChunkNew(ix->meta, ix->metalen);
+  TMutexUnlock(&store->lock);
+  return ch;
+}
 
-  // go through request lines
-  //do {
-  FD_ZERO(&fds);
-  FD_SET(sockfd, &fds);
+/* The cache file name for a stream's key */
+static void
+CacheName(const char *key, char *name)
+{
+  uint64_t h = 14695981039346656037ULL;
 
-  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0)
+  for (; *key; key++)
     {
-      RTMP_Log(RTMP_LOGERROR, "Request timeout/select failed, ignoring request");
-      goto quit;
+      h ^= (unsigned char) *key;
+      h *= 1099511628211ULL;
     }
+  sprintf(name, "%016llx", (unsigned long long) h);
+}
+
+static void
+CachePath(GW_STORE *store, GW_CACHE *ce, int part, char *path)
+{
+  if (part)
+    snprintf(path, GW_PATH_MAX, "%s/%s.%d.part", store->cachedir, ce->name,
+	     ce->id);
   else
+    snprintf(path, GW_PATH_MAX, "%s/%s.flv", store->cachedir, ce->name);
+}
+
+/* The rest of the cache functions are called with store->lock held */
+static void
+CacheUnref(GW_CACHE *ce)
+{
+  if (!--ce->refs)
+    {
+      free(ce->key);
+      free(ce);
+    }
+}
+
+/* Drop ce from the list, its file stays */
+static void
+CacheUnlist(GW_STORE *store, GW_CACHE *ce)
+{
+  GW_CACHE **prev;
+
+  for (prev = &store->cache; *prev != ce; prev = &(*prev)->next);
+  *prev = ce->next;
+  ce->listed = FALSE;
+  store->cachesize -= ce->size;
+  CacheUnref(ce);
+}
+
+/* Remove whole files, least recently used first, until under the cap.
+ * Clients still sending one keep their open copy.
+ */
+static void
+CacheTrim(GW_STORE *store)
+{
+  GW_CACHE *ce, *last;
+  char path[GW_PATH_MAX];
+
+  while (store->cachesize > store->cachemax)
+    {
+      last = NULL;
+      for (ce = store->cache; ce; ce = ce->next)
+	if (ce->done)
+	  last = ce;
+      if (!last)
+	break;
+      CachePath(store, last, FALSE, path);
+      RTMP_Log(RTMP_LOGDEBUG, "%s: removing %s, %lld bytes", __FUNCTION__,
+	  path, (long long) last->size);
+      unlink(path);
+      CacheUnlist(store, last);
+    }
+}
+
+/* Find the entry for name and make it the most recently used */
+static GW_CACHE *
+CacheFind(GW_STORE *store, const char *name)
+{
+  GW_CACHE **prev, *ce;
+
+  for (prev = &store->cache; (ce = *prev); prev = &ce->next)
+    if (!strcmp(ce->name, name))
+      {
+	*prev = ce->next;
+	ce->next = store->cache;
+	store->cache = ce;
+	break;
+      }
+  return ce;
+}
+
+typedef struct
+{
+  GW_CACHE *ce;
+  time_t mtime;
+} GW_CACHEFILE;
+
+static int
+CacheFileCmp(const void *a, const void *b)
+{
+  time_t x = ((const GW_CACHEFILE *) a)->mtime;
+  time_t y = ((const GW_CACHEFILE *) b)->mtime;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Read the key at the head of the cache file path; NULL if it has none
+ * or it doesn't hash to name.
+ */
+static char *
+CacheFileKey(const char *path, const char *name)
+{
+  char buf[4], check[17], *key = NULL;
+  unsigned int len;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_BINARY)) == -1)
+    return NULL;
+  if (read(fd, buf, 4) == 4 && (len = AMF_DecodeInt32(buf)) > 0
+      && len <= GW_KEY_MAX && (key = malloc(len + 1)))
+    {
+      if (read(fd, key, len) == (ssize_t) len && !memchr(key, 0, len))
+	{
+	  key[len] = '\0';
+	  CacheName(key, check);
+	}
+      else
+	check[0] = '\0';
+      if (strcmp(check, name))
+	{
+	  free(key);
+	  key = NULL;
+	}
+    }
+  close(fd);
+  return key;
+}
+
+/* At startup: take over the whole files a previous run left, newest
+ * first, and remove partial ones. Returns FALSE if the directory can't
+ * be read.
+ */
+static int
+CacheLoad(GW_STORE *store)
+{
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  GW_CACHEFILE *files = NULL, *f;
+  GW_CACHE *ce;
+  char path[GW_PATH_MAX], name[17], *key;
+  int i, n = 0, max = 0, len;
+
+  if (!(dir = opendir(store->cachedir)))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, can't open cache directory %s", __FUNCTION__,
+	  store->cachedir);
+      return FALSE;
+    }
+  while ((de = readdir(dir)))
+    {
+      len = strlen(de->d_name);
+      // only our own names: <16 hex>.flv and <16 hex>.<id>.part
+      if (len < 16 + 4 || de->d_name[16] != '.'
+	  || strspn(de->d_name, "0123456789abcdef") != 16)
+	continue;
+      snprintf(path, sizeof(path), "%s/%s", store->cachedir, de->d_name);
+      if (len > 16 + 1 + 5 && !strcmp(de->d_name + len - 5, ".part")
+	  && strspn(de->d_name + 17, "0123456789") == (size_t) len - 17 - 5)
+	{
+	  unlink(path);
+	  continue;
+	}
+      if (len != 16 + 4 || strcmp(de->d_name + 16, ".flv")
+	  || stat(path, &st) || !S_ISREG(st.st_mode))
+	continue;
+      memcpy(name, de->d_name, 16);
+      name[16] = '\0';
+      if (!(key = CacheFileKey(path, name)))
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s: %s has no valid key, removing it",
+	      __FUNCTION__, path);
+	  unlink(path);
+	  continue;
+	}
+      if (n == max)
+	{
+	  max = max ? max * 2 : 64;
+	  if (!(f = realloc(files, max * sizeof(GW_CACHEFILE))))
+	    {
+	      free(key);
+	      break;
+	    }
+	  files = f;
+	}
+      if (!(ce = calloc(1, sizeof(GW_CACHE))))
+	{
+	  free(key);
+	  break;
+	}
+      strcpy(ce->name, name);
+      ce->key = key;
+      ce->hlen = 4 + strlen(key);
+      ce->size = st.st_size - ce->hlen;
+      ce->done = TRUE;
+      ce->listed = TRUE;
+      ce->refs = 1;
+      files[n].ce = ce;
+      files[n++].mtime = st.st_mtime;
+    }
+  closedir(dir);
+
+  qsort(files, n, sizeof(GW_CACHEFILE), CacheFileCmp);
+  for (i = n - 1; i >= 0; i--)
     {
-      nRead = recv(sockfd, header, 2047, 0);
-      header[2047] = '\0';
+      files[i].ce->next = store->cache;
+      store->cache = files[i].ce;
+      store->cachesize += files[i].ce->size;
+    }
+  free(files);
+  CacheTrim(store);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: %d cache files, %lld bytes", __FUNCTION__, n,
+      (long long) store->cachesize);
+  return TRUE;
+}
 
-      RTMP_Log(RTMP_LOGDEBUG, "%s: header: %s", __FUNCTION__, header);
+/* Send up to len bytes of the file fd from *off without blocking */
+static int
+FileSend(int sockfd, int fd, int64_t *off, int64_t len)
+{
+#ifdef __linux__
+  off_t o = *off;
+  ssize_t n;
+
+  n = sendfile(sockfd, fd, &o, len > (1 << 30) ? (1 << 30) : len);
+  if (n > 0)
+    *off = o;
+  return n;
+#else
+  char buf[16384];
+  int n;
 
-      if (strstr(header, "Range: bytes=") != 0)
+  if (len > (int64_t) sizeof(buf))
+    len = sizeof(buf);
+  if (lseek(fd, *off, SEEK_SET) < 0)
+    return -1;
+  if ((n = read(fd, buf, len)) <= 0)
+    return n;
+  n = send(sockfd, buf, n, 0);
+  if (n > 0)
+    *off += n;
+  return n;
+#endif
+}
+
+/* The newest HLS stream called name; called with the store lock held */
+static GW_HLS *
+HlsFind(GW_STORE *store, const char *name)
+{
+  GW_HLS *h;
+
+  for (h = store->hls; h; h = h->next)
+    if (!strcmp(h->name, name))
+      break;
+  return h;
+}
+
+/* Take h off the store's list and drop its segments, so it can be
+ * listed again from scratch; called with the store lock held.
+ */
+static void
+HlsUnlist(GW_STORE *store, GW_HLS *h)
+{
+  GW_HLS **prev;
+  int i;
+
+  for (prev = &store->hls; *prev != h; prev = &(*prev)->next);
+  *prev = h->next;
+  h->listed = FALSE;
+  for (i = 0; i < GW_HLS_KEEP; i++)
+    {
+      SegmentRelease(h->seg[i]);
+      h->seg[i] = NULL;
+    }
+  h->nseg = 0;
+  h->maxdur = 0;
+}
+
+static void
+HlsFree(GW_STORE *store, GW_HLS *h)
+{
+  int i;
+
+  if (!h)
+    return;
+  // clients may still be sending them
+  TMutexLock(&store->lock);
+  for (i = 0; i < GW_HLS_KEEP; i++)
+    SegmentRelease(h->seg[i]);
+  TMutexUnlock(&store->lock);
+  free(h->buf);
+  free(h->es);
+  free(h->sps);
+  free(h);
+}
+
+/* Write h's playlist, its last few segments, into buf; called with the
+ * store lock held.
+ */
+static int
+HlsPlaylist(GW_HLS *h, char *buf, int size)
+{
+  uint32_t i, first = h->nseg > GW_HLS_LIST ? h->nseg - GW_HLS_LIST : 0;
+  int len;
+
+  len = snprintf(buf, size,
+		 "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%u\n"
+		 "#EXT-X-MEDIA-SEQUENCE:%u\n", (h->maxdur + 999) / 1000, first);
+  for (i = first; i < h->nseg && len < size; i++)
+    len += snprintf(buf + len, size - len, "#EXTINF:%.3f,\nhls/%s/%u.ts\n",
+		    h->seg[i % GW_HLS_KEEP]->dur / 1000.0, h->tag, i);
+  if (h->ended && len < size)
+    len += snprintf(buf + len, size - len, "#EXT-X-ENDLIST\n");
+  return len < size ? len : size - 1;
+}
+
+/* Put s on the server's ready list; called with s->lock held */
+static void
+StreamReady(GW_STREAM *s)
+{
+  STREAMING_SERVER *server = s->server;
+  int wake = FALSE;
+
+  TMutexLock(&server->lock);
+  if (!s->ready)
+    {
+      s->ready = TRUE;
+      s->rnext = server->ready;
+      wake = server->ready == NULL;
+      server->ready = s;
+    }
+  TMutexUnlock(&server->lock);
+  if (wake)
+    ServerWake(server);
+}
+
+static void
+StreamRelease(GW_STREAM *s)
+{
+  int i, refs;
+
+  TMutexLock(&s->lock);
+  refs = --s->refs;
+  TMutexUnlock(&s->lock);
+  if (refs)
+    return;
+
+  for (i = 0; i < GW_RING_SLOTS; i++)
+    if (s->ring[i])
+      ChunkRelease(s->ring[i]);
+  for (i = 0; i < GW_INIT_MAX; i++)
+    if (s->init[i])
+      ChunkRelease(s->init[i]);
+  if (s->cache)
+    {
+      TMutexLock(&s->server->store->lock);
+      CacheUnref(s->cache);
+      TMutexUnlock(&s->server->store->lock);
+    }
+  HlsFree(s->server->store, s->hls);
+  RequestFree(s->rq);
+  free(s->key);
+  free(s->ikey);
+  TCondFree(&s->cond);
+  TMutexFree(&s->lock);
+  free(s);
+}
+
+static int
+IsMetaTag(const char *tag, int len)
+{
+  return (tag[0] & 0x1f) == RTMP_PACKET_TYPE_INFO && len >= 11 + 13 + 4
+    && !memcmp(tag + 11, "\002\000\012onMetaData", 13);
+}
+
+/* Keep what a client joining at the last keyframe needs to decode;
+ * called with s->lock held, before ch is appended.
+ */
+static void
+StreamIndex(GW_STREAM *s, GW_CHUNK *ch)
+{
+  const unsigned char *d = (const unsigned char *) ch->data;
+  int init = -1;
+
+  if (ch->len < 11 + 2 + 4)
+    return;
+  switch (d[0] & 0x1f)
+    {
+    case RTMP_PACKET_TYPE_INFO:
+      if (IsMetaTag(ch->data, ch->len))
+	init = GW_INIT_META;
+      break;
+    case RTMP_PACKET_TYPE_VIDEO:
+      if ((d[11] & 0x0f) == 7 && d[12] == 0)
+	init = GW_INIT_VIDEO;
+      else if ((d[11] >> 4) == 1)
+	{
+	  s->gopseq = s->head;
+	  s->havegop = TRUE;
+	}
+      break;
+    case RTMP_PACKET_TYPE_AUDIO:
+      if ((d[11] >> 4) == 10 && d[12] == 0)
+	init = GW_INIT_AUDIO;
+      break;
+    }
+  if (init != -1)
+    {
+      if (s->init[init])
+	ChunkRelease(s->init[init]);
+      ch->refs++;
+      s->init[init] = ch;
+    }
+}
+
+/* Session thread: append one tag, taking over ch. A single client's
+ * stream waits for it to fall less than a ring behind; a shared one,
+ * or one left to clients of its cache file, overwrites the oldest tag
+ * instead. Returns FALSE once the stream has no clients left.
+ */
+static int
+StreamPut(GW_STREAM *s, GW_CHUNK *ch)
+{
+  GW_CHUNK **slot;
+  int ok;
+
+  TMutexLock(&s->lock);
+  while (s->paced && s->head - s->rseq >= GW_RING_SLOTS && !s->closing)
+    TCondWait(&s->cond, &s->lock);
+  ok = !s->closing;
+  if (ok)
+    {
+      slot = &s->ring[s->head % GW_RING_SLOTS];
+      if (*slot)
+	ChunkRelease(*slot);
+      *slot = ch;
+      StreamIndex(s, ch);
+      s->lastts = ch->ts;
+      s->head++;
+      StreamReady(s);
+    }
+  else
+    ChunkRelease(ch);
+  TMutexUnlock(&s->lock);
+  return ok;
+}
+
+#define SAVC(x)	static const AVal av_##x = AVC(#x)
+
+SAVC(keyframes);
+SAVC(filepositions);
+SAVC(times);
+
+/* Where the keyframes object of onMetaData keeps its two arrays */
+typedef struct GW_KFWALK
+{
+  int depth;			// of the keyframes object, -1 until found
+  const char *pos, *times;	// the arrays, marker included
+  int posSize, timesSize;
+} GW_KFWALK;
+
+static int
+WalkKeyframes(const AMFWalkEvent *ev, void *ctx)
+{
+  GW_KFWALK *w = ctx;
+
+  if (w->depth < 0)
+    {
+      // the first property so named, as RTMP_FindFirstMatchingProperty
+      if (!AVMATCH(&ev->e_name, &av_keyframes))
+	return AMF_WALK_CONTINUE;
+      if (ev->e_type != AMF_OBJECT && ev->e_type != AMF_ECMA_ARRAY)
+	return AMF_WALK_STOP;
+      w->depth = ev->e_depth;
+      return AMF_WALK_CONTINUE;
+    }
+  if (ev->e_depth == w->depth)
+    return AMF_WALK_STOP;	// end of the keyframes object
+  if (ev->e_depth != w->depth + 1 || ev->e_type == AMF_OBJECT_END)
+    return AMF_WALK_CONTINUE;
+  if (!w->pos && AVMATCH(&ev->e_name, &av_filepositions))
+    {
+      w->pos = ev->e_data;
+      w->posSize = ev->e_size;
+    }
+  else if (!w->times && AVMATCH(&ev->e_name, &av_times))
+    {
+      w->times = ev->e_data;
+      w->timesSize = ev->e_size;
+    }
+  // the numbers are read in bulk once the walk is done
+  return AMF_WALK_SKIP;
+}
+
+/* Session thread: publish the keyframes object of onMetaData, if any */
+static void
+StreamMetaIndex(GW_STREAM *s, const char *tag, int len)
+{
+  GW_KFWALK w;
+  GW_INDEX *ix = NULL;
+  double *pos = NULL, *times;
+  int i, n, nt;
+
+  memset(&w, 0, sizeof(w));
+  w.depth = -1;
+  if (AMF_Walk(tag + 11, len - 11 - 4, WalkKeyframes, &w) < 0
+      || !w.pos || !w.times
+      || AMF_DecodeNumberArray(w.pos, w.posSize, NULL, 0, &n) < 0 || !n
+      || !(pos = malloc(2 * n * sizeof(double))))
+    goto done;
+  times = pos + n;
+  if (AMF_DecodeNumberArray(w.pos, w.posSize, pos, n, &n) < 0
+      || AMF_DecodeNumberArray(w.times, w.timesSize, times, n, &nt) < 0
+      || nt != n)
+    goto done;
+
+  if (!(ix = IndexNew(s->ikey)))
+    goto done;
+  ix->frommeta = TRUE;
+  for (i = 0; i < n; i++)
+    if (!IndexAdd(ix, pos[i], times[i]))
+      goto done;
+  IndexSetMeta(ix, tag, len);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: stream %d lists %d keyframes", __FUNCTION__,
+      s->id, ix->n);
+  IndexPut(s->server->store, ix);
+  ix = NULL;
+
+done:
+  IndexFree(ix);
+  free(pos);
+}
+
+/* Session thread, VOD: learn where keyframes are from the tag at
+ * s->outpos of the FLV.
+ */
+static void
+StreamLearn(GW_STREAM *s, const char *tag, int len, uint32_t ts)
+{
+  const unsigned char *d = (const unsigned char *) tag;
+
+  if (IsMetaTag(tag, len))
+    {
+      if (s->built)
+	IndexSetMeta(s->built, tag, len);
+      StreamMetaIndex(s, tag, len);
+    }
+  else if (s->built && (d[0] & 0x1f) == RTMP_PACKET_TYPE_VIDEO
+	   && len >= 11 + 2 + 4 && (d[11] >> 4) == 1
+	   && !((d[11] & 0x0f) == 7 && d[12] == 0)
+	   && !IndexAdd(s->built, s->outpos, ts / 1000.0))
+    {
+      IndexFree(s->built);
+      s->built = NULL;
+    }
+  s->outpos += len;
+}
+
+/* Session thread: stop writing s's cache file and remove it */
+static void
+StreamUncache(GW_STREAM *s)
+{
+  GW_STORE *store = s->server->store;
+  char part[GW_PATH_MAX];
+
+  if (s->cfd != -1)
+    close(s->cfd);
+  s->cfd = -1;
+  CachePath(store, s->cache, TRUE, part);
+  unlink(part);
+  TMutexLock(&store->lock);
+  s->cache->writer = NULL;
+  if (s->cache->listed)
+    CacheUnlist(store, s->cache);
+  TMutexUnlock(&store->lock);
+}
+
+/* Session thread: append FLV bytes to s's cache file and let its
+ * readers know.
+ */
+static void
+StreamTee(GW_STREAM *s, const char *data, int len)
+{
+  GW_STORE *store = s->server->store;
+  GW_CACHE *ce = s->cache;
+
+  if (s->cfd == -1 || !len)
+    return;
+  if (write(s->cfd, data, len) != len)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s: can't write cache file, stream %d not cached",
+	  __FUNCTION__, s->id);
+      StreamUncache(s);
+    }
+  else
+    {
+      TMutexLock(&store->lock);
+      ce->size += len;
+      if (ce->listed)
+	{
+	  store->cachesize += len;
+	  CacheTrim(store);
+	}
+      TMutexUnlock(&store->lock);
+    }
+  TMutexLock(&s->lock);
+  if (!s->closing)
+    StreamReady(s);
+  TMutexUnlock(&s->lock);
+}
+
+/* Session thread: keep the cache file of a whole download */
+static void
+StreamCacheEnd(GW_STREAM *s, int complete)
+{
+  GW_STORE *store = s->server->store;
+  GW_CACHE *ce = s->cache;
+  char part[GW_PATH_MAX], path[GW_PATH_MAX];
+
+  if (s->cfd == -1)
+    return;
+  if (close(s->cfd) || !complete)
+    {
+      s->cfd = -1;
+      StreamUncache(s);
+      return;
+    }
+  s->cfd = -1;
+  CachePath(store, ce, TRUE, part);
+  CachePath(store, ce, FALSE, path);
+  TMutexLock(&store->lock);
+  ce->writer = NULL;
+  if (ce->listed && !rename(part, path))
+    {
+      ce->done = TRUE;
+      RTMP_Log(RTMP_LOGDEBUG, "%s: cached stream %d as %s, %lld bytes",
+	  __FUNCTION__, s->id, path, (long long) ce->size);
+    }
+  else
+    {
+      unlink(part);
+      if (ce->listed)
+	CacheUnlist(store, ce);
+    }
+  TMutexUnlock(&store->lock);
+}
+
+/* MPEG-TS for HLS segments: a PAT, a PMT, and a PID per track */
+#define TS_PACKET	188
+#define TS_PID_PMT	0x1000
+#define TS_PID_VIDEO	0x100
+#define TS_PID_AUDIO	0x101
+#define TS_DELAY	63000	// PTS ahead of PCR, 700ms at 90kHz
+
+static int
+HlsGrow(char **buf, int *size, int need)
+{
+  char *b;
+  int n = *size ? *size : 64 * 1024;
+
+  while (n < need)
+    n *= 2;
+  if (n == *size)
+    return TRUE;
+  if (!(b = realloc(*buf, n)))
+    return FALSE;
+  *buf = b;
+  *size = n;
+  return TRUE;
+}
+
+static uint32_t
+TsCrc(const unsigned char *p, int len)
+{
+  uint32_t crc = 0xffffffff;
+  int i;
+
+  while (len--)
+    {
+      crc ^= (uint32_t) *p++ << 24;
+      for (i = 0; i < 8; i++)
+	crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+  return crc;
+}
+
+/* Session thread: append data as TS packets of pid, the first one
+ * with a PCR if pcr >= 0 and flagged as a random access point if rai.
+ * The last one is padded out with adaptation field stuffing.
+ */
+static int
+TsWrite(GW_HLS *h, int pid, int cc, const unsigned char *data, int len,
+	int64_t pcr, int rai)
+{
+  unsigned char *p, *q;
+  int first = TRUE, n, afl, room;
+
+  while (len > 0)
+    {
+      if (!HlsGrow(&h->buf, &h->size, h->len + TS_PACKET))
+	return FALSE;
+      p = (unsigned char *) h->buf + h->len;
+      h->len += TS_PACKET;
+
+      afl = -1;			// adaptation field length, -1 for none
+      if (first && (pcr >= 0 || rai))
+	afl = 1 + (pcr >= 0 ? 6 : 0);
+      room = TS_PACKET - 4 - (afl >= 0 ? afl + 1 : 0);
+      n = len < room ? len : room;
+      if (n < room)
+	afl = afl < 0 ? room - n - 1 : afl + room - n;
+
+      p[0] = 0x47;
+      p[1] = (first ? 0x40 : 0) | (pid >> 8);
+      p[2] = pid & 0xff;
+      p[3] = (afl >= 0 ? 0x30 : 0x10) | (h->cc[cc]++ & 0x0f);
+      q = p + 4;
+      if (afl >= 0)
+	{
+	  *q++ = afl;
+	  if (afl > 0)
+	    {
+	      *q++ = (first && rai ? 0x40 : 0) | (first && pcr >= 0 ? 0x10 : 0);
+	      if (first && pcr >= 0)
+		{
+		  q[0] = pcr >> 25;
+		  q[1] = pcr >> 17;
+		  q[2] = pcr >> 9;
+		  q[3] = pcr >> 1;
+		  q[4] = ((pcr & 1) << 7) | 0x7e;
+		  q[5] = 0;
+		  q += 6;
+		}
+	      memset(q, 0xff, p + 5 + afl - q);
+	      q = p + 5 + afl;
+	    }
+	}
+      memcpy(q, data, n);
+      data += n;
+      len -= n;
+      first = FALSE;
+    }
+  return TRUE;
+}
+
+/* Session thread: a PAT and a PMT for the tracks seen, to start each
+ * segment with.
+ */
+static int
+TsTables(GW_HLS *h)
+{
+  unsigned char sec[64], *p, *start;
+  uint32_t crc;
+  int len;
+
+  // PAT: program 1 at TS_PID_PMT
+  p = sec;
+  *p++ = 0;			// pointer field
+  start = p;
+  *p++ = 0x00;
+  p += 2;
+  *p++ = 0x00;
+  *p++ = 0x01;			// transport stream id
+  *p++ = 0xc1;
+  *p++ = 0x00;
+  *p++ = 0x00;
+  *p++ = 0x00;
+  *p++ = 0x01;
+  *p++ = 0xe0 | (TS_PID_PMT >> 8);
+  *p++ = TS_PID_PMT & 0xff;
+  len = p - start - 3 + 4;
+  start[1] = 0xb0 | (len >> 8);
+  start[2] = len;
+  crc = TsCrc(start, p - start);
+  *p++ = crc >> 24;
+  *p++ = crc >> 16;
+  *p++ = crc >> 8;
+  *p++ = crc;
+  if (!TsWrite(h, 0, TS_CC_PAT, sec, p - sec, -1, FALSE))
+    return FALSE;
+
+  // PMT: H.264 and ADTS AAC, the clock on the video if there is any
+  p = sec;
+  *p++ = 0;
+  start = p;
+  *p++ = 0x02;
+  p += 2;
+  *p++ = 0x00;
+  *p++ = 0x01;			// program number
+  *p++ = 0xc1;
+  *p++ = 0x00;
+  *p++ = 0x00;
+  *p++ = 0xe0 | ((h->nalsize ? TS_PID_VIDEO : TS_PID_AUDIO) >> 8);
+  *p++ = (h->nalsize ? TS_PID_VIDEO : TS_PID_AUDIO) & 0xff;
+  *p++ = 0xf0;
+  *p++ = 0x00;
+  if (h->nalsize)
+    {
+      *p++ = 0x1b;
+      *p++ = 0xe0 | (TS_PID_VIDEO >> 8);
+      *p++ = TS_PID_VIDEO & 0xff;
+      *p++ = 0xf0;
+      *p++ = 0x00;
+    }
+  if (h->hasaudio)
+    {
+      *p++ = 0x0f;
+      *p++ = 0xe0 | (TS_PID_AUDIO >> 8);
+      *p++ = TS_PID_AUDIO & 0xff;
+      *p++ = 0xf0;
+      *p++ = 0x00;
+    }
+  len = p - start - 3 + 4;
+  start[1] = 0xb0 | (len >> 8);
+  start[2] = len;
+  crc = TsCrc(start, p - start);
+  *p++ = crc >> 24;
+  *p++ = crc >> 16;
+  *p++ = crc >> 8;
+  *p++ = crc;
+  return TsWrite(h, TS_PID_PMT, TS_CC_PMT, sec, p - sec, -1, FALSE);
+}
+
+/* Session thread: an FLV timestamp at 90kHz. They need not start at 0,
+ * librtmp starts some live streams just below it.
+ */
+static int64_t
+HlsTime(GW_HLS *h, uint32_t ts)
+{
+  return (int64_t) (int32_t) (ts - h->tbase) * 90;
+}
+
+static void
+PesTime(unsigned char *p, int prefix, uint64_t t)
+{
+  p[0] = (prefix << 4) | ((t >> 29) & 0x0e) | 1;
+  p[1] = t >> 22;
+  p[2] = ((t >> 14) & 0xfe) | 1;
+  p[3] = t >> 7;
+  p[4] = (t << 1) | 1;
+}
+
+/* Session thread: fill in the PES header at the start of h->es, which
+ * holds len bytes with the frame after it, and write it out. Times are
+ * at 90kHz; the PCR goes with the video, or the audio if there is none.
+ */
+static int
+HlsPes(GW_HLS *h, int video, int len, int64_t pts, int64_t dts, int key)
+{
+  unsigned char *p = (unsigned char *) h->es;
+  int plen = len - 6;
+
+  p[0] = 0;
+  p[1] = 0;
+  p[2] = 1;
+  p[3] = video ? 0xe0 : 0xc0;
+  if (video || plen > 0xffff)
+    plen = 0;			// unbounded
+  p[4] = plen >> 8;
+  p[5] = plen;
+  p[6] = 0x80;
+  p[7] = video ? 0xc0 : 0x80;	// PTS, and DTS for video
+  p[8] = video ? 10 : 5;
+  PesTime(p + 9, video ? 3 : 2, pts + TS_DELAY);
+  if (video)
+    PesTime(p + 14, 1, dts + TS_DELAY);
+  return TsWrite(h, video ? TS_PID_VIDEO : TS_PID_AUDIO,
+		 video ? TS_CC_VIDEO : TS_CC_AUDIO, p, len,
+		 video || !h->nalsize ? (int64_t) (dts & 0x1ffffffffLL) : -1,
+		 key);
+}
+
+/* Session thread: keep the SPS and PPS of an AVCDecoderConfigurationRecord
+ * in Annex B form, to repeat before each keyframe.
+ */
+static void
+HlsAvcc(GW_HLS *h, const unsigned char *p, int len)
+{
+  const unsigned char *end = p + len;
+  char *sps;
+  int i, n, count, pps, slen = 0;
+
+  // a start code replaces each 2 byte length, at most doubling it
+  if (len < 6 || !(sps = malloc(len * 2)))
+    return;
+  h->nalsize = (p[4] & 3) + 1;
+  p += 5;
+  for (pps = 0; pps < 2 && p < end; pps++)
+    {
+      count = *p++ & (pps ? 0xff : 0x1f);
+      for (i = 0; i < count && end - p >= 2; i++)
+	{
+	  n = (p[0] << 8) | p[1];
+	  p += 2;
+	  if (n > end - p)
+	    break;
+	  memcpy(sps + slen, "\0\0\0\1", 4);
+	  memcpy(sps + slen + 4, p, n);
+	  slen += 4 + n;
+	  p += n;
+	}
+    }
+  free(h->sps);
+  h->sps = sps;
+  h->spslen = slen;
+}
+
+/* Session thread: one H.264 frame, from the AVC tag body b */
+static int
+HlsVideo(GW_HLS *h, const unsigned char *b, int blen, uint32_t ts, int key)
+{
+  static const unsigned char aud[] = { 0, 0, 0, 1, 0x09, 0xf0 };
+  const unsigned char *p = b + 5, *end = b + blen;
+  int32_t cts = (b[2] << 16) | (b[3] << 8) | b[4];
+  int len = 19, n, i;
+
+  if (cts & 0x800000)
+    cts -= 0x1000000;
+  // start codes grow a NALU by at most 3 bytes, its length is 1 or more
+  if (!HlsGrow(&h->es, &h->essize, len + sizeof(aud) + h->spslen + blen * 3))
+    return FALSE;
+  memcpy(h->es + len, aud, sizeof(aud));
+  len += sizeof(aud);
+  if (key)
+    {
+      memcpy(h->es + len, h->sps, h->spslen);
+      len += h->spslen;
+    }
+  while (end - p >= h->nalsize)
+    {
+      for (n = 0, i = 0; i < h->nalsize; i++)
+	n = (n << 8) | *p++;
+      if (n > end - p)
+	break;
+      if (n && (p[0] & 0x1f) != 9)
+	{
+	  memcpy(h->es + len, "\0\0\0\1", 4);
+	  memcpy(h->es + len + 4, p, n);
+	  len += 4 + n;
+	}
+      p += n;
+    }
+  return HlsPes(h, TRUE, len, HlsTime(h, ts) + cts * 90, HlsTime(h, ts),
+		key);
+}
+
+/* Session thread: one raw AAC frame, with an ADTS header */
+static int
+HlsAudio(GW_HLS *h, const unsigned char *raw, int n, uint32_t ts)
+{
+  unsigned char *p;
+  int flen = 7 + n;
+
+  if (flen > 0x1fff)
+    return TRUE;
+  if (!HlsGrow(&h->es, &h->essize, 14 + flen))
+    return FALSE;
+  p = (unsigned char *) h->es + 14;
+  p[0] = 0xff;
+  p[1] = 0xf1;
+  p[2] = (((h->aacprofile - 1) & 3) << 6) | ((h->aacrate & 0x0f) << 2)
+    | ((h->aacchans >> 2) & 1);
+  p[3] = ((h->aacchans & 3) << 6) | (flen >> 11);
+  p[4] = flen >> 3;
+  p[5] = ((flen & 7) << 5) | 0x1f;
+  p[6] = 0xfc;
+  memcpy(p + 7, raw, n);
+  return HlsPes(h, FALSE, 14 + flen, HlsTime(h, ts), HlsTime(h, ts),
+		!h->nalsize);
+}
+
+/* Session thread: publish the segment being muxed, if any, as ending at
+ * ts, and start the next one there unless this is the end or HLS was
+ * stopped.
+ */
+static void
+HlsCut(GW_STREAM *s, GW_HLS *h, uint32_t ts, int next)
+{
+  GW_STORE *store = s->server->store;
+  GW_SEGMENT *seg = NULL;
+  int listed, published = FALSE;
+
+  if (h->open && (seg = malloc(offsetof(GW_SEGMENT, data) + h->len)))
+    {
+      seg->refs = 1;
+      seg->len = h->len;
+      seg->dur = ts - h->t0;
+      memcpy(seg->data, h->buf, h->len);
+    }
+  h->open = FALSE;
+  h->len = 0;
+
+  TMutexLock(&store->lock);
+  listed = h->listed;
+  if (seg && listed)
+    {
+      SegmentRelease(h->seg[h->nseg % GW_HLS_KEEP]);
+      h->seg[h->nseg % GW_HLS_KEEP] = seg;
+      h->nseg++;
+      if (seg->dur > h->maxdur)
+	h->maxdur = seg->dur;
+      seg = NULL;
+      published = TRUE;
+    }
+  TMutexUnlock(&store->lock);
+  free(seg);
+
+  // playlist requests may be waiting for it
+  if (published)
+    {
+      TMutexLock(&s->lock);
+      if (!s->closing)
+	StreamReady(s);
+      TMutexUnlock(&s->lock);
+    }
+
+  if (next && listed)
+    {
+      if (!h->based)
+	{
+	  h->tbase = ts;
+	  h->based = TRUE;
+	}
+      h->t0 = h->tlast = ts;
+      h->open = TsTables(h);
+      if (!h->open)
+	h->len = 0;
+    }
+}
+
+/* Session thread: mux one FLV tag into the current segment, cutting it
+ * at a keyframe once it is long enough; audio only streams are cut at
+ * any frame.
+ */
+static void
+HlsTag(GW_STREAM *s, GW_HLS *h, const char *tag, int len, uint32_t ts)
+{
+  const unsigned char *b = (const unsigned char *) tag + 11;
+  int blen = len - 11 - 4, key, ok = TRUE;
+
+  if (blen < 2)
+    return;
+  switch (tag[0] & 0x1f)
+    {
+    case RTMP_PACKET_TYPE_VIDEO:
+      if ((b[0] & 0x0f) != 7)
+	return;
+      if (b[1] == 0)
+	{
+	  HlsAvcc(h, b + 5, blen - 5);
+	  return;
+	}
+      if (b[1] != 1 || blen < 5 || !h->nalsize)
+	return;
+      key = (b[0] >> 4) == 1;
+      if (key && (!h->open || ts - h->t0 >= GW_HLS_TARGET))
+	HlsCut(s, h, ts, TRUE);
+      if (h->open)
+	ok = HlsVideo(h, b, blen, ts, key);
+      break;
+    case RTMP_PACKET_TYPE_AUDIO:
+      if ((b[0] >> 4) != 10)
+	return;
+      if (b[1] == 0)
+	{
+	  if (blen >= 4)
+	    {
+	      h->aacprofile = b[2] >> 3;
+	      h->aacrate = ((b[2] & 7) << 1) | (b[3] >> 7);
+	      h->aacchans = (b[3] >> 3) & 0x0f;
+	      h->hasaudio = TRUE;
+	    }
+	  return;
+	}
+      if (b[1] != 1 || !h->hasaudio)
+	return;
+      if (!h->nalsize && (!h->open || ts - h->t0 >= GW_HLS_TARGET))
+	HlsCut(s, h, ts, TRUE);
+      if (h->open)
+	ok = HlsAudio(h, b + 2, blen - 2, ts);
+      break;
+    default:
+      return;
+    }
+  if (!h->open)
+    return;
+  h->tlast = ts;
+  if (!ok || h->len > GW_HLS_MAXSEG)
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s: stream %d, dropping a %s HLS segment",
+	  __FUNCTION__, s->id, ok ? "runaway" : "failed");
+      h->open = FALSE;
+      h->len = 0;
+    }
+}
+
+/* Session thread: HLS was asked for once s was running, take the codec
+ * headers it already read.
+ */
+static void
+HlsPrime(GW_STREAM *s, GW_HLS *h)
+{
+  GW_CHUNK *init[2];
+  int i;
+
+  TMutexLock(&s->lock);
+  for (i = 0; i < 2; i++)
+    if ((init[i] = s->init[GW_INIT_VIDEO + i]))
+      init[i]->refs++;
+  TMutexUnlock(&s->lock);
+  for (i = 0; i < 2; i++)
+    if (init[i])
+      HlsTag(s, h, init[i]->data, init[i]->len, init[i]->ts);
+  TMutexLock(&s->lock);
+  for (i = 0; i < 2; i++)
+    if (init[i])
+      ChunkRelease(init[i]);
+  TMutexUnlock(&s->lock);
+  h->primed = TRUE;
+}
+
+/* Session thread: the stream ended, publish what is left */
+static void
+HlsFinish(GW_STREAM *s, GW_HLS *h)
+{
+  GW_STORE *store = s->server->store;
+
+  HlsCut(s, h, h->tlast, FALSE);
+  TMutexLock(&store->lock);
+  h->ended = TRUE;
+  TMutexUnlock(&store->lock);
+}
+
+/* Split what RTMP_Read returned into the FLV header and whole tags.
+ * Returns the bytes used, or -1 if the stream is closing.
+ */
+static int
+StreamParse(GW_STREAM *s, const char *buf, int len)
+{
+  static const char flvHeader[] = { 'F', 'L', 'V', 0x01, 0x05,
+    0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00
+  };
+  GW_CHUNK *ch, *meta;
+  GW_HLS *h;
+  int pos = 0, tlen;
+
+  TMutexLock(&s->lock);
+  h = s->hls;
+  TMutexUnlock(&s->lock);
+  if (h && !h->primed)
+    HlsPrime(s, h);
+
+  if (!s->init[GW_INIT_FLV])
+    {
+      if (len < (int) sizeof(flvHeader))
+	return 0;
+      if (memcmp(buf, "FLV", 3) == 0)
+	pos = sizeof(flvHeader);
+      // RTMP_Read only writes it on its first call
+      ch = ChunkNew(pos ? buf : flvHeader, sizeof(flvHeader));
+      if (!ch)
+	return -1;
+      TMutexLock(&s->lock);
+      s->init[GW_INIT_FLV] = ch;
+      TMutexUnlock(&s->lock);
+      if (!pos)
+	StreamTee(s, flvHeader, sizeof(flvHeader));
+    }
+
+  while (len - pos >= 11)
+    {
+      tlen = 11 + AMF_DecodeInt24(buf + pos + 1) + 4;
+      if (len - pos < tlen)
+	break;
+      ch = ChunkNew(buf + pos, tlen);
+      if (!ch)
+	return -1;
+      ch->ts = AMF_DecodeInt24(buf + pos + 4) |
+	((uint32_t) (unsigned char) buf[pos + 7] << 24);
+      if (s->ikey)
+	{
+	  // a seek may start right at the media, so that players
+	  // still get the metadata first, send the copy we have
+	  if (s->seek && !s->ntags++ && !IsMetaTag(ch->data, ch->len)
+	      && (meta = IndexMeta(s->server->store, s->ikey)) && !StreamPut(s, meta))
+	    {
+	      ChunkRelease(ch);
+	      return -1;
+	    }
+	  StreamLearn(s, ch->data, ch->len, ch->ts);
+	}
+      if (h)
+	HlsTag(s, h, ch->data, ch->len, ch->ts);
+      if (!StreamPut(s, ch))
+	return -1;
+      pos += tlen;
+    }
+  StreamTee(s, buf, pos);
+  return pos;
+}
+
+TFTYPE
+sessionThread(void *arg)
+{
+  GW_STREAM *s = arg;
+  STREAMING_SERVER *server = s->server;
+  RTMP_REQUEST *req = &s->rq->req;
+  RTMP *rtmp;
+  char *buffer = NULL;
+  int size = GW_CHUNK_SIZE, have = 0, used;
+  uint32_t dSeek = 0;		// can be used to start from a later point in the stream
+  uint32_t ts = 0;
+  double total = 0;
+  int nRead = 0, complete = FALSE;
+  GW_HLS *hls;
+
+  RTMP_LogSetConnId(s->id);
+
+  if (req->swfVfy)
+    {
+#ifdef CRYPTO
+        if (RTMP_HashSWF(req->swfUrl.av_val, &req->swfSize, req->hash, req->swfAge) == 0)
+          {
+            req->swfHash.av_val = (char *)req->hash;
+            req->swfHash.av_len = RTMP_SWF_HASHLEN;
+          }
+#endif
+    }
+
+  // User defined seek offset
+  if (req->dStartOffset > 0)
+    {
+      if (req->bLiveStream)
+	RTMP_Log(RTMP_LOGWARNING,
+	    "Can't seek in a live stream, ignoring --seek option");
+      else
+	dSeek += req->dStartOffset;
+    }
+
+  if (dSeek != 0)
+    {
+      RTMP_LogPrintf("Starting at TS: %d ms\n", dSeek);
+    }
+
+  // offsets of a download from the start are those a player will see
+  s->outpos = 13;
+  if (s->ikey && !s->seek)
+    s->built = IndexNew(s->ikey);
+
+  RTMP_Log(RTMP_LOGDEBUG, "Setting buffer time to: %dms", req->bufferTime);
+  rtmp = RTMP_Alloc();
+  buffer = malloc(size);
+  if (!rtmp || !buffer)
+    goto done;
+  RTMP_Init(rtmp);
+  RTMP_SetBufferMS(rtmp, req->bufferTime);
+  if (!req->fullUrl.av_len)
+    {
+      RTMP_SetupStream(rtmp, req->protocol, &req->hostname, req->rtmpport, &req->sockshost,
+		       &req->playpath, &req->tcUrl, &req->swfUrl, &req->pageUrl, &req->app, &req->auth, &req->swfHash, req->swfSize, &req->flashVer, &req->subscribepath, &req->usherToken, dSeek, req->dStopOffset,
+		       req->bLiveStream, req->timeout);
+    }
+  else
+    {
+      if (RTMP_SetupURL(rtmp, req->fullUrl.av_val) == FALSE)
+        {
+          RTMP_Log(RTMP_LOGERROR, "Couldn't parse URL: %s", req->fullUrl.av_val);
+          goto done;
+        }
+      if (dSeek)
+	rtmp->Link.seekTime = dSeek;
+    }
+  /* backward compatibility, we always sent this as true before */
+  if (req->auth.av_len)
+    rtmp->Link.lFlags |= RTMP_LF_AUTH;
+
+  rtmp->Link.extras = req->extras;
+  rtmp->Link.token = req->token;
+  rtmp->m_read.timestamp = dSeek;
+
+  RTMP_LogPrintf("Connecting ... port: %d, app: %s\n", req->rtmpport, req->app.av_val);
+  if (!RTMP_Connect(rtmp, NULL))
+    {
+      RTMP_LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+    }
+  else
+    {
+      TMutexLock(&s->lock);
+      if (!s->closing)
+	s->rtmpfd = RTMP_Socket(rtmp);
+      TMutexUnlock(&s->lock);
+
+      do
+	{
+	  nRead = RTMP_Read(rtmp, buffer + have, size - have);
+
+	  if (nRead > 0)
+	    {
+	      total += nRead;
+	      have += nRead;
+	      used = StreamParse(s, buffer, have);
+	      if (used < 0)
+		break;
+	      have -= used;
+	      memmove(buffer, buffer + used, have);
+	      if (have == size)
+		{
+		  // a tag bigger than the buffer
+		  char *b = realloc(buffer, size * 2);
+		  if (!b)
+		    break;
+		  buffer = b;
+		  size *= 2;
+		}
+	    }
+#ifdef _DEBUG
+	  else
+	    {
+	      RTMP_Log(RTMP_LOGDEBUG, "zero read!");
+	    }
+#endif
+	}
+      while (server->state == STREAMING_ACCEPTING && nRead > -1
+	     && RTMP_IsConnected(rtmp));
+
+      TMutexLock(&s->lock);
+      s->rtmpfd = -1;
+      TMutexUnlock(&s->lock);
+
+      // only a whole download gives a whole index or cache file
+      complete = rtmp->m_read.status == RTMP_READ_COMPLETE && !have;
+      if (s->built && complete && s->built->n)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s: stream %d counted %d keyframes",
+	      __FUNCTION__, s->id, s->built->n);
+	  IndexPut(server->store, s->built);
+	  s->built = NULL;
+	}
+    }
+  ts = rtmp->m_read.timestamp;
+  RTMP_Close(rtmp);
+
+done:
+  if (rtmp)
+    RTMP_Free(rtmp);
+  free(buffer);
+  IndexFree(s->built);
+  s->built = NULL;
+  StreamCacheEnd(s, complete);
+  TMutexLock(&s->lock);
+  hls = s->hls;
+  TMutexUnlock(&s->lock);
+  if (hls)
+    HlsFinish(s, hls);
+  RTMP_LogPrintf("Stream %d closed, %.3f KB / %.2f sec\n", s->id,
+	    total / 1024.0, (double) ts / 1000.0);
+
+  // let the event loop send the rest and close the clients
+  TMutexLock(&s->lock);
+  s->eof = TRUE;
+  if (!s->closing)
+    StreamReady(s);
+  TMutexUnlock(&s->lock);
+
+  StreamRelease(s);
+  RTMP_LogSetConnId(0);
+
+  // last: once sessions reaches 0 the shard may stop and be freed
+  TMutexLock(&server->lock);
+  server->sessions--;
+  ServerWake(server);
+  TMutexUnlock(&server->lock);
+  TFRET();
+}
+
+/* Event loop only: the last client has left s */
+static void
+StreamClose(GW_STREAM *s)
+{
+  STREAMING_SERVER *server = s->server;
+  GW_STREAM **prev;
+
+  if (s->pprev)
+    {
+      if ((*s->pprev = s->next))
+	s->next->pprev = s->pprev;
+      s->pprev = NULL;
+    }
+
+  TMutexLock(&s->lock);
+  s->closing = TRUE;
+  if (s->rtmpfd != -1)
+    shutdown(s->rtmpfd, 0);	// unblock the session's RTMP_Read
+  TCondSignal(&s->cond);
+  TMutexUnlock(&s->lock);
+
+  TMutexLock(&server->lock);
+  if (s->ready)
+    {
+      for (prev = &server->ready; *prev != s; prev = &(*prev)->rnext);
+      *prev = s->rnext;
+      s->ready = FALSE;
+    }
+  TMutexUnlock(&server->lock);
+
+  // the download stops, don't let another client read its file
+  if (s->cache)
+    {
+      TMutexLock(&server->store->lock);
+      if (s->cache->writer == s)
+	s->cache->writer = NULL;
+      TMutexUnlock(&server->store->lock);
+    }
+
+  RTMP_Log(RTMP_LOGDEBUG, "%s: closed stream %d", __FUNCTION__, s->id);
+  StreamRelease(s);
+}
+
+/* Event loop only: detach c from its stream */
+static void
+ClientLeave(GW_CLIENT *c)
+{
+  GW_STREAM *s = c->stream;
+
+  if (!s)
+    return;
+  if (c->cur)
+    {
+      TMutexLock(&s->lock);
+      ChunkRelease(c->cur);
+      TMutexUnlock(&s->lock);
+      c->cur = NULL;
+    }
+  if ((*c->spprev = c->snext))
+    c->snext->spprev = c->spprev;
+  c->stream = NULL;
+  if (!s->clients && !s->hlsopen)
+    StreamClose(s);
+  else if (s->paced && c->cfd == -1)
+    {
+      // only readers of its cache file are left
+      TMutexLock(&s->lock);
+      s->paced = FALSE;
+      TCondSignal(&s->cond);
+      TMutexUnlock(&s->lock);
+    }
+}
+
+/* drop c's reference to a queued HLS segment */
+static void
+ClientSegmentRelease(GW_CLIENT *c, GW_SEGMENT *seg)
+{
+  TMutexLock(&c->server->store->lock);
+  SegmentRelease(seg);
+  TMutexUnlock(&c->server->store->lock);
+}
+
+/* free a chunk off c's own queue */
+static void
+ClientChunkFree(GW_CLIENT *c, GW_CHUNK *ch)
+{
+  if (ch->seg)
+    ClientSegmentRelease(c, ch->seg);
+  free(ch);
+}
+
+/* Event loop only: done with c's cache file */
+static void
+ClientUncache(GW_CLIENT *c)
+{
+  GW_STORE *store = c->server->store;
+
+  if (c->cfd != -1)
+    close(c->cfd);
+  c->cfd = -1;
+  if (c->cache)
+    {
+      TMutexLock(&store->lock);
+      CacheUnref(c->cache);
+      TMutexUnlock(&store->lock);
+      c->cache = NULL;
+    }
+}
+
+/* Event loop only: drop the socket and leave the stream */
+static void
+ClientClose(GW_CLIENT *c)
+{
+  STREAMING_SERVER *server = c->server;
+  GW_CHUNK *ch;
+
+  RTMP_TimerCancel(&server->timers, &c->timer);
+  EvDel(&server->ev, c->sockfd);
+  closesocket(c->sockfd);
+  c->state = CLIENT_CLOSED;
+  if ((*c->pprev = c->next))
+    c->next->pprev = c->pprev;
+
+  ClientLeave(c);
+  ClientUncache(c);
+  while ((ch = c->head))
+    {
+      c->head = ch->next;
+      ClientChunkFree(c, ch);
+    }
+  RequestFree(c->rq);
+
+  if (c->dropped)
+    RTMP_Log(RTMP_LOGWARNING, "%s: connection %d skipped %u tags to keep up",
+	__FUNCTION__, c->id, c->dropped);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: closed connection %d", __FUNCTION__, c->id);
+  free(c);
+}
+
+static int ClientHlsWait(GW_CLIENT *c);
+static int ClientAnswer(GW_CLIENT *c, const char *status, const char *type,
+			const char *body, int blen);
+
+static void
+ClientTimeout(RTMP_TIMER *t, void *arg)
+{
+  GW_CLIENT *c = arg;
+
+  if (c->hlswait)
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s: no HLS segment for connection %d in time",
+	  __FUNCTION__, c->id);
+      c->hlswait = FALSE;
+      ClientLeave(c);
+      ClientAnswer(c, "504 Gateway Timeout", NULL, NULL, 0);
+      return;
+    }
+  if (c->nreq && !c->inlen)
+    RTMP_Log(RTMP_LOGDEBUG, "%s: connection %d idle, closing", __FUNCTION__,
+	c->id);
+  else
+    RTMP_Log(RTMP_LOGERROR, "Request timeout, ignoring request");
+  ClientClose(c);
+}
+
+/* queue a copy of data ahead of any stream data */
+static int
+ClientWrite(GW_CLIENT *c, const char *data, int len)
+{
+  GW_CHUNK *ch = ChunkNew(data, len);
+
+  if (!ch)
+    return FALSE;
+  if (c->tail)
+    c->tail->next = ch;
+  else
+    c->head = ch;
+  c->tail = ch;
+  return TRUE;
+}
+
+/* queue seg's data without copying it, taking over the caller's reference */
+static int
+ClientWriteSegment(GW_CLIENT *c, GW_SEGMENT *seg)
+{
+  GW_CHUNK *ch = malloc(sizeof(GW_CHUNK));
+
+  if (!ch)
+    {
+      ClientSegmentRelease(c, seg);
+      return FALSE;
+    }
+  ch->next = NULL;
+  ch->refs = 1;
+  ch->len = seg->len;
+  ch->off = 0;
+  ch->seg = seg;
+  ch->ts = 0;
+  if (c->tail)
+    c->tail->next = ch;
+  else
+    c->head = ch;
+  c->tail = ch;
+  return TRUE;
+}
+
+/* Pick c's next ring tag into c->cur; called with s->lock held. On a
+ * shared stream, a client falling behind its best lag loses video
+ * interframes, then whole GOPs. Returns FALSE if it should be dropped.
+ */
+static int
+ClientNext(GW_CLIENT *c, GW_STREAM *s)
+{
+  GW_CHUNK *ch;
+  int32_t lag;
+  int frame;
+
+  while (c->seq != s->head)
+    {
+      if (s->head - c->seq > GW_RING_SLOTS)
+	return FALSE;
+      ch = s->ring[c->seq % GW_RING_SLOTS];
+      if (s->key)
+	{
+	  lag = (int32_t) (s->lastts - ch->ts);
+	  if (lag < c->minlag)
+	    c->minlag = lag;
+	  lag -= c->minlag;
+	  if (lag > GW_LAG_MAX)
+	    return FALSE;
+	  if (lag > GW_LAG_SKIP && s->havegop && s->gopseq > c->seq)
+	    {
+	      c->dropped += s->gopseq - c->seq;
+	      c->seq = s->gopseq;
+	      c->minlag = (int32_t) (s->lastts -
+				     s->ring[c->seq % GW_RING_SLOTS]->ts);
+	      c->skipping = FALSE;
+	      continue;
+	    }
+	  if ((ch->data[0] & 0x1f) == RTMP_PACKET_TYPE_VIDEO && ch->len > 11 + 4)
+	    {
+	      frame = (unsigned char) ch->data[11] >> 4;
+	      if (frame == 1)
+		c->skipping = FALSE;
+	      else if ((frame == 2 || frame == 3)
+		       && (c->skipping || lag > GW_LAG_DROP))
+		{
+		  c->skipping = TRUE;
+		  c->dropped++;
+		  c->seq++;
+		  continue;
+		}
+	    }
+	}
+      c->cur = ch;
+      c->ts = ch->ts;
+      c->seq++;
+      break;
+    }
+  return TRUE;
+}
+
+static int ClientIdle(GW_CLIENT *c);
+
+/* Send the rest of the chunk header in c->pre. Returns -1 on error,
+ * else TRUE once it is all sent.
+ */
+static int
+ClientPrefix(GW_CLIENT *c)
+{
+  int n;
+
+  if (c->poff < c->plen)
+    {
+      n = send(c->sockfd, c->pre + c->poff, c->plen - c->poff, GW_MSG_MORE);
+      if (n < 0)
+	return -1;
+      c->poff += n;
+    }
+  return c->poff == c->plen;
+}
+
+/* Start a chunk or WebSocket frame of len bytes in c->pre */
+static void
+ClientFrame(GW_CLIENT *c, int64_t len)
+{
+  unsigned char *p = (unsigned char *) c->pre;
+  int i, n;
+
+  if (c->ws)
+    {
+      n = len < 126 ? 0 : len < 0x10000 ? 2 : 8;
+      p[0] = 0x82;		// FIN, binary
+      p[1] = n == 0 ? len : n == 2 ? 126 : 127;
+      for (i = 0; i < n; i++)
+	p[2 + i] = len >> (8 * (n - 1 - i));
+      c->plen = 2 + n;
+    }
+  else
+    c->plen = sprintf(c->pre, "%s%llx\r\n", c->sent ? "\r\n" : "",
+		      (unsigned long long) len);
+  c->poff = 0;
+  c->sent++;
+}
+
+/* The body is over: queue the last chunk or a close frame */
+static void
+ClientEnd(GW_CLIENT *c)
+{
+  static const char lastchunk[] = "\r\n0\r\n\r\n";
+  static const char wsclose[] = { 0x88, 0x02, 0x03, 0xe8 };	// 1000
+  int n;
+
+  if (c->ws)
+    ClientWrite(c, wsclose, sizeof(wsclose));
+  else
+    {
+      n = c->sent ? 0 : 2;
+      ClientWrite(c, lastchunk + n, sizeof(lastchunk) - 1 - n);
+    }
+}
+
+/* A WebSocket frame is partly sent, nothing else may go in between */
+static int
+ClientMidFrame(GW_CLIENT *c)
+{
+  return c->ws && (c->clen
+		   || (c->cur && (c->poff < c->plen || c->off < c->cur->len)));
+}
+
+/* Send what is pending without blocking: the client's own queue, then
+ * its cache file or the stream's tags from its position on, then wait
+ * for the next request if the connection is kept alive. Returns FALSE
+ * if the client was closed, on error or after the end of its response.
+ */
+static int
+ClientFlush(GW_CLIENT *c)
+{
+  STREAMING_SERVER *server = c->server;
+  GW_STREAM *s;
+  GW_CHUNK *ch;
+  int n, err = 0, done = FALSE, blocked = FALSE, lapped = FALSE, eof;
+  int events;
+  int64_t sent;
+  int failed;
+
+again:
+  // a pong may be queued while a frame is out, it waits for the end
+  while ((ch = c->head) && !ClientMidFrame(c))
+    {
+      n = send(c->sockfd, (ch->seg ? ch->seg->data : ch->data) + ch->off,
+	       ch->len - ch->off, 0);
+      if (n < 0)
+	goto senderr;
+      ch->off += n;
+      if (ch->off < ch->len)
+	{
+	  blocked = TRUE;
+	  goto out;
+	}
+      if (!(c->head = ch->next))
+	c->tail = NULL;
+      ClientChunkFree(c, ch);
+    }
+
+  if (c->cfd != -1)
+    {
+      // a partial file ends with its download
+      eof = !c->cache;
+      failed = FALSE;
+      if (c->cache)
+	{
+	  TMutexLock(&server->store->lock);
+	  c->cend = c->cache->hlen + c->cache->size;
+	  eof = c->cache->done;
+	  failed = !eof && !c->cache->writer;
+	  TMutexUnlock(&server->store->lock);
+	}
+      while (c->coff < c->cend)
+	{
+	  if ((c->chunked || c->ws) && !c->clen)
+	    {
+	      if (c->head)
+		goto again;
+	      c->clen = c->cend - c->coff;
+	      ClientFrame(c, c->clen);
+	    }
+	  if ((n = ClientPrefix(c)) < 0)
+	    goto senderr;
+	  if (!n)
+	    {
+	      blocked = TRUE;
+	      goto out;
+	    }
+	  sent = c->coff;
+	  n = FileSend(c->sockfd, c->cfd, &c->coff,
+		       c->chunked || c->ws ? c->clen : c->cend - c->coff);
+	  if (n < 0)
+	    goto senderr;
+	  if (!n)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "%s: cache file for connection %d is short",
+		  __FUNCTION__, c->id);
+	      done = TRUE;
+	      goto out;
+	    }
+	  if (c->chunked || c->ws)
+	    c->clen -= c->coff - sent;
+	}
+      if (failed)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s: download for connection %d failed, closing",
+	      __FUNCTION__, c->id);
+	  done = TRUE;
+	}
+      else if (eof)
+	{
+	  ClientLeave(c);
+	  ClientUncache(c);
+	  c->state = CLIENT_ANSWERING;
+	  if (c->chunked || c->ws)
+	    ClientEnd(c);
+	  c->eof = !c->keepalive;
+	  goto again;
+	}
+      goto out;
+    }
+
+  if (!(s = c->stream))
+    {
+      done = c->eof;
+      goto out;
+    }
+  if (c->hlswait)
+    return ClientHlsWait(c);
+
+  while (1)
+    {
+      if (!c->cur || c->off == c->cur->len)
+	{
+	  if (c->head)
+	    goto again;
+	  TMutexLock(&s->lock);
+	  if (c->cur)
+	    ChunkRelease(c->cur);
+	  c->cur = NULL;
+	  if (!s->init[GW_INIT_FLV])
+	    ;			// nothing read yet
+	  else if (c->ninit < c->initend)
+	    {
+	      while (!c->cur && c->ninit < c->initend)
+		c->cur = s->init[c->ninit++];
+	    }
+	  if (!c->cur && !ClientNext(c, s))
+	    lapped = TRUE;
+	  if (c->cur)
+	    {
+	      c->cur->refs++;
+	      c->more = c->ninit < c->initend || c->seq != s->head;
+	    }
+	  if (!s->key && s->rseq != c->seq)
+	    {
+	      s->rseq = c->seq;
+	      TCondSignal(&s->cond);
+	    }
+	  eof = s->eof;
+	  TMutexUnlock(&s->lock);
+
+	  if (lapped)
+	    {
+	      RTMP_Log(RTMP_LOGWARNING, "%s: connection %d fell too far behind stream %d, closing",
+		  __FUNCTION__, c->id, s->id);
+	      done = TRUE;
+	      break;
+	    }
+	  if (!c->cur)
+	    {
+	      if (eof && (c->chunked || c->ws))
+		{
+		  // end the body, the connection may carry on
+		  ClientLeave(c);
+		  c->state = CLIENT_ANSWERING;
+		  ClientEnd(c);
+		  c->eof = !c->keepalive;
+		  goto again;
+		}
+	      done = eof;
+	      break;
+	    }
+	  c->off = 0;
+	  if (c->chunked || c->ws)
+	    ClientFrame(c, c->cur->len);
+	}
+      if ((n = ClientPrefix(c)) < 0)
+	goto senderr;
+      if (!n)
+	{
+	  blocked = TRUE;
+	  break;
+	}
+      // let a burst of tags fill whole segments, push the last one
+      n = send(c->sockfd, c->cur->data + c->off, c->cur->len - c->off,
+	       c->more ? GW_MSG_MORE : 0);
+      if (n < 0)
+	goto senderr;
+      c->off += n;
+      if (c->off < c->cur->len)
+	{
+	  blocked = TRUE;
+	  break;
+	}
+    }
+  goto out;
+
+senderr:
+  err = GetSockError();
+  if (SockAgain(err))
+    blocked = TRUE;
+  else
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
+	  err);
+      done = TRUE;
+    }
+
+out:
+  if (done)
+    {
+      ClientClose(c);
+      return FALSE;
+    }
+  events = blocked ? EV_READ | EV_WRITE : EV_READ;
+  if (events != c->events)
+    {
+      EvSet(&server->ev, c->sockfd, events, c->events, c);
+      c->events = events;
+    }
+  if (c->state == CLIENT_ANSWERING && !c->stream && !c->head && c->cfd == -1)
+    return ClientIdle(c);
+  return TRUE;
+}
+
+/* Split the request line and pick out the headers we act on, in place.
+ * Returns FALSE for a method other than GET or HEAD.
+ */
+static int
+RequestParse(GW_REQUEST *rq)
+{
+  char *line = rq->header, *next, *val, *p;
+
+  next = line + strcspn(line, "\n");
+  if (*next)
+    *next++ = '\0';
+  if (!strncmp(line, "GET ", 4))
+    line += 4;
+  else if (!strncmp(line, "HEAD ", 5))
+    {
+      rq->headonly = TRUE;
+      line += 5;
+    }
+  else
+    return FALSE;
+
+  rq->target = line;
+  line += strcspn(line, " \r");
+  if (*line == ' ')
+    {
+      *line++ = '\0';
+      rq->http11 = !strncmp(line, "HTTP/1.1", 8);
+    }
+  else
+    *line = '\0';
+  rq->keepalive = rq->http11;
+
+  for (line = next; *line; line = next)
+    {
+      next = line + strcspn(line, "\n");
+      if (*next)
+	*next++ = '\0';
+      line[strcspn(line, "\r")] = '\0';
+      if (!(val = strchr(line, ':')))
+	continue;
+      *val++ = '\0';
+      val += strspn(val, " \t");
+      if (!strcasecmp(line, "Connection"))
+	{
+	  for (p = val; *p; p++)
+	    *p = tolower(*p);
+	  if (strstr(val, "close"))
+	    rq->keepalive = FALSE;
+	  else if (strstr(val, "keep-alive"))
+	    rq->keepalive = TRUE;
+	  if (strstr(val, "upgrade"))
+	    rq->connupgrade = TRUE;
+	}
+      else if (!strcasecmp(line, "Upgrade"))
+	rq->websocket = !strcasecmp(val, "websocket");
+      else if (!strcasecmp(line, "Sec-WebSocket-Key"))
+	rq->wskey = val;
+      else if (!strcasecmp(line, "Sec-WebSocket-Version"))
+	rq->wsversion = atoi(val);
+    }
+  return TRUE;
+}
+
+/* Parse and check the request in c->rq against the defaults.
+ * Returns NULL if it can be streamed, else the HTTP status to answer.
+ */
+static const char *
+ClientRequest(GW_CLIENT *c)
+{
+  GW_REQUEST *rq = c->rq;
+  RTMP_REQUEST *req = &rq->req;
+  char *filename = NULL;	// GET request: file name
+  char *ptr, *arg;
+  const char *status = "404 Not Found";
+  char ich;
+
+  // reset RTMP options to defaults specified upon invokation of streams
+  memcpy(req, &defaultRTMPRequest, sizeof(RTMP_REQUEST));
+
+  // a Range header is ignored: byte ranges of the FLV we build can't
+  // be honored, so the answer is always the whole stream with a 200
+  filename = rq->target;
+
+  // if we got a filename from the GET method
+  if (filename != NULL)
+    {
+      RTMP_Log(RTMP_LOGDEBUG, "%s: Request header: %s", __FUNCTION__, filename);
+      if (filename[0] != '/')
+	goto fail;
+
+      ptr = filename + 1;
+      if (rq->hls)
+	ptr += 8;		// hls.m3u8
+
+      // parse parameters, in place: each arg is cut at its '&'
+      if (*ptr == '?')
+	{
+	  ptr++;
+	  while (ptr[0] && ptr[1])
+	    {
+	      // FLV pseudo-streaming: a byte offset into the file
+	      if (!strncmp(ptr, "start=", 6))
+		{
+		  rq->offset = strtod(ptr + 6, NULL);
+		  ptr += strcspn(ptr, "&");
+		  if (*ptr)
+		    ptr++;
+		  continue;
+		}
+	      ich = *ptr++;
+	      if (*ptr != '=')
+		goto fail;	// long parameters not (yet) supported
+
+	      arg = ++ptr;
+	      ptr += strcspn(ptr, "&");
+	      if (*ptr)
+		*ptr++ = '\0';
+	      http_unescape(arg);
+
+	      RTMP_Log(RTMP_LOGDEBUG, "%s: parameter: %c, arg: %s", __FUNCTION__,
+		  ich, arg);
+
+	      // don't append to the defaults' conn data
+	      if (ich == 'C' && !rq->ownextras)
+		{
+		  copyAMF(&req->extras, &defaultRTMPRequest.extras);
+		  rq->ownextras = TRUE;
+		}
+	      if (!ParseOption(ich, arg, req))
+		{
+		  status = "400 unknown option";
+		  goto fail;
+		}
+	    }
+	}
+    }
+
+  // do necessary checks right here to make sure the combined request of default values and GET parameters is correct
+  if (!req->hostname.av_len && !req->fullUrl.av_len)
+    {
+      RTMP_Log(RTMP_LOGERROR,
+	  "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
+      status = "400 Missing Hostname";
+      goto fail;
+    }
+  if (req->playpath.av_len == 0 && !req->fullUrl.av_len)
+    {
+      RTMP_Log(RTMP_LOGERROR,
+	  "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
+      status = "400 Missing Playpath";
+      goto fail;
+    }
+
+  if (req->protocol == RTMP_PROTOCOL_UNDEFINED && !req->fullUrl.av_len)
+    {
+      RTMP_Log(RTMP_LOGWARNING,
+	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
+      req->protocol = RTMP_PROTOCOL_RTMP;
+    }
+  if (req->rtmpport == -1 && !req->fullUrl.av_len)
+    {
+      RTMP_Log(RTMP_LOGWARNING,
+	  "You haven't specified a port (--port) or rtmp url (-r), using default port");
+      req->rtmpport = 0;
+    }
+  if (req->rtmpport == 0 && !req->fullUrl.av_len)
+    {
+      if (req->protocol & RTMP_FEATURE_SSL)
+	req->rtmpport = 443;
+      else if (req->protocol & RTMP_FEATURE_HTTP)
+	req->rtmpport = 80;
+      else
+	req->rtmpport = 1935;
+    }
+
+  if (req->tcUrl.av_len == 0)
+    {
+      int len = snprintf(rq->tcUrl, sizeof(rq->tcUrl), "%s://%.*s:%d/%.*s",
+	RTMPProtocolStringsLower[req->protocol], req->hostname.av_len,
+	req->hostname.av_val, req->rtmpport, req->app.av_len, req->app.av_val);
+      if (len >= (int) sizeof(rq->tcUrl))
+	len = sizeof(rq->tcUrl) - 1;
+      req->tcUrl.av_val = rq->tcUrl;
+      req->tcUrl.av_len = len;
+    }
+  return NULL;
+
+fail:
+  RTMP_LogPrintf("%s, %s, %s\n", __FUNCTION__, status, filename);
+  return status;
+}
+
+/* The upstream stream a request asks for, as a string that is the
+ * same for requests that can share its session or keyframe index;
+ * NULL if it has its own conn data.
+ */
+static char *
+RequestKey(GW_REQUEST *rq)
+{
+  RTMP_REQUEST *req = &rq->req;
+  char key[2048], *p;
+  int len;
+
+  // request-specific conn data isn't in the key
+  if (rq->ownextras)
+    return NULL;
+
+  if (req->fullUrl.av_len)
+    len = snprintf(key, sizeof(key), "%.*s", req->fullUrl.av_len,
+		   req->fullUrl.av_val);
+  else
+    len = snprintf(key, sizeof(key),
+		   "%s://%.*s:%d/%.*s/%.*s tcUrl=%.*s swfUrl=%.*s pageUrl=%.*s"
+		   " subscribe=%.*s jtv=%.*s socks=%.*s",
+		   RTMPProtocolStringsLower[req->protocol],
+		   req->hostname.av_len, req->hostname.av_val, req->rtmpport,
+		   req->app.av_len, req->app.av_val,
+		   req->playpath.av_len, req->playpath.av_val,
+		   req->tcUrl.av_len, req->tcUrl.av_val,
+		   req->swfUrl.av_len, req->swfUrl.av_val,
+		   req->pageUrl.av_len, req->pageUrl.av_val,
+		   req->subscribepath.av_len, req->subscribepath.av_val,
+		   req->usherToken.av_len, req->usherToken.av_val,
+		   req->sockshost.av_len, req->sockshost.av_val);
+  // options sent to the server, also with a full URL, may change what
+  // it plays: viewers that differ in them don't share a session
+  if (len >= 0 && len < (int) sizeof(key))
+    len += snprintf(key + len, sizeof(key) - len,
+		    " auth=%.*s token=%.*s flashVer=%.*s swfVfy=%d %u",
+		    req->auth.av_len, req->auth.av_val,
+		    req->token.av_len, req->token.av_val,
+		    req->flashVer.av_len, req->flashVer.av_val,
+		    req->swfVfy, req->dStopOffset);
+  if (len < 0 || len >= (int) sizeof(key))
+    return NULL;
+
+  // scheme and host are case-insensitive
+  if ((p = strstr(key, "://")))
+    for (p += 3; *p && *p != '/' && *p != ':' && *p != ' '; p++)
+      *p = tolower(*p);
+  for (p = key; *p && *p != ':'; p++)
+    *p = tolower(*p);
+  return strdup(key);
+}
+
+/* Turn the start= byte offset of a request into a seek, by the stream's
+ * keyframe index. Without an index the stream is sent from the start.
+ */
+static void
+ClientSeek(GW_CLIENT *c)
+{
+  GW_REQUEST *rq = c->rq;
+  RTMP_REQUEST *req = &rq->req;
+  char *key;
+  int ms = -1;
+
+  if (rq->offset <= 0)
+    return;
+  if (!req->bLiveStream && (key = RequestKey(rq)))
+    {
+      ms = IndexSeek(c->server->store, key, rq->offset);
+      free(key);
+    }
+  if (ms < 0)
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s: no keyframe index, start=%.0f ignored",
+	  __FUNCTION__, rq->offset);
+      return;
+    }
+  RTMP_Log(RTMP_LOGDEBUG, "%s: byte %.0f is at %d ms", __FUNCTION__,
+      rq->offset, ms);
+  req->dStartOffset = ms;
+}
+
+/* Serve c from the cache file called name for key, if there is one: a
+ * whole file by itself, a partial one as a reader of the stream writing
+ * it, returned in *sp. Returns FALSE if it isn't cached.
+ */
+static int
+ClientCache(GW_CLIENT *c, const char *name, const char *key, GW_STREAM **sp)
+{
+  GW_STORE *store = c->server->store;
+  GW_CACHE *ce;
+  struct stat st;
+  char path[GW_PATH_MAX];
+  int fd = -1;
+
+  *sp = NULL;
+  TMutexLock(&store->lock);
+  if ((ce = CacheFind(store, name)) && !ce->done && ce->writer
+      && ce->writer->server != c->server)
+    ce = NULL;			// another shard's download, can't follow it
+  if (ce && strcmp(ce->key, key))
+    {
+      RTMP_Log(RTMP_LOGWARNING, "%s: cache name %s is taken by another stream",
+	  __FUNCTION__, name);
+      ce = NULL;
+    }
+  if (ce)
+    {
+      CachePath(store, ce, !ce->done, path);
+      if ((ce->done || ce->writer)
+	  && (fd = open(path, O_RDONLY | O_BINARY)) != -1
+	  && (!ce->done || fstat(fd, &st) == 0))
+	{
+	  c->coff = ce->hlen;
+	  if (ce->done)
+	    c->cend = st.st_size;
+	  else
+	    {
+	      ce->refs++;
+	      c->cache = ce;
+	      *sp = ce->writer;
+	    }
+	  c->cfd = fd;
+	}
+      else
+	{
+	  // gone, or its download is failing
+	  if (fd != -1)
+	    close(fd);
+	  fd = -1;
+	  CacheUnlist(store, ce);
+	}
+    }
+  TMutexUnlock(&store->lock);
+  if (fd == -1)
+    return FALSE;
+  RTMP_Log(RTMP_LOGDEBUG, "%s: connection %d reads %s", __FUNCTION__, c->id,
+      path);
+  return TRUE;
+}
+
+/* Have the new stream s write its download to the cache file name,
+ * unless another shard already is, or another key has that name.
+ */
+static void
+StreamCache(GW_STREAM *s, const char *name)
+{
+  GW_STORE *store = s->server->store;
+  GW_CACHE *ce = calloc(1, sizeof(GW_CACHE));
+  char part[GW_PATH_MAX], hdr[4];
+
+  if (!ce)
+    return;
+  if (!(ce->key = strdup(s->ikey)))
+    {
+      free(ce);
+      return;
+    }
+  strcpy(ce->name, name);
+  ce->hlen = 4 + strlen(ce->key);
+  ce->id = s->id;
+  CachePath(store, ce, TRUE, part);
+  AMF_EncodeInt32(hdr, hdr + 4, ce->hlen - 4);
+  TMutexLock(&store->lock);
+  if (CacheFind(store, name))
+    ce->refs = 1;
+  else if ((s->cfd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+			  0644)) == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, can't create %s", __FUNCTION__, part);
+      ce->refs = 1;
+    }
+  else if (write(s->cfd, hdr, 4) != 4
+	   || write(s->cfd, ce->key, ce->hlen - 4) != ce->hlen - 4)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, can't write %s", __FUNCTION__, part);
+      close(s->cfd);
+      s->cfd = -1;
+      unlink(part);
+      ce->refs = 1;
+    }
+  else
+    {
+      ce->listed = TRUE;
+      ce->writer = s;
+      ce->refs = 2;		// list and stream
+      s->cache = ce;
+      ce->next = store->cache;
+      store->cache = ce;
+    }
+  if (!s->cache)
+    CacheUnref(ce);
+  TMutexUnlock(&store->lock);
+}
+
+/* Attach c to a running stream for its request, or start one. A VOD
+ * stream from the start may be read from the cache instead.
+ */
+static int
+ClientAttach(GW_CLIENT *c)
+{
+  STREAMING_SERVER *server = c->server;
+  GW_STREAM *s;
+  char *key = NULL, *ikey = NULL, name[17] = "";
+  int eof;
+
+  if (c->rq->req.bLiveStream)
+    key = RequestKey(c->rq);
+  else if ((ikey = RequestKey(c->rq)) && server->store->cachedir
+	   && !c->rq->req.dStartOffset)
+    {
+      CacheName(ikey, name);
+      if (ClientCache(c, name, ikey, &s))
+	{
+	  free(ikey);
+	  if (!s)
+	    return TRUE;
+	  goto attach;
+	}
+    }
+
+  for (s = key ? server->streams : NULL; s; s = s->next)
+    {
+      if (strcmp(s->key, key))
+	continue;
+      TMutexLock(&s->lock);
+      eof = s->eof;
+      TMutexUnlock(&s->lock);
+      if (!eof)
+	break;
+    }
+
+  if (s)
+    {
+      free(key);
+      RequestFree(c->rq);
+      c->rq = NULL;
+      TMutexLock(&s->lock);
+      c->seq = s->head;
+      if (s->havegop && s->head - s->gopseq < GW_RING_SLOTS)
+	c->seq = s->gopseq;
+      TMutexUnlock(&s->lock);
+      // tags before c->seq are gone or skipped: replay their init tags
+      c->initend = c->seq ? GW_INIT_MAX : GW_INIT_FLV + 1;
+      RTMP_Log(RTMP_LOGDEBUG, "%s: connection %d joins stream %d at tag %llu",
+	  __FUNCTION__, c->id, s->id, (unsigned long long) c->seq);
+    }
+  else
+    {
+      s = calloc(1, sizeof(GW_STREAM));
+      if (!s)
+	{
+	  free(key);
+	  free(ikey);
+	  return FALSE;
+	}
+      s->server = server;
+      s->rq = c->rq;
+      c->rq = NULL;
+      s->key = key;
+      s->ikey = ikey;
+      s->seek = s->rq->req.dStartOffset > 0;
+      s->paced = !key;
+      s->id = ServerId(server);
+      s->refs = 2;		// event loop and session
+      s->rtmpfd = -1;
+      s->cfd = -1;
+      if (name[0])
+	StreamCache(s, name);
+      TMutexInit(&s->lock);
+      TCondInit(&s->cond);
+      if (key)
+	{
+	  if ((s->next = server->streams))
+	    s->next->pprev = &s->next;
+	  s->pprev = &server->streams;
+	  server->streams = s;
+	}
+      TMutexLock(&server->lock);
+      server->sessions++;
+      TMutexUnlock(&server->lock);
+      c->initend = GW_INIT_FLV + 1;
+      RTMP_Log(RTMP_LOGDEBUG, "%s: connection %d starts stream %d", __FUNCTION__,
+	  c->id, s->id);
+      ThreadCreate(sessionThread, s);
+    }
+
+attach:
+  c->minlag = 0x7fffffff;
+  if ((c->snext = s->clients))
+    c->snext->spprev = &c->snext;
+  c->spprev = &s->clients;
+  s->clients = c;
+  c->stream = s;
+  c->state = CLIENT_STREAMING;
+  return TRUE;
+}
+
+/* The Connection header a response needs, if any */
+static const char *
+ClientConnection(GW_CLIENT *c)
+{
+  return !c->keepalive ? "Connection: close\r\n" :
+    !c->http11 ? "Connection: keep-alive\r\n" : "";
+}
+
+/* Queue a whole response to c and send it. Returns FALSE if c was
+ * closed.
+ */
+static int
+ClientAnswer(GW_CLIENT *c, const char *status, const char *type,
+	     const char *body, int blen)
+{
+  char buf[512];
+  int len;
+
+  len = snprintf(buf, sizeof(buf),
+    "HTTP/1.1 %s%sContent-Length: %d\r\n%s%s%s%s\r\n", status, srvhead, blen,
+    type ? "Content-Type: " : "", type ? type : "", type ? "\r\n" : "",
+    ClientConnection(c));
+  ClientWrite(c, buf, len);
+  if (blen && !(c->rq && c->rq->headonly))
+    ClientWrite(c, body, blen);
+  c->eof = !c->keepalive;
+  return ClientFlush(c);
+}
+
+/* Queue an HLS playlist or, by reference, a segment to c, cacheable for
+ * maxage seconds. Takes over the caller's reference to seg.
+ */
+static void
+ClientHlsQueue(GW_CLIENT *c, const char *type, int maxage, const char *body,
+	       int blen, GW_SEGMENT *seg)
+{
+  char buf[512];
+  int len;
+
+  if (seg)
+    blen = seg->len;
+
+  len = snprintf(buf, sizeof(buf),
+    "HTTP/1.1 200 OK%sContent-Type: %s\r\nContent-Length: %d\r\n"
+    "Cache-Control: max-age=%d\r\nAccess-Control-Allow-Origin: *\r\n%s\r\n",
+    srvhead, type, blen, maxage, ClientConnection(c));
+  ClientWrite(c, buf, len);
+  if (c->rq && c->rq->headonly)
+    {
+      if (seg)
+	ClientSegmentRelease(c, seg);
+    }
+  else if (seg)
+    ClientWriteSegment(c, seg);
+  else
+    ClientWrite(c, body, blen);
+  c->eof = !c->keepalive;
+}
+
+/* Event loop only: stop segmenting s for HLS, and close it unless it
+ * still has clients.
+ */
+static void
+StreamHlsStop(GW_STREAM *s)
+{
+  GW_STORE *store = s->server->store;
+  GW_CLIENT *c, *next;
+
+  RTMP_TimerCancel(&s->server->timers, &s->hlstimer);
+  s->hlsopen = FALSE;
+  TMutexLock(&store->lock);
+  if (s->hls->listed)
+    HlsUnlist(store, s->hls);
+  TMutexUnlock(&store->lock);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: stream %d no longer segmented", __FUNCTION__,
+      s->id);
+
+  if (!s->clients)
+    StreamClose(s);
+  else
+    // playlist requests still waiting get nothing now
+    for (c = s->clients; c; c = next)
+      {
+	next = c->snext;
+	if (c->hlswait)
+	  ClientFlush(c);
+      }
+}
+
+static void
+StreamHlsTimeout(RTMP_TIMER *t, void *arg)
+{
+  GW_STREAM *s = arg;
+  GW_STORE *store = s->server->store;
+  uint32_t idle;
+
+  TMutexLock(&store->lock);
+  idle = RTMP_GetTime() - s->hls->touched;
+  TMutexUnlock(&store->lock);
+  if (idle < GW_HLS_IDLE)
+    RTMP_TimerSet(&s->server->timers, t, GW_HLS_IDLE - idle);
+  else
+    StreamHlsStop(s);
+}
+
+/* Event loop only: have s segmented for HLS as name, from its next
+ * keyframe. Returns FALSE if out of memory.
+ */
+static int
+StreamHls(GW_STREAM *s, const char *name)
+{
+  GW_STORE *store = s->server->store;
+  GW_HLS *h = s->hls;
+
+  if (!h)
+    {
+      if (!(h = calloc(1, sizeof(GW_HLS))))
+	return FALSE;
+      strcpy(h->name, name);
+      h->stream = s;
+      TMutexLock(&s->lock);
+      s->hls = h;
+      TMutexUnlock(&s->lock);
+    }
+  if (s->hlsopen)
+    return TRUE;
+  s->hlsopen = TRUE;
+  RTMP_TimerInit(&s->hlstimer, StreamHlsTimeout, s);
+  RTMP_TimerSet(&s->server->timers, &s->hlstimer, GW_HLS_IDLE);
+  TMutexLock(&store->lock);
+  // segment names from an earlier listing must not match the new ones
+  sprintf(h->tag, "%lx-%d-%d", (unsigned long) time(NULL), s->id,
+	  ++h->lists);
+  h->listed = TRUE;
+  h->touched = RTMP_GetTime();
+  h->next = store->hls;
+  store->hls = h;
+  TMutexUnlock(&store->lock);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: stream %d segmented as hls/%s", __FUNCTION__,
+      s->id, h->tag);
+  return TRUE;
+}
+
+/* Event loop only: answer c's playlist request once its stream has a
+ * segment, or has ended or stopped without one. Returns FALSE if c was
+ * closed.
+ */
+static int
+ClientHlsWait(GW_CLIENT *c)
+{
+  GW_STORE *store = c->server->store;
+  GW_STREAM *s = c->stream;
+  GW_HLS *h = s->hls;
+  char buf[1024];
+  int len = 0, eof, listed;
+
+  TMutexLock(&s->lock);
+  eof = s->eof;
+  TMutexUnlock(&s->lock);
+  TMutexLock(&store->lock);
+  listed = h->listed;
+  if (listed && h->nseg)
+    len = HlsPlaylist(h, buf, sizeof(buf));
+  TMutexUnlock(&store->lock);
+  if (!len && listed && !eof)
+    return TRUE;
+
+  c->hlswait = FALSE;
+  RTMP_TimerCancel(&c->server->timers, &c->timer);
+  ClientLeave(c);
+  if (!len)
+    return ClientAnswer(c, listed ? "502 Bad Gateway" : "504 Gateway Timeout",
+			NULL, NULL, 0);
+  ClientHlsQueue(c, "application/vnd.apple.mpegurl", 1, buf, len, NULL);
+  return ClientFlush(c);
+}
+
+/* Answer a request for a live stream's HLS playlist, from the store if
+ * any shard segments the stream already. Else start segmenting it here,
+ * and answer once there is a segment. Returns FALSE if c was closed.
+ */
+static int
+ClientPlaylist(GW_CLIENT *c)
+{
+  STREAMING_SERVER *server = c->server;
+  GW_STORE *store = server->store;
+  GW_HLS *h;
+  char *key, name[17], buf[1024];
+  int len = 0, here = TRUE;
+
+  if (!c->rq->req.bLiveStream || !(key = RequestKey(c->rq)))
+    return ClientAnswer(c, "400 HLS needs a shared live stream", NULL, NULL, 0);
+  CacheName(key, name);
+  free(key);
+
+  TMutexLock(&store->lock);
+  // one that ended without a segment failed, try again
+  if ((h = HlsFind(store, name)) && h->ended && !h->nseg)
+    h = NULL;
+  if (h)
+    {
+      if (!h->ended)
+	h->touched = RTMP_GetTime();
+      if (h->nseg)
+	len = HlsPlaylist(h, buf, sizeof(buf));
+      else
+	here = h->stream->server == server;
+    }
+  TMutexUnlock(&store->lock);
+
+  if (len)
+    {
+      ClientHlsQueue(c, "application/vnd.apple.mpegurl", 1, buf, len, NULL);
+      return ClientFlush(c);
+    }
+  if (c->rq->headonly)
+    return ClientAnswer(c, "404 Not Found", NULL, NULL, 0);
+  // another shard is starting it, the player will ask again
+  if (!here)
+    return ClientAnswer(c, "503 Service Unavailable", NULL, NULL, 0);
+
+  if (!ClientAttach(c))
+    return ClientAnswer(c, "503 Service Unavailable", NULL, NULL, 0);
+  if (!StreamHls(c->stream, name))
+    {
+      ClientLeave(c);
+      return ClientAnswer(c, "503 Service Unavailable", NULL, NULL, 0);
+    }
+  c->hlswait = TRUE;
+  c->eof = !c->keepalive;
+  RTMP_TimerSet(&server->timers, &c->timer, GW_HLS_WAIT);
+  return ClientFlush(c);
+}
+
+/* Answer a request for the HLS segment at path, tag/seq.ts */
+static int
+ClientSegment(GW_CLIENT *c, const char *path)
+{
+  GW_STORE *store = c->server->store;
+  GW_HLS *h;
+  GW_SEGMENT *seg = NULL;
+  const char *slash = strchr(path, '/');
+  char *end;
+  unsigned long seq;
+  int tlen;
+
+  if (!slash || (tlen = slash - path) >= (int) sizeof(h->tag))
+    return ClientAnswer(c, "404 Not Found", NULL, NULL, 0);
+  seq = strtoul(slash + 1, &end, 10);
+  if (end == slash + 1 || strcmp(end, ".ts"))
+    return ClientAnswer(c, "404 Not Found", NULL, NULL, 0);
+
+  TMutexLock(&store->lock);
+  for (h = store->hls; h; h = h->next)
+    if (!strncmp(h->tag, path, tlen) && !h->tag[tlen])
+      break;
+  if (h && seq < h->nseg && h->nseg - seq <= GW_HLS_KEEP
+      && (seg = h->seg[seq % GW_HLS_KEEP]))
+    {
+      if (!h->ended)
+	h->touched = RTMP_GetTime();
+      seg->refs++;
+    }
+  TMutexUnlock(&store->lock);
+  if (!seg)
+    return ClientAnswer(c, "404 Not Found", NULL, NULL, 0);
+  // sent from the store's copy, the lock is not held while queueing
+  ClientHlsQueue(c, "video/mp2t", GW_HLS_MAXAGE, NULL, 0, seg);
+  return ClientFlush(c);
+}
+
+/* A cheap answer for load balancer health checks */
+static int
+ServerStatus(STREAMING_SERVER *server, char *buf, int size)
+{
+  GW_CLIENT *c;
+  GW_STREAM *s;
+  int nclients = 0, nshared = 0, nsessions;
+
+  for (c = server->clients; c; c = c->next)
+    nclients++;
+  for (s = server->streams; s; s = s->next)
+    nshared++;
+  TMutexLock(&server->lock);
+  nsessions = server->sessions;
+  TMutexUnlock(&server->lock);
+  return snprintf(buf, size, "clients %d\nsessions %d\nshared %d\n",
+		  nclients, nsessions, nshared);
+}
+
+#define ROL32(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+/* SHA-1 of a short message, for the WebSocket handshake; rtmpgw may be
+ * built without a crypto library.
+ */
+static void
+Sha1(const unsigned char *msg, int len, unsigned char *md)
+{
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+    0xc3d2e1f0
+  };
+  uint32_t w[80], a, b, c, d, e, f, k, t;
+  unsigned char blk[64];
+  int i, pos, n, done = FALSE;
+
+  for (pos = 0; !done; pos += 64)
+    {
+      n = len - pos;
+      if (n >= 64)
+	memcpy(blk, msg + pos, 64);
+      else
+	{
+	  // the 0x80 goes in the first block past the end, the length
+	  // in the last one
+	  memset(blk, 0, 64);
+	  if (n >= 0)
+	    {
+	      memcpy(blk, msg + pos, n);
+	      blk[n] = 0x80;
+	    }
+	  if (n < 56)
+	    {
+	      for (i = 0; i < 8; i++)
+		blk[63 - i] = ((uint64_t) len * 8) >> (8 * i);
+	      done = TRUE;
+	    }
+	}
+      for (i = 0; i < 16; i++)
+	w[i] = ((uint32_t) blk[4 * i] << 24) | (blk[4 * i + 1] << 16)
+	  | (blk[4 * i + 2] << 8) | blk[4 * i + 3];
+      for (; i < 80; i++)
+	w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      a = h[0];
+      b = h[1];
+      c = h[2];
+      d = h[3];
+      e = h[4];
+      for (i = 0; i < 80; i++)
+	{
+	  if (i < 20)
+	    {
+	      f = (b & c) | (~b & d);
+	      k = 0x5a827999;
+	    }
+	  else if (i < 40)
+	    {
+	      f = b ^ c ^ d;
+	      k = 0x6ed9eba1;
+	    }
+	  else if (i < 60)
+	    {
+	      f = (b & c) | (b & d) | (c & d);
+	      k = 0x8f1bbcdc;
+	    }
+	  else
+	    {
+	      f = b ^ c ^ d;
+	      k = 0xca62c1d6;
+	    }
+	  t = ROL32(a, 5) + f + e + k + w[i];
+	  e = d;
+	  d = c;
+	  c = ROL32(b, 30);
+	  b = a;
+	  a = t;
+	}
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+    }
+  for (i = 0; i < 20; i++)
+    md[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* Sec-WebSocket-Accept for rq's key into out, 29 bytes. Returns FALSE
+ * if rq is not a valid upgrade.
+ */
+static int
+WsAccept(GW_REQUEST *rq, char *out)
+{
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned char buf[128], md[21];
+  uint32_t v;
+  int i, len;
+
+  // RFC 6455 4.2.1: a GET, Connection: Upgrade, version 13 and a key
+  if (!rq->http11 || !rq->connupgrade || !rq->wskey || rq->wsversion != 13)
+    return FALSE;
+  // the base64 of 16 bytes
+  if ((len = strlen(rq->wskey)) != 24)
+    return FALSE;
+  memcpy(buf, rq->wskey, len);
+  memcpy(buf + len, GW_WS_GUID, sizeof(GW_WS_GUID) - 1);
+  Sha1(buf, len + sizeof(GW_WS_GUID) - 1, md);
+  md[20] = 0;
+  for (i = 0; i < 7; i++)
+    {
+      v = (md[3 * i] << 16) | (md[3 * i + 1] << 8) | md[3 * i + 2];
+      out[4 * i] = b64[v >> 18];
+      out[4 * i + 1] = b64[(v >> 12) & 0x3f];
+      out[4 * i + 2] = b64[(v >> 6) & 0x3f];
+      out[4 * i + 3] = b64[v & 0x3f];
+    }
+  out[27] = '=';		// 20 bytes pad to 21
+  out[28] = '\0';
+  return TRUE;
+}
+
+/* Take the frames a WebSocket client sent off c->in: answer pings and
+ * a close, ignore the rest. Returns FALSE if c was closed.
+ */
+static int
+ClientWsRead(GW_CLIENT *c)
+{
+  unsigned char *p = (unsigned char *) c->in;
+  char pong[2 + 125];
+  int op, len, hl, i, queued = FALSE;
+
+  while (c->inlen >= 2)
+    {
+      op = p[0] & 0x0f;
+      len = p[1] & 0x7f;
+      hl = 2 + 4;
+      // clients mask what they send; control frames are short
+      if (!(p[1] & 0x80) || ((op & 8) && len > 125))
 	{
-	  // TODO check range starts from 0 and asking till the end.
-	  RTMP_LogPrintf("%s, Range request not supported\n", __FUNCTION__);
-	  len = sprintf(buf, "HTTP/1.0 416 Requested Range Not Satisfiable%s\r\n",
-		  srvhead);
-	  send(sockfd, buf, len, 0);
-	  goto quit;
+	  RTMP_Log(RTMP_LOGWARNING, "%s: bad WebSocket frame from connection %d",
+	      __FUNCTION__, c->id);
+	  ClientClose(c);
+	  return FALSE;
 	}
-
-      if (strncmp(header, "GET", 3) == 0 && nRead > 4)
+      if (len == 126)
 	{
-	  filename = header + 4;
-
-	  // filter " HTTP/..." from end of request
-	  char *p = filename;
-	  while (*p != '\0')
-	    {
-	      if (*p == ' ')
-		{
-		  *p = '\0';
-		  break;
-		}
-	      p++;
-	    }
+	  if (c->inlen < 4)
+	    break;
+	  len = (p[2] << 8) | p[3];
+	  hl += 2;
 	}
-    }
-  //} while(!isHTTPRequestEOF(header, nRead));
-
-  // if we got a filename from the GET method
-  if (filename != NULL)
-    {
-      RTMP_Log(RTMP_LOGDEBUG, "%s: Request header: %s", __FUNCTION__, filename);
-      if (filename[0] == '/')
-	{			// if its not empty, is it /?
-	  ptr = filename + 1;
+      if (len == 127 || hl + len > (int) sizeof(c->in) - 1)
+	{
+	  RTMP_Log(RTMP_LOGWARNING, "%s: WebSocket message from connection %d too big",
+	      __FUNCTION__, c->id);
+	  ClientClose(c);
+	  return FALSE;
+	}
+      if (c->inlen < hl + len)
+	break;
+      for (i = 0; i < len; i++)
+	p[hl + i] ^= p[hl - 4 + (i & 3)];
 
-	  // parse parameters
-	  if (*ptr == '?')
+      if (op == 8)
+	{
+	  RTMP_Log(RTMP_LOGDEBUG, "%s: connection %d closed its WebSocket",
+	      __FUNCTION__, c->id);
+	  // the answer can't cut into a frame, nor follow our own close
+	  if (ClientMidFrame(c) || c->state != CLIENT_STREAMING)
 	    {
-	      ptr++;
-	      int len = strlen(ptr);
-
-	      while (len >= 2)
-		{
-		  char ich = *ptr;
-		  ptr++;
-		  if (*ptr != '=')
-		    goto filenotfound;	// long parameters not (yet) supported
-
-		  ptr++;
-		  len -= 2;
-
-		  // get position of the next '&'
-		  char *temp;
-
-		  unsigned int nArgLen = len;
-		  if ((temp = strstr(ptr, "&")) != 0)
-		    {
-		      nArgLen = temp - ptr;
-		    }
-
-		  char *arg = (char *) malloc((nArgLen + 1) * sizeof(char));
-		  memcpy(arg, ptr, nArgLen * sizeof(char));
-		  arg[nArgLen] = '\0';
-
-		  //RTMP_Log(RTMP_LOGDEBUG, "%s: unescaping parameter: %s", __FUNCTION__, arg);
-		  http_unescape(arg);
-
-		  RTMP_Log(RTMP_LOGDEBUG, "%s: parameter: %c, arg: %s", __FUNCTION__,
-		      ich, arg);
-
-		  ptr += nArgLen + 1;
-		  len -= nArgLen + 1;
-
-		  if (!ParseOption(ich, arg, &req))
-		    {
-		      status = "400 unknown option";
-		      goto filenotfound;
-		    }
-		}
+	      ClientClose(c);
+	      return FALSE;
 	    }
+	  ClientLeave(c);
+	  ClientUncache(c);
+	  c->state = CLIENT_ANSWERING;
+	  ClientEnd(c);
+	  c->eof = TRUE;
+	  c->inlen = 0;
+	  return ClientFlush(c);
 	}
-      else
+      if (op == 9)
 	{
-	  goto filenotfound;
+	  pong[0] = 0x8a;
+	  pong[1] = len;
+	  memcpy(pong + 2, p + hl, len);
+	  ClientWrite(c, pong, 2 + len);
+	  queued = TRUE;
 	}
+      c->inlen -= hl + len;
+      memmove(c->in, c->in + hl + len, c->inlen + 1);
     }
-  else
-    {
-      RTMP_LogPrintf("%s: No request header received/unsupported method\n",
-		__FUNCTION__);
-    }
+  return queued ? ClientFlush(c) : TRUE;
+}
 
-  // do necessary checks right here to make sure the combined request of default values and GET parameters is correct
-  if (!req.hostname.av_len && !req.fullUrl.av_len)
-    {
-      RTMP_Log(RTMP_LOGERROR,
-	  "You must specify a hostname (--host) or url (-r \"rtmp://host[:port]/playpath\") containing a hostname");
-      status = "400 Missing Hostname";
-      goto filenotfound;
-    }
-  if (req.playpath.av_len == 0 && !req.fullUrl.av_len)
-    {
-      RTMP_Log(RTMP_LOGERROR,
-	  "You must specify a playpath (--playpath) or url (-r \"rtmp://host[:port]/playpath\") containing a playpath");
-      status = "400 Missing Playpath";
-      goto filenotfound;;
-    }
+/* Request header complete: answer it, or start streaming it.
+ * Returns FALSE if c was closed.
+ */
+static int
+ClientStart(GW_CLIENT *c)
+{
+  GW_REQUEST *rq = c->rq;
+  const char *status;
+  char buf[512], accept[32];
+  int len, headonly, ws;
 
-  if (req.protocol == RTMP_PROTOCOL_UNDEFINED && !req.fullUrl.av_len)
+  RTMP_TimerCancel(&c->server->timers, &c->timer);
+  RTMP_Log(RTMP_LOGDEBUG, "%s: header: %s", __FUNCTION__, rq->header);
+  c->state = CLIENT_ANSWERING;
+  c->nreq++;
+
+  if (!RequestParse(rq))
     {
-      RTMP_Log(RTMP_LOGWARNING,
-	  "You haven't specified a protocol (--protocol) or rtmp url (-r), using default protocol RTMP");
-      req.protocol = RTMP_PROTOCOL_RTMP;
+      c->keepalive = FALSE;
+      return ClientAnswer(c, "501 Not Implemented", NULL, NULL, 0);
     }
-  if (req.rtmpport == -1 && !req.fullUrl.av_len)
+  c->http11 = rq->http11;
+  c->keepalive = rq->keepalive;
+  headonly = rq->headonly;
+
+  if (!strcmp(rq->target, "/status"))
     {
-      RTMP_Log(RTMP_LOGWARNING,
-	  "You haven't specified a port (--port) or rtmp url (-r), using default port");
-      req.rtmpport = 0;
+      len = ServerStatus(c->server, buf, sizeof(buf));
+      return ClientAnswer(c, "200 OK", "text/plain", buf, len);
     }
-  if (req.rtmpport == 0 && !req.fullUrl.av_len)
+  if (!strncmp(rq->target, "/hls/", 5))
+    return ClientSegment(c, rq->target + 5);
+  if (!strncmp(rq->target, "/hls.m3u8", 9)
+      && (!rq->target[9] || rq->target[9] == '?'))
+    rq->hls = TRUE;
+
+  ws = rq->websocket && !headonly && !rq->hls;
+  if (ws && !WsAccept(rq, accept))
     {
-      if (req.protocol & RTMP_FEATURE_SSL)
-	req.rtmpport = 443;
-      else if (req.protocol & RTMP_FEATURE_HTTP)
-	req.rtmpport = 80;
-      else
-	req.rtmpport = 1935;
+      c->keepalive = FALSE;
+      return ClientAnswer(c, "400 Bad Request", NULL, NULL, 0);
     }
 
-  if (req.tcUrl.av_len == 0)
+  status = ClientRequest(c);
+  if (!status && rq->hls)
+    return ClientPlaylist(c);
+  if (!status)
+    ClientSeek(c);
+  if (!status && !headonly && !ClientAttach(c))
+    status = "503 Service Unavailable";
+  if (status)
+    return ClientAnswer(c, status, NULL, NULL, 0);
+
+  if (ws)
     {
-      char str[512] = { 0 };
-      req.tcUrl.av_len = snprintf(str, 511, "%s://%.*s:%d/%.*s",
-	RTMPProtocolStringsLower[req.protocol], req.hostname.av_len,
-	req.hostname.av_val, req.rtmpport, req.app.av_len, req.app.av_val);
-      req.tcUrl.av_val = (char *) malloc(req.tcUrl.av_len + 1);
-      strcpy(req.tcUrl.av_val, str);
+      // FLV in binary frames until the stream ends, then close
+      c->ws = TRUE;
+      c->keepalive = FALSE;
+      c->eof = TRUE;
+      len = snprintf(buf, sizeof(buf),
+	"HTTP/1.1 101 Switching Protocols%sUpgrade: websocket\r\n"
+	"Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+	srvhead, accept);
+      ClientWrite(c, buf, len);
+      return ClientFlush(c);
     }
 
-  if (req.swfVfy)
+  if (c->cfd != -1 && !c->cache)
     {
-#ifdef CRYPTO
-        if (RTMP_HashSWF(req.swfUrl.av_val, &req.swfSize, req.hash, req.swfAge) == 0)
-          {
-            req.swfHash.av_val = (char *)req.hash;
-            req.swfHash.av_len = RTMP_SWF_HASHLEN;
-          }
-#endif
+      // a whole cache file, its length is known
+      c->eof = !c->keepalive;
+      len = snprintf(buf, sizeof(buf),
+	"HTTP/1.1 200 OK%sContent-Type: video/flv\r\nContent-Length: %lld\r\n%s\r\n",
+	srvhead, (long long) (c->cend - c->coff), ClientConnection(c));
+      ClientWrite(c, buf, len);
+      return ClientFlush(c);
     }
 
-  // after validation of the http request send response header
-  len = sprintf(buf, "HTTP/1.0 200 OK%sContent-Type: video/flv\r\n\r\n", srvhead);
-  send(sockfd, buf, len, 0);
+  // a body of unknown length needs chunks to keep the connection
+  c->chunked = c->http11;
+  if (!c->chunked && !headonly)
+    c->keepalive = FALSE;
+  c->eof = !c->keepalive;
 
-  // send the packets
-  buffer = (char *) calloc(PACKET_SIZE, 1);
+  // after validation of the http request send response header
+  len = snprintf(buf, sizeof(buf),
+    "HTTP/1.1 200 OK%sContent-Type: video/flv\r\n%s%s\r\n", srvhead,
+    c->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+    ClientConnection(c));
+  ClientWrite(c, buf, len);
+  return ClientFlush(c);
+}
 
-  // User defined seek offset
-  if (req.dStartOffset > 0)
-    {
-      if (req.bLiveStream)
-	RTMP_Log(RTMP_LOGWARNING,
-	    "Can't seek in a live stream, ignoring --seek option");
-      else
-	dSeek += req.dStartOffset;
-    }
+/* Take the next complete request header off c->in and answer it.
+ * Returns FALSE if c was closed.
+ */
+static int
+ClientParse(GW_CLIENT *c)
+{
+  GW_REQUEST *rq = c->rq;
+  char *end, *lf;
+  int len;
 
-  if (dSeek != 0)
+  // blank lines between requests are allowed
+  len = strspn(c->in, "\r\n");
+  if (len)
     {
-      RTMP_LogPrintf("Starting at TS: %d ms\n", dSeek);
+      c->inlen -= len;
+      memmove(c->in, c->in + len, c->inlen + 1);
     }
 
-  RTMP_Log(RTMP_LOGDEBUG, "Setting buffer time to: %dms", req.bufferTime);
-  RTMP_Init(&rtmp);
-  RTMP_SetBufferMS(&rtmp, req.bufferTime);
-  if (!req.fullUrl.av_len)
-    {
-      RTMP_SetupStream(&rtmp, req.protocol, &req.hostname, req.rtmpport, &req.sockshost,
-		       &req.playpath, &req.tcUrl, &req.swfUrl, &req.pageUrl, &req.app, &req.auth, &req.swfHash, req.swfSize, &req.flashVer, &req.subscribepath, &req.usherToken, dSeek, req.dStopOffset,
-		       req.bLiveStream, req.timeout);
-    }
+  end = strstr(c->in, "\r\n\r\n");
+  lf = strstr(c->in, "\n\n");
+  if (lf && (!end || lf < end))
+    len = lf + 2 - c->in;
+  else if (end)
+    len = end + 4 - c->in;
   else
     {
-      if (RTMP_SetupURL(&rtmp, req.fullUrl.av_val) == FALSE)
-        {
-          RTMP_Log(RTMP_LOGERROR, "Couldn't parse URL: %s", req.fullUrl.av_val);
-          return;
-        }
+      if (c->inlen < (int) sizeof(c->in) - 1)
+	return TRUE;
+      RTMP_TimerCancel(&c->server->timers, &c->timer);
+      c->state = CLIENT_ANSWERING;
+      c->keepalive = FALSE;
+      return ClientAnswer(c, "431 Request Header Fields Too Large", NULL,
+			  NULL, 0);
     }
-  /* backward compatibility, we always sent this as true before */
-  if (req.auth.av_len)
-    rtmp.Link.lFlags |= RTMP_LF_AUTH;
 
-  rtmp.Link.extras = req.extras;
-  rtmp.Link.token = req.token;
-  rtmp.m_read.timestamp = dSeek;
+  memcpy(rq->header, c->in, len);
+  rq->header[len] = '\0';
+  rq->hlen = len;
+  c->inlen -= len;
+  memmove(c->in, c->in + len, c->inlen + 1);
+  return ClientStart(c);
+}
 
-  RTMP_LogPrintf("Connecting ... port: %d, app: %s\n", req.rtmpport, req.app.av_val);
-  if (!RTMP_Connect(&rtmp, NULL))
+/* Response sent on a kept-alive connection: read the next request */
+static int
+ClientIdle(GW_CLIENT *c)
+{
+  RequestFree(c->rq);
+  if (!(c->rq = calloc(1, sizeof(GW_REQUEST))))
     {
-      RTMP_LogPrintf("%s, failed to connect!\n", __FUNCTION__);
+      ClientClose(c);
+      return FALSE;
     }
-  else
-    {
-      unsigned long size = 0;
-      double percent = 0;
-      double duration = 0.0;
-
-      int nWritten = 0;
-      int nRead = 0;
-
-      do
-	{
-	  nRead = RTMP_Read(&rtmp, buffer, PACKET_SIZE);
-
-	  if (nRead > 0)
-	    {
-	      if ((nWritten = send(sockfd, buffer, nRead, 0)) < 0)
-		{
-		  RTMP_Log(RTMP_LOGERROR, "%s, sending failed, error: %d", __FUNCTION__,
-		      GetSockError());
-		  goto cleanup;	// we are in STREAMING_IN_PROGRESS, so we'll go to STREAMING_ACCEPTING
-		}
+  c->state = CLIENT_READING;
+  c->ninit = 0;
+  c->skipping = FALSE;
+  c->chunked = FALSE;
+  c->ws = FALSE;
+  c->sent = 0;
+  c->plen = c->poff = 0;
+  c->coff = c->cend = c->clen = 0;
+  RTMP_TimerSet(&c->server->timers, &c->timer, GW_IDLE_TIMEOUT);
+  return ClientParse(c);
+}
 
-	      size += nRead;
+static void
+ClientEvent(GW_CLIENT *c, int events)
+{
+  char buf[512];
+  int n;
 
-	      //RTMP_LogPrintf("write %dbytes (%.1f KB)\n", nRead, nRead/1024.0);
-	      if (duration <= 0)	// if duration unknown try to get it from the stream (onMetaData)
-		duration = RTMP_GetDuration(&rtmp);
+  if (events & EV_READ)
+    {
+      // keep what a client sends ahead, it may be its next request
+      if (c->inlen < (int) sizeof(c->in) - 1)
+	n = recv(c->sockfd, c->in + c->inlen,
+		 sizeof(c->in) - 1 - c->inlen, 0);
+      else
+	n = recv(c->sockfd, buf, sizeof(buf), 0);
 
-	      if (duration > 0)
-		{
-		  percent =
-		    ((double) (dSeek + rtmp.m_read.timestamp)) / (duration *
-							   1000.0) * 100.0;
-		  percent = ((double) (int) (percent * 10.0)) / 10.0;
-		  RTMP_LogStatus("\r%.3f KB / %.2f sec (%.1f%%)",
-			    (double) size / 1024.0,
-			    (double) (rtmp.m_read.timestamp) / 1000.0, percent);
-		}
-	      else
-		{
-		  RTMP_LogStatus("\r%.3f KB / %.2f sec", (double) size / 1024.0,
-			    (double) (rtmp.m_read.timestamp) / 1000.0);
-		}
-	    }
-#ifdef _DEBUG
-	  else
-	    {
-	      RTMP_Log(RTMP_LOGDEBUG, "zero read!");
-	    }
-#endif
+      if (n < 0 && SockAgain(GetSockError()))
+	return;
+      if (n <= 0)
+	{
+	  ClientClose(c);
+	  return;
 	}
-      while (server->state == STREAMING_IN_PROGRESS && nRead > -1
-	     && RTMP_IsConnected(&rtmp) && nWritten >= 0);
-    }
-cleanup:
-  RTMP_LogPrintf("Closing connection... ");
-  RTMP_Close(&rtmp);
-  RTMP_LogPrintf("done!\n\n");
-
-quit:
-  if (buffer)
-    {
-      free(buffer);
-      buffer = NULL;
+      if (c->inlen == (int) sizeof(c->in) - 1)
+	{
+	  // too much to hold: finish this response and close
+	  c->keepalive = FALSE;
+	  c->eof = TRUE;
+	}
+      else
+	{
+	  c->inlen += n;
+	  c->in[c->inlen] = '\0';
+	}
+      if (c->state == CLIENT_READING && !ClientParse(c))
+	return;
+      if (c->ws && !ClientWsRead(c))
+	return;
     }
+  if (events & EV_WRITE)
+    ClientFlush(c);
+}
 
-  if (sockfd)
-    closesocket(sockfd);
+static void
+ServerAccept(STREAMING_SERVER *server)
+{
+  GW_CLIENT *c;
 
-  if (server->state == STREAMING_IN_PROGRESS)
-    server->state = STREAMING_ACCEPTING;
+  while (1)
+    {
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof(struct sockaddr_in);
+      int sockfd =
+	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
 
-  return;
+      if (sockfd < 0)
+	{
+	  if (!SockAgain(GetSockError()))
+	    RTMP_Log(RTMP_LOGERROR, "%s: accept failed, error %d", __FUNCTION__,
+		GetSockError());
+	  return;
+	}
 
-filenotfound:
-  RTMP_LogPrintf("%s, %s, %s\n", __FUNCTION__, status, filename);
-  len = sprintf(buf, "HTTP/1.0 %s%s\r\n", status, srvhead);
-  send(sockfd, buf, len, 0);
-  goto quit;
+      SetNonBlock(sockfd);
+      {
+	int bufsize = GW_SNDBUF, on = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, (char *) &bufsize,
+		   sizeof(bufsize));
+	// GW_MSG_MORE batches writes, the last one goes out at once
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+      }
+      c = calloc(1, sizeof(GW_CLIENT));
+      if (c && !(c->rq = calloc(1, sizeof(GW_REQUEST))))
+	{
+	  free(c);
+	  c = NULL;
+	}
+      if (!c)
+	{
+	  closesocket(sockfd);
+	  continue;
+	}
+      c->server = server;
+      c->sockfd = sockfd;
+      c->cfd = -1;
+      c->id = ServerId(server);
+      c->state = CLIENT_READING;
+      RTMP_TimerInit(&c->timer, ClientTimeout, c);
+      RTMP_TimerSet(&server->timers, &c->timer, GW_REQ_TIMEOUT);
+
+      if ((c->next = server->clients))
+	c->next->pprev = &c->next;
+      c->pprev = &server->clients;
+      server->clients = c;
+
+      c->events = EV_READ;
+      EvSet(&server->ev, sockfd, EV_READ, 0, c);
+
+      RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection %d from %s\n", __FUNCTION__,
+	  c->id, inet_ntoa(addr.sin_addr));
+    }
 }
 
+/* The event loop: accepts clients, reads their requests and sends
+ * them what the session threads read, all without blocking.
+ */
 TFTYPE
 serverThread(void *arg)
 {
   STREAMING_SERVER *server = arg;
-  server->state = STREAMING_ACCEPTING;
+  GW_EVENT evs[64];
+  GW_STREAM *s, *snext;
+  GW_CLIENT *c, *next;
+  uint64_t head;
+  uint32_t lastts;
+  int i, n, timeout;
 
-  while (server->state == STREAMING_ACCEPTING)
+  while (1)
     {
-      struct sockaddr_in addr;
-      socklen_t addrlen = sizeof(struct sockaddr_in);
-      int sockfd =
-	accept(server->socket, (struct sockaddr *) &addr, &addrlen);
+      if (server->state == STREAMING_STOPPING)
+	{
+	  if (server->socket != -1)
+	    {
+	      EvDel(&server->ev, server->socket);
+	      if (closesocket(server->socket))
+		RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
+		    __FUNCTION__, GetSockError());
+	      server->socket = -1;
+	    }
+	  for (s = server->streams; s; s = snext)
+	    {
+	      snext = s->next;
+	      if (s->hlsopen)
+		StreamHlsStop(s);
+	    }
+	  while (server->clients)
+	    ClientClose(server->clients);
+
+	  // wait for streaming threads to exit
+	  TMutexLock(&server->lock);
+	  n = server->sessions;
+	  TMutexUnlock(&server->lock);
+	  if (!n)
+	    break;
+	}
 
-      if (sockfd > 0)
+      timeout = RTMP_TimerNextDelay(&server->timers);
+#ifdef WIN32
+      // no wakeup pipe, poll for queued data instead
+      if (timeout < 0 || timeout > 10)
+	timeout = 10;
+#endif
+      n = EvWait(&server->ev, evs, 64, timeout);
+      for (i = 0; i < n; i++)
 	{
-	  // Create a new process and transfer the control to that
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: accepted connection from %s\n", __FUNCTION__,
-	      inet_ntoa(addr.sin_addr));
-	  processTCPrequest(server, sockfd);
-	  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
+	  if (evs[i].ptr == server)
+	    ServerAccept(server);
+	  else if (evs[i].ptr == server->wake)
+	    {
+#ifndef WIN32
+	      char buf[64];
+	      while (read(server->wake[0], buf, sizeof(buf)) > 0);
+#endif
+	    }
+	  else
+	    ClientEvent(evs[i].ptr, evs[i].events);
 	}
-      else
+      RTMP_TimerAdvance(&server->timers, RTMP_GetTime());
+
+      // s stays marked ready until unlinked, so its rnext holds still
+      TMutexLock(&server->lock);
+      s = server->ready;
+      server->ready = NULL;
+      TMutexUnlock(&server->lock);
+      for (; s; s = snext)
 	{
-	  RTMP_Log(RTMP_LOGERROR, "%s: accept failed", __FUNCTION__);
+	  TMutexLock(&server->lock);
+	  snext = s->rnext;
+	  s->ready = FALSE;
+	  TMutexUnlock(&server->lock);
+	  TMutexLock(&s->lock);
+	  head = s->head;
+	  lastts = s->lastts;
+	  TMutexUnlock(&s->lock);
+	  // clients waiting for EV_WRITE are flushed from there, but
+	  // don't keep one that stopped reading
+	  for (c = s->clients; c; c = next)
+	    {
+	      next = c->snext;
+	      if (!(c->events & EV_WRITE))
+		ClientFlush(c);
+	      else if (s->key && c->ninit == c->initend
+		       && (head - c->seq > GW_RING_SLOTS
+			   || (int64_t) (int32_t) (lastts - c->ts) - c->minlag
+			      > GW_LAG_MAX))
+		{
+		  RTMP_Log(RTMP_LOGWARNING, "%s: connection %d stalled on stream %d, closing",
+		      __FUNCTION__, c->id, s->id);
+		  ClientClose(c);
+		}
+	    }
 	}
     }
+
+#ifndef WIN32
+  close(server->wake[0]);
+  close(server->wake[1]);
+#endif
+  EvFree(&server->ev);
   server->state = STREAMING_STOPPED;
   TFRET();
 }
 
-STREAMING_SERVER *
-startStreaming(const char *address, int port)
+/* Empty and free the store, once no shard runs */
+static void
+StoreFree(GW_STORE *store)
+{
+  GW_INDEX *ix;
+
+  while ((ix = store->index))
+    {
+      store->index = ix->next;
+      IndexFree(ix);
+    }
+  while (store->cache)
+    CacheUnlist(store, store->cache);
+  // the HLS states belong to their streams, which are gone
+  while (store->hls)
+    HlsUnlist(store, store->hls);
+  TMutexFree(&store->lock);
+  free(store);
+}
+
+/* Start shard number shard of nshards listening on address:port */
+static STREAMING_SERVER *
+ShardStart(const char *address, int port, GW_STORE *store, int shard,
+	   int nshards)
 {
   struct sockaddr_in addr;
   int sockfd;
@@ -705,6 +4333,14 @@ startStreaming(const char *address, int port)
       return 0;
     }
 
+#ifdef SO_REUSEPORT
+  if (nshards > 1)
+    {
+      int on = 1;
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on));
+    }
+#endif
+
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
   addr.sin_port = htons(port);
@@ -714,56 +4350,166 @@ startStreaming(const char *address, int port)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d", __FUNCTION__,
 	  port);
+      closesocket(sockfd);
       return 0;
     }
 
-  if (listen(sockfd, 10) == -1)
+  if (listen(sockfd, SOMAXCONN) == -1)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, listen failed", __FUNCTION__);
       closesocket(sockfd);
       return 0;
     }
+  SetNonBlock(sockfd);
 
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
+  server->state = STREAMING_ACCEPTING;
+  server->shard = shard;
+  server->nshards = nshards;
+  server->store = store;
+  TMutexInit(&server->lock);
+  RTMP_TimerWheelInit(&server->timers, RTMP_GetTime());
+
+  if (!EvInit(&server->ev))
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, couldn't create event queue", __FUNCTION__);
+      closesocket(sockfd);
+      free(server);
+      return 0;
+    }
+#ifndef WIN32
+  if (pipe(server->wake) == -1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "%s, couldn't create wakeup pipe", __FUNCTION__);
+      EvFree(&server->ev);
+      closesocket(sockfd);
+      free(server);
+      return 0;
+    }
+  SetNonBlock(server->wake[0]);
+  SetNonBlock(server->wake[1]);
+  EvSet(&server->ev, server->wake[0], EV_READ, 0, server->wake);
+#endif
+  EvSet(&server->ev, sockfd, EV_READ, 0, server);
 
   ThreadCreate(serverThread, server);
 
   return server;
 }
 
-void
-stopStreaming(STREAMING_SERVER * server)
+/* Start that many shards on address:port. Returns the first, the
+ * others follow on its next list.
+ */
+STREAMING_SERVER *
+startStreaming(const char *address, int port, int shards)
 {
-  assert(server);
+  STREAMING_SERVER *first = NULL, **last = &first;
+  GW_STORE *store;
+  int i;
+
+  // the first RTMP_Init sets up the shared TLS context; don't let
+  // concurrent sessions race to it
+  {
+    RTMP *rtmp = RTMP_Alloc();
+    if (rtmp)
+      {
+	RTMP_Init(rtmp);
+	RTMP_Free(rtmp);
+      }
+  }
 
-  if (server->state != STREAMING_STOPPED)
+  store = (GW_STORE *) calloc(1, sizeof(GW_STORE));
+  if (!store)
+    return 0;
+  TMutexInit(&store->lock);
+  if ((store->cachedir = cacheDir))
     {
-      if (server->state == STREAMING_IN_PROGRESS)
+      store->cachemax = cacheMax;
+      if (!CacheLoad(store))
 	{
-	  server->state = STREAMING_STOPPING;
+	  StoreFree(store);
+	  return 0;
+	}
+    }
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
+  for (i = 0; i < shards; i++)
+    {
+      if (!(*last = ShardStart(address, port, store, i, shards)))
+	{
+	  if (first)
+	    {
+	      stopStreaming(first);
+	      freeStreaming(first);
+	    }
+	  else
+	    StoreFree(store);
+	  return 0;
 	}
+      last = &(*last)->next;
+    }
+  return first;
+}
+
+void
+stopStreaming(STREAMING_SERVER * server)
+{
+  STREAMING_SERVER *shard;
+
+  assert(server);
+
+  for (shard = server; shard; shard = shard->next)
+    if (shard->state != STREAMING_STOPPED)
+      {
+	shard->state = STREAMING_STOPPING;
+	ServerWake(shard);
+      }
+
+  // wait for the event loops to close everything
+  for (shard = server; shard; shard = shard->next)
+    while (shard->state != STREAMING_STOPPED)
+      msleep(1);
+}
 
-      if (closesocket(server->socket))
-	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
-	    __FUNCTION__, GetSockError());
+/* Free the stopped shards and their store */
+void
+freeStreaming(STREAMING_SERVER * server)
+{
+  STREAMING_SERVER *next;
 
-      server->state = STREAMING_STOPPED;
+  if (!server)
+    return;
+  StoreFree(server->store);
+  for (; server; server = next)
+    {
+      next = server->next;
+      TMutexFree(&server->lock);
+      free(server);
     }
 }
 
 
+/* Tell the shards to stop, without waiting for them */
+static void
+ServersStop(void)
+{
+  STREAMING_SERVER *server;
+
+  for (server = httpServer; server; server = server->next)
+    if (server->state != STREAMING_STOPPED)
+      {
+	server->state = STREAMING_STOPPING;
+	ServerWake(server);
+      }
+}
+
 void
 sigIntHandler(int sig)
 {
   RTMP_ctrlC = TRUE;
   RTMP_LogPrintf("Caught signal: %d, cleaning up, just a second...\n", sig);
-  if (httpServer)
-    stopStreaming(httpServer);
+  // may be running on an event loop thread: don't wait for it here
+  ServersStop();
   signal(SIGINT, SIG_DFL);
 }
 
@@ -960,6 +4706,7 @@ ParseOption(char opt, char *arg, RTMP_REQUEST * req)
       break;
     case 'S':
       STR2AVAL(req->sockshost, arg);
+      break;
     case 'q':
       RTMP_debuglevel = RTMP_LOGCRIT;
       break;
@@ -989,6 +4736,8 @@ main(int argc, char **argv)
 
   char *httpStreamingDevice = DEFAULT_HTTP_STREAMING_DEVICE;	// streaming device, default 0.0.0.0
   int nHttpStreamingPort = 80;	// port
+  int nShards = 1;		// event loops, each with its own listener
+  STREAMING_SERVER *server;
 
   RTMP_LogPrintf("HTTP-RTMP Stream Gateway %s\n", RTMPDUMP_VERSION);
   RTMP_LogPrintf("(c) 2010 Andrej Stepanchuk, Howard Chu; license: GPL\n\n");
@@ -1036,6 +4785,9 @@ main(int argc, char **argv)
     //{"skip",    1, NULL, 'k'},
     {"device", 1, NULL, 'D'},
     {"sport", 1, NULL, 'g'},
+    {"shards", 1, NULL, 'N'},
+    {"cache", 1, NULL, 'K'},
+    {"cachesize", 1, NULL, 'Q'},
     {"subscribe", 1, NULL, 'd'},
     {"start", 1, NULL, 'A'},
     {"stop", 1, NULL, 'B'},
@@ -1056,7 +4808,7 @@ main(int argc, char **argv)
 
   while ((opt =
 	  getopt_long(argc, argv,
-		      "hvqVzr:s:t:i:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:w:x:W:X:S:j:", longopts,
+		      "hvqVzr:s:t:i:p:a:f:u:n:c:l:y:m:d:D:A:B:T:g:N:K:Q:w:x:W:X:S:j:", longopts,
 		      NULL)) != -1)
     {
       switch (opt)
@@ -1128,8 +4880,15 @@ main(int argc, char **argv)
 	    ("--device|-D             Streaming device ip address (default: %s)\n",
 	     DEFAULT_HTTP_STREAMING_DEVICE);
 	  RTMP_LogPrintf
-	    ("--sport|-g              Streaming port (default: %d)\n\n",
+	    ("--sport|-g              Streaming port (default: %d)\n",
 	     nHttpStreamingPort);
+	  RTMP_LogPrintf
+	    ("--shards|-N num         Event loops sharing the port, 0 for one per CPU (default: 1)\n");
+	  RTMP_LogPrintf
+	    ("--cache|-K dir          Keep VOD downloads in dir and serve them from there\n");
+	  RTMP_LogPrintf
+	    ("--cachesize|-Q num      Cache size cap in MB (default: %lld)\n\n",
+	     (long long) (cacheMax >> 20));
 	  RTMP_LogPrintf
 	    ("--quiet|-q              Suppresses all command output.\n");
 	  RTMP_LogPrintf("--verbose|-V            Verbose command output.\n");
@@ -1167,6 +4926,33 @@ main(int argc, char **argv)
 	      }
 	    break;
 	  }
+	case 'N':
+	  nShards = ThreadShards(optarg);
+	  break;
+	case 'K':
+	  if (strlen(optarg) > GW_PATH_MAX - 64)
+	    {
+	      RTMP_Log(RTMP_LOGERROR, "Cache directory name too long, ignoring");
+	    }
+	  else
+	    {
+	      cacheDir = optarg;
+	    }
+	  break;
+	case 'Q':
+	  {
+	    double mb = atof(optarg);
+	    if (mb <= 0)
+	      {
+		RTMP_Log(RTMP_LOGERROR,
+		    "Invalid cache size (requested %s MB), ignoring", optarg);
+	      }
+	    else
+	      {
+		cacheMax = (int64_t) (mb * 1024 * 1024);
+	      }
+	    break;
+	  }
 	default:
 	  //RTMP_LogPrintf("unknown option: %c\n", opt);
 	  if (!ParseOption(opt, optarg, &defaultRTMPRequest))
@@ -1180,24 +4966,34 @@ main(int argc, char **argv)
   netstackdump_read = fopen("netstackdump_read", "wb");
 #endif
 
+  /* keep stdio off the connection threads */
+  RTMP_LogAsyncStart(0);
+
   // start text UI
   ThreadCreate(controlServerThread, 0);
 
   // start http streaming
   if ((httpServer =
-       startStreaming(httpStreamingDevice, nHttpStreamingPort)) == 0)
+       startStreaming(httpStreamingDevice, nHttpStreamingPort, nShards)) == 0)
     {
       RTMP_Log(RTMP_LOGERROR, "Failed to start HTTP server, exiting!");
+      RTMP_LogAsyncStop();
       return RD_FAILED;
     }
   RTMP_LogPrintf("Streaming on http://%s:%d\n", httpStreamingDevice,
 	    nHttpStreamingPort);
+  if (nShards > 1)
+    RTMP_LogPrintf("%d shards\n", nShards);
 
-  while (httpServer->state != STREAMING_STOPPED)
-    {
-      sleep(1);
-    }
+  for (server = httpServer; server; server = server->next)
+    while (server->state != STREAMING_STOPPED)
+      {
+	sleep(1);
+      }
+  freeStreaming(httpServer);
+  httpServer = NULL;
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
+  RTMP_LogAsyncStop();
 
   CleanupSockets();
 
@@ -78,10 +78,18 @@ enum
   STREAMING_STOPPED
 };
 
-typedef struct
+/* One shard: a listening socket and the thread serving it. With
+ * SO_REUSEPORT, each shard has its own socket on the same port and the
+ * kernel spreads connections over them.
+ */
+typedef struct STREAMING_SERVER
 {
   int socket;
   int state;
+  struct STREAMING_SERVER *next;	// next shard
+  int shard;
+  int nshards;
+  int nconn;
   int streamID;
   int arglen;
   int argc;
@@ -93,9 +101,11 @@ typedef struct
 
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
 void *sslCtx = NULL;
+int fastOpen = FALSE;		// -F: TCP Fast Open on the listening sockets
 
-STREAMING_SERVER *startStreaming(const char *address, int port);
+STREAMING_SERVER *startStreaming(const char *address, int port, int shards);
 void stopStreaming(STREAMING_SERVER * server);
+void freeStreaming(STREAMING_SERVER * server);
 void AVreplace(AVal *src, const AVal *orig, const AVal *repl);
 
 static const AVal av_dquote = AVC("\"");
@@ -147,7 +157,6 @@ FILE *netstackdump_read = NULL;
 #define SAVC(x) static const AVal av_##x = AVC(#x)
 
 SAVC(app);
-SAVC(connect);
 SAVC(flashVer);
 SAVC(swfUrl);
 SAVC(pageUrl);
@@ -159,9 +168,6 @@ SAVC(videoCodecs);
 SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(_result);
-SAVC(createStream);
-SAVC(getStreamLength);
-SAVC(play);
 SAVC(fmsVer);
 SAVC(mode);
 SAVC(level);
@@ -263,7 +269,6 @@ static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
 static const AVal av_Stopped_playing = AVC("Stopped playing");
 SAVC(details);
 SAVC(clientid);
-static const AVal av_NetStream_Authenticate_UsherToken = AVC("NetStream.Authenticate.UsherToken");
 
 static int
 SendPlayStart(RTMP *r)
@@ -459,13 +464,48 @@ dumpAMF(AMFObject *obj, char *ptr, AVal *argv, int *argc)
   return ptr;
 }
 
+/* What ServeInvoke() reads from an invoke besides connect */
+typedef struct INVOKE
+{
+  int n;			// top level values seen
+  AVal method;
+  double txn;
+  AVal arg;			// fourth value, if a string
+} INVOKE;
+
+static int
+WalkInvoke(const AMFWalkEvent *ev, void *ctx)
+{
+  INVOKE *in = ctx;
+
+  // containers are skipped, so every event is a top level value
+  switch (in->n++)
+    {
+    case 0:
+      if (ev->e_type != AMF_STRING)
+	return AMF_WALK_STOP;
+      in->method = ev->e_aval;
+      return AMF_WALK_CONTINUE;
+    case 1:
+      if (ev->e_type == AMF_NUMBER)
+	in->txn = ev->e_number;
+      return AMF_WALK_SKIP;
+    case 2:
+      return AMF_WALK_SKIP;
+    default:
+      if (ev->e_type == AMF_STRING)
+	in->arg = ev->e_aval;
+      return AMF_WALK_STOP;
+    }
+}
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 int
 ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int offset)
 {
   const char *body;
   unsigned int nBodySize;
-  int ret = 0, nRes;
+  int ret = 0;
 
   body = packet->m_body + offset;
   nBodySize = packet->m_nBodySize - offset;
@@ -477,21 +517,30 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
       return 0;
     }
 
-  AMFObject obj;
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
+  INVOKE in = {0};
+  if (AMF_Walk(body, nBodySize, WalkInvoke, &in) < 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
+  double txn = in.txn;
+  RTMP_Log(RTMP_LOGDEBUG, "%s, client invoking <%.*s>", __FUNCTION__,
+      in.method.av_len, in.method.av_val);
+  RTMP_NAME id = RTMP_NameLookup(&in.method);
+
+  // only connect needs the whole tree, to copy its extra arguments
+  AMFObject obj = {0};
+  if (id == RTMP_NAME_CONNECT || RTMP_LogEnabled(RTMP_LOGDEBUG))
+    {
+      if (AMF_Decode(&obj, body, nBodySize, FALSE) < 0)
+	{
+	  RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
+	  return 0;
+	}
+      AMF_Dump(&obj);
+    }
 
-  AMF_Dump(&obj);
-  AVal method;
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  double txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-  RTMP_Log(RTMP_LOGDEBUG, "%s, client invoking <%s>", __FUNCTION__, method.av_val);
-
-  if (AVMATCH(&method, &av_connect))
+  if (id == RTMP_NAME_CONNECT)
     {
       AMFObject cobj;
       AVal pname, pval;
@@ -570,33 +619,35 @@ ServeInvoke(STREAMING_SERVER *server, RTMP * r, RTMPPacket *packet, unsigned int
 	}
       SendConnectResult(r, txn);
     }
-  else if (AVMATCH(&method, &av_createStream))
+  else if (id == RTMP_NAME_CREATESTREAM)
     {
       SendResultNumber(r, txn, ++server->streamID);
     }
-  else if (AVMATCH(&method, &av_getStreamLength))
+  else if (id == RTMP_NAME_GETSTREAMLENGTH)
     {
       SendResultNumber(r, txn, 10.0);
     }
-  else if (AVMATCH(&method, &av_NetStream_Authenticate_UsherToken))
+  else if (id == RTMP_NAME_USHERTOKEN)
     {
-      AVal usherToken;
-      AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &usherToken);
+      AVal usherToken = in.arg;
       AVreplace(&usherToken, &av_dquote, &av_escdquote);
       server->arglen += 6 + usherToken.av_len;
       server->argc += 2;
       r->Link.usherToken = usherToken;
     }
-  else if (AVMATCH(&method, &av_play))
+  else if (id == RTMP_NAME_PLAY)
     {
       char *file, *p, *q, *cmd, *ptr;
       AVal *argv, av;
       int len, argc;
       uint32_t now;
       RTMPPacket pc = {0};
-      AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &r->Link.playpath);
+      r->Link.playpath = in.arg;
       if (!r->Link.playpath.av_len)
-        return 0;
+        {
+          AMF_Reset(&obj);
+          return 0;
+        }
       /*
       r->Link.seekTime = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 4));
       if (obj.o_num > 5)
@@ -860,10 +911,10 @@ controlServerThread(void *unused)
       switch (ich)
 	{
 	case 'q':
+	  // main stops the shards, stops the logger and exits
 	  RTMP_LogPrintf("Exiting\n");
-	  stopStreaming(rtmpServer);
-	  exit(0);
-	  break;
+	  RTMP_ctrlC = TRUE;
+	  TFRET();
 	default:
 	  RTMP_LogPrintf("Unknown command \'%c\', ignoring\n", ich);
 	}
@@ -973,7 +1024,9 @@ serverThread(void *arg)
 	      inet_ntoa(addr.sin_addr));
 #endif
 	  /* Create a new thread and transfer the control to that */
+	  RTMP_LogSetConnId(++server->nconn * server->nshards + server->shard);
 	  doServe(server, sockfd);
+	  RTMP_LogSetConnId(0);
 	  RTMP_Log(RTMP_LOGDEBUG, "%s: processed request\n", __FUNCTION__);
 	}
       else
@@ -985,8 +1038,8 @@ serverThread(void *arg)
   TFRET();
 }
 
-STREAMING_SERVER *
-startStreaming(const char *address, int port)
+static STREAMING_SERVER *
+ShardStart(const char *address, int port, int shard, int nshards)
 {
   struct sockaddr_in addr;
   int sockfd, tmp;
@@ -1003,6 +1056,25 @@ startStreaming(const char *address, int port)
   setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
 				(char *) &tmp, sizeof(tmp) );
 
+#ifdef SO_REUSEPORT
+  if (nshards > 1)
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				(char *) &tmp, sizeof(tmp) );
+#endif
+
+#ifdef TCP_FASTOPEN
+  if (fastOpen)
+    {
+      /* accept handshake data carried in the SYN from TFO clients */
+      tmp = 16;
+      if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+				(char *) &tmp, sizeof(tmp) ) == -1)
+	RTMP_Log(GetSockError() == ENOPROTOOPT ? RTMP_LOGDEBUG : RTMP_LOGWARNING,
+	    "%s, TCP Fast Open not enabled, error %d", __FUNCTION__,
+	    GetSockError());
+    }
+#endif
+
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
   addr.sin_port = htons(port);
@@ -1012,6 +1084,7 @@ startStreaming(const char *address, int port)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d", __FUNCTION__,
 	  port);
+      closesocket(sockfd);
       return 0;
     }
 
@@ -1024,33 +1097,72 @@ startStreaming(const char *address, int port)
 
   server = (STREAMING_SERVER *) calloc(1, sizeof(STREAMING_SERVER));
   server->socket = sockfd;
+  server->shard = shard;
+  server->nshards = nshards;
 
   ThreadCreate(serverThread, server);
 
   return server;
 }
 
+/* Start that many shards on address:port. Returns the first, the
+ * others follow on its next list.
+ */
+STREAMING_SERVER *
+startStreaming(const char *address, int port, int shards)
+{
+  STREAMING_SERVER *first = NULL, **last = &first;
+  int i;
+
+  for (i = 0; i < shards; i++)
+    {
+      if (!(*last = ShardStart(address, port, i, shards)))
+	{
+	  if (first)
+	    {
+	      stopStreaming(first);
+	      freeStreaming(first);
+	    }
+	  return 0;
+	}
+      last = &(*last)->next;
+    }
+  return first;
+}
+
 void
 stopStreaming(STREAMING_SERVER * server)
 {
   assert(server);
 
-  if (server->state != STREAMING_STOPPED)
-    {
-      if (server->state == STREAMING_IN_PROGRESS)
-	{
-	  server->state = STREAMING_STOPPING;
+  for (; server; server = server->next)
+    if (server->state != STREAMING_STOPPED)
+      {
+	if (server->state == STREAMING_IN_PROGRESS)
+	  {
+	    server->state = STREAMING_STOPPING;
 
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
-	}
+	    // wait for streaming threads to exit
+	    while (server->state != STREAMING_STOPPED)
+	      msleep(1);
+	  }
 
-      if (closesocket(server->socket))
-	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
-	    __FUNCTION__, GetSockError());
+	if (closesocket(server->socket))
+	  RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
+	      __FUNCTION__, GetSockError());
+
+	server->state = STREAMING_STOPPED;
+      }
+}
 
-      server->state = STREAMING_STOPPED;
+void
+freeStreaming(STREAMING_SERVER * server)
+{
+  while (server)
+    {
+      STREAMING_SERVER *next = server->next;
+      free(server);
+      server = next;
     }
 }
 
@@ -1077,6 +1189,8 @@ main(int argc, char **argv)
   char *rtmpStreamingDevice = DEFAULT_HTTP_STREAMING_DEVICE;	// streaming device, default 0.0.0.0
   int nRtmpStreamingPort = 1935;	// port
   char *cert = NULL, *key = NULL;
+  int nShards = 1;
+  STREAMING_SERVER *server;
 
   RTMP_LogPrintf("RTMP Server %s\n", RTMPDUMP_VERSION);
   RTMP_LogPrintf("(c) 2010 Andrej Stepanchuk, Howard Chu; license: GPL\n\n");
@@ -1091,6 +1205,18 @@ main(int argc, char **argv)
         cert = argv[++i];
       else if (!strcmp(argv[i], "-k") && i + 1 < argc)
         key = argv[++i];
+      else if (!strcmp(argv[i], "-F"))
+        {
+#ifdef TCP_FASTOPEN
+          fastOpen = TRUE;
+#else
+          RTMP_Log(RTMP_LOGERROR, "No TCP Fast Open here, ignoring -F");
+#endif
+        }
+      else if (!strcmp(argv[i], "-N") && i + 1 < argc)
+        {
+          nShards = ThreadShards(argv[++i]);
+        }
     }
 
   if (cert && key)
@@ -1119,24 +1245,37 @@ main(int argc, char **argv)
 
   InitSockets();
 
+  /* keep stdio off the connection threads */
+  RTMP_LogAsyncStart(0);
+
   // start text UI
   ThreadCreate(controlServerThread, 0);
 
   // start http streaming
   if ((rtmpServer =
-       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort)) == 0)
+       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort, nShards)) == 0)
     {
       RTMP_Log(RTMP_LOGERROR, "Failed to start RTMP server, exiting!");
+      RTMP_LogAsyncStop();
       return RD_FAILED;
     }
   RTMP_LogPrintf("Streaming on rtmp://%s:%d\n", rtmpStreamingDevice,
 	    nRtmpStreamingPort);
+  if (nShards > 1)
+    RTMP_LogPrintf("%d shards\n", nShards);
 
-  while (rtmpServer->state != STREAMING_STOPPED)
-    {
-      sleep(1);
-    }
+  for (server = rtmpServer; server; server = server->next)
+    while (server->state != STREAMING_STOPPED)
+      {
+	if (RTMP_ctrlC)
+	  stopStreaming(rtmpServer);
+	else
+	  sleep(1);
+      }
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
+  RTMP_LogAsyncStop();
+
+  freeStreaming(rtmpServer);
 
   if (sslCtx)
     RTMP_TLS_FreeServerContext(sslCtx);
@@ -84,10 +84,15 @@ typedef struct Plist
   RTMPPacket p_pkt;
 } Plist;
 
-typedef struct
+/* One shard: a listening socket and the thread accepting on it. With
+ * SO_REUSEPORT, each shard has its own socket on the same port and the
+ * kernel spreads connections over them. Connections copy it.
+ */
+typedef struct STREAMING_SERVER
 {
   int socket;
   int state;
+  struct STREAMING_SERVER *next;	// next shard
   uint32_t stamp;
   RTMP rs;
   RTMP rc;
@@ -99,8 +104,10 @@ typedef struct
 } STREAMING_SERVER;
 
 STREAMING_SERVER *rtmpServer = 0;	// server structure pointer
+int fastOpen = FALSE;		// -F: TCP Fast Open on the listening sockets
 
-STREAMING_SERVER *startStreaming(const char *address, int port);
+STREAMING_SERVER *startStreaming(const char *address, int port, int shards);
+void freeStreaming(STREAMING_SERVER * server);
 void stopStreaming(STREAMING_SERVER * server);
 
 #define STR2AVAL(av,str)	av.av_val = str; av.av_len = strlen(av.av_val)
@@ -119,7 +126,6 @@ FILE *netstackdump_read = NULL;
 #define SAVC(x) static const AVal av_##x = AVC(#x)
 
 SAVC(app);
-SAVC(connect);
 SAVC(flashVer);
 SAVC(swfUrl);
 SAVC(pageUrl);
@@ -132,32 +138,61 @@ SAVC(videoFunction);
 SAVC(objectEncoding);
 SAVC(_result);
 SAVC(createStream);
-SAVC(play);
-SAVC(closeStream);
 SAVC(fmsVer);
 SAVC(mode);
-SAVC(level);
 SAVC(code);
 SAVC(secureToken);
-SAVC(onStatus);
-SAVC(close);
-static const AVal av_NetStream_Failed = AVC("NetStream.Failed");
-static const AVal av_NetStream_Play_Failed = AVC("NetStream.Play.Failed");
-static const AVal av_NetStream_Play_StreamNotFound =
-AVC("NetStream.Play.StreamNotFound");
-static const AVal av_NetConnection_Connect_InvalidApp =
-AVC("NetConnection.Connect.InvalidApp");
-static const AVal av_NetStream_Play_Start = AVC("NetStream.Play.Start");
-static const AVal av_NetStream_Play_Complete = AVC("NetStream.Play.Complete");
-static const AVal av_NetStream_Play_Stop = AVC("NetStream.Play.Stop");
 
 static const char *cst[] = { "client", "server" };
 
+/* What ServeInvoke() reads from an invoke besides connect: the method
+ * and the fourth value, the path to play or the onStatus info object */
+typedef struct INVOKE
+{
+  int n;			// top level values seen
+  AVal method;
+  AVal arg;			// fourth value, if a string
+  AVal code;			// code member of the fourth value
+} INVOKE;
+
+static int
+WalkInvoke(const AMFWalkEvent *ev, void *ctx)
+{
+  INVOKE *in = ctx;
+
+  if (ev->e_depth == 0)
+    {
+      if (ev->e_type == AMF_OBJECT_END)
+        return AMF_WALK_STOP;	// end of the info object
+      switch (in->n++)
+        {
+        case 0:
+          if (ev->e_type != AMF_STRING)
+            return AMF_WALK_STOP;
+          in->method = ev->e_aval;
+          return AMF_WALK_CONTINUE;
+        case 1:
+        case 2:
+          return AMF_WALK_SKIP;
+        default:
+          if (ev->e_type == AMF_OBJECT || ev->e_type == AMF_ECMA_ARRAY)
+            return AMF_WALK_CONTINUE;
+          if (ev->e_type == AMF_STRING)
+            in->arg = ev->e_aval;
+          return AMF_WALK_STOP;
+        }
+    }
+  if (ev->e_depth == 1 && ev->e_type == AMF_STRING && !in->code.av_val
+      && AVMATCH(&ev->e_name, &av_code))
+    in->code = ev->e_aval;
+  return AMF_WALK_SKIP;
+}
+
 // Returns 0 for OK/Failed/error, 1 for 'Stop or Complete'
 int
 ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *body)
 {
-  int ret = 0, nRes;
+  int ret = 0;
   int nBodySize = pack->m_nBodySize;
 
   if (body > pack->m_body)
@@ -170,20 +205,31 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       return 0;
     }
 
-  AMFObject obj;
-  nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-  if (nRes < 0)
+  INVOKE in;
+  memset(&in, 0, sizeof(in));
+  if (AMF_Walk(body, nBodySize, WalkInvoke, &in) < 0)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
       return 0;
     }
+  RTMP_Log(RTMP_LOGDEBUG, "%s, %s invoking <%.*s>", __FUNCTION__, cst[which],
+      in.method.av_len, in.method.av_val);
+  RTMP_NAME id = RTMP_NameLookup(&in.method);
 
-  AMF_Dump(&obj);
-  AVal method;
-  AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-  RTMP_Log(RTMP_LOGDEBUG, "%s, %s invoking <%s>", __FUNCTION__, cst[which], method.av_val);
+  // only connect needs the whole tree, for its command object and flags
+  AMFObject obj;
+  memset(&obj, 0, sizeof(obj));
+  if (id == RTMP_NAME_CONNECT || RTMP_LogEnabled(RTMP_LOGDEBUG))
+    {
+      if (AMF_Decode(&obj, body, nBodySize, FALSE) < 0)
+        {
+          RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
+          return 0;
+        }
+      AMF_Dump(&obj);
+    }
 
-  if (AVMATCH(&method, &av_connect))
+  if (id == RTMP_NAME_CONNECT)
     {
       AMFObject cobj;
       AVal pname, pval;
@@ -304,7 +350,7 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
         }
       server->rc.m_bSendCounter = FALSE;
     }
-  else if (AVMATCH(&method, &av_play))
+  else if (id == RTMP_NAME_PLAY)
     {
       Flist *fl;
       AVal av;
@@ -318,7 +364,7 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
       int count = 0, flen;
 
       server->rc.m_stream_id = pack->m_nInfoField2;
-      AMFProp_GetString(AMF_GetProp(&obj, NULL, 3), &av);
+      av = in.arg;
       server->rc.Link.playpath = av;
       if (!av.av_val)
         goto out;
@@ -397,24 +443,22 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
           server->f_tail = fl;
         }
     }
-  else if (AVMATCH(&method, &av_onStatus))
+  else if (id == RTMP_NAME_ONSTATUS)
     {
-      AMFObject obj2;
-      AVal code, level;
-      AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-      AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
-
-      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
-      if (AVMATCH(&code, &av_NetStream_Failed)
-	  || AVMATCH(&code, &av_NetStream_Play_Failed)
-	  || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
-	  || AVMATCH(&code, &av_NetConnection_Connect_InvalidApp))
+      RTMP_NAME status;
+
+      RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %.*s", __FUNCTION__,
+	  in.code.av_len, in.code.av_val);
+      status = RTMP_NameLookup(&in.code);
+      if (status == RTMP_NAME_NS_FAILED
+	  || status == RTMP_NAME_NS_PLAY_FAILED
+	  || status == RTMP_NAME_NS_PLAY_STREAMNOTFOUND
+	  || status == RTMP_NAME_NC_CONNECT_INVALIDAPP)
 	{
 	  ret = 1;
 	}
 
-      if (AVMATCH(&code, &av_NetStream_Play_Start))
+      if (status == RTMP_NAME_NS_PLAY_START)
 	{
           /* set up the next stream */
           if (server->f_cur)
@@ -431,17 +475,17 @@ ServeInvoke(STREAMING_SERVER *server, int which, RTMPPacket *pack, const char *b
 	}
 
       // Return 1 if this is a Play.Complete or Play.Stop
-      if (AVMATCH(&code, &av_NetStream_Play_Complete)
-	  || AVMATCH(&code, &av_NetStream_Play_Stop))
+      if (status == RTMP_NAME_NS_PLAY_COMPLETE
+	  || status == RTMP_NAME_NS_PLAY_STOP)
 	{
 	  ret = 1;
 	}
     }
-  else if (AVMATCH(&method, &av_closeStream))
+  else if (id == RTMP_NAME_CLOSESTREAM)
     {
       ret = 1;
     }
-  else if (AVMATCH(&method, &av_close))
+  else if (id == RTMP_NAME_CLOSE)
     {
       RTMP_Close(&server->rc);
       ret = 1;
@@ -720,7 +764,7 @@ controlServerThread(void *unused)
 	case 'q':
 	  RTMP_LogPrintf("Exiting\n");
 	  stopStreaming(rtmpServer);
-          free(rtmpServer);
+	  freeStreaming(rtmpServer);
 	  exit(0);
 	  break;
 	default:
@@ -1052,8 +1096,8 @@ serverThread(void *arg)
   TFRET();
 }
 
-STREAMING_SERVER *
-startStreaming(const char *address, int port)
+static STREAMING_SERVER *
+ShardStart(const char *address, int port, int nshards)
 {
   struct sockaddr_in addr;
   int sockfd, tmp;
@@ -1070,6 +1114,25 @@ startStreaming(const char *address, int port)
   setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
 				(char *) &tmp, sizeof(tmp) );
 
+#ifdef SO_REUSEPORT
+  if (nshards > 1)
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+				(char *) &tmp, sizeof(tmp) );
+#endif
+
+#ifdef TCP_FASTOPEN
+  if (fastOpen)
+    {
+      /* accept handshake data carried in the SYN from TFO clients */
+      tmp = 16;
+      if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+				(char *) &tmp, sizeof(tmp) ) == -1)
+	RTMP_Log(GetSockError() == ENOPROTOOPT ? RTMP_LOGDEBUG : RTMP_LOGWARNING,
+	    "%s, TCP Fast Open not enabled, error %d", __FUNCTION__,
+	    GetSockError());
+    }
+#endif
+
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(address);	//htonl(INADDR_ANY);
   addr.sin_port = htons(port);
@@ -1079,6 +1142,7 @@ startStreaming(const char *address, int port)
     {
       RTMP_Log(RTMP_LOGERROR, "%s, TCP bind failed for port number: %d", __FUNCTION__,
 	  port);
+      closesocket(sockfd);
       return 0;
     }
 
@@ -1097,29 +1161,66 @@ startStreaming(const char *address, int port)
   return server;
 }
 
-void
-stopStreaming(STREAMING_SERVER * server)
+/* Start that many shards on address:port. Returns the first, the
+ * others follow on its next list.
+ */
+STREAMING_SERVER *
+startStreaming(const char *address, int port, int shards)
 {
-  assert(server);
+  STREAMING_SERVER *first = NULL, **last = &first;
+  int i;
 
-  if (server->state != STREAMING_STOPPED)
+  for (i = 0; i < shards; i++)
     {
-      int fd = server->socket;
-      server->socket = 0;
-      if (server->state == STREAMING_IN_PROGRESS)
+      if (!(*last = ShardStart(address, port, shards)))
 	{
-	  server->state = STREAMING_STOPPING;
-
-	  // wait for streaming threads to exit
-	  while (server->state != STREAMING_STOPPED)
-	    msleep(1);
+	  if (first)
+	    {
+	      stopStreaming(first);
+	      freeStreaming(first);
+	    }
+	  return 0;
 	}
+      last = &(*last)->next;
+    }
+  return first;
+}
+
+void
+stopStreaming(STREAMING_SERVER * server)
+{
+  assert(server);
 
-      if (fd && closesocket(fd))
-	RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
-	    __FUNCTION__, GetSockError());
+  for (; server; server = server->next)
+    if (server->state != STREAMING_STOPPED)
+      {
+	int fd = server->socket;
+	server->socket = 0;
+	if (server->state == STREAMING_IN_PROGRESS)
+	  {
+	    server->state = STREAMING_STOPPING;
+
+	    // wait for streaming threads to exit
+	    while (server->state != STREAMING_STOPPED)
+	      msleep(1);
+	  }
+
+	if (fd && closesocket(fd))
+	  RTMP_Log(RTMP_LOGERROR, "%s: Failed to close listening socket, error %d",
+	      __FUNCTION__, GetSockError());
+
+	server->state = STREAMING_STOPPED;
+      }
+}
 
-      server->state = STREAMING_STOPPED;
+void
+freeStreaming(STREAMING_SERVER * server)
+{
+  while (server)
+    {
+      STREAMING_SERVER *next = server->next;
+      free(server);
+      server = next;
     }
 }
 
@@ -1144,14 +1245,32 @@ main(int argc, char **argv)
 
   char *rtmpStreamingDevice = DEFAULT_RTMP_STREAMING_DEVICE;	// streaming device, default 0.0.0.0
   int nRtmpStreamingPort = 1935;	// port
+  int nShards = 1;
+  STREAMING_SERVER *server;
+  int i;
 
   RTMP_LogPrintf("RTMP Proxy Server %s\n", RTMPDUMP_VERSION);
   RTMP_LogPrintf("(c) 2010 Andrej Stepanchuk, Howard Chu; license: GPL\n\n");
 
   RTMP_debuglevel = RTMP_LOGINFO;
 
-  if (argc > 1 && !strcmp(argv[1], "-z"))
-    RTMP_debuglevel = RTMP_LOGALL;
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "-z"))
+        RTMP_debuglevel = RTMP_LOGALL;
+      else if (!strcmp(argv[i], "-F"))
+        {
+#ifdef TCP_FASTOPEN
+          fastOpen = TRUE;
+#else
+          RTMP_Log(RTMP_LOGERROR, "No TCP Fast Open here, ignoring -F");
+#endif
+        }
+      else if (!strcmp(argv[i], "-N") && i + 1 < argc)
+        {
+          nShards = ThreadShards(argv[++i]);
+        }
+    }
 
   signal(SIGINT, sigIntHandler);
 #ifndef WIN32
@@ -1170,21 +1289,24 @@ main(int argc, char **argv)
 
   // start http streaming
   if ((rtmpServer =
-       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort)) == 0)
+       startStreaming(rtmpStreamingDevice, nRtmpStreamingPort, nShards)) == 0)
     {
       RTMP_Log(RTMP_LOGERROR, "Failed to start RTMP server, exiting!");
       return RD_FAILED;
     }
   RTMP_LogPrintf("Streaming on rtmp://%s:%d\n", rtmpStreamingDevice,
 	    nRtmpStreamingPort);
+  if (nShards > 1)
+    RTMP_LogPrintf("%d shards\n", nShards);
 
-  while (rtmpServer->state != STREAMING_STOPPED)
-    {
-      sleep(1);
-    }
+  for (server = rtmpServer; server; server = server->next)
+    while (server->state != STREAMING_STOPPED)
+      {
+	sleep(1);
+      }
   RTMP_Log(RTMP_LOGDEBUG, "Done, exiting...");
 
-  free(rtmpServer);
+  freeStreaming(rtmpServer);
 
   CleanupSockets();
 
@@ -19,6 +19,8 @@
  *
  */
 
+#include <stdlib.h>
+
 #include "thread.h"
 #include "librtmp/log.h"
 
@@ -38,6 +40,9 @@ ThreadCreate(thrfunc *routine, void *args)
   return thd;
 }
 #else
+#include <unistd.h>
+#include <sys/socket.h>
+
 pthread_t
 ThreadCreate(thrfunc *routine, void *args)
 {
@@ -56,3 +61,28 @@ ThreadCreate(thrfunc *routine, void *args)
   return id;
 }
 #endif
+
+int
+ThreadShards(const char *arg)
+{
+  int n = atoi(arg);
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (n == 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1 || n > 1024)
+    {
+      RTMP_Log(RTMP_LOGERROR,
+	  "Invalid number of shards (requested %s), using 1", arg);
+      n = 1;
+    }
+#ifndef SO_REUSEPORT
+  if (n > 1)
+    {
+      RTMP_Log(RTMP_LOGERROR, "No SO_REUSEPORT here, using 1 shard");
+      n = 1;
+    }
+#endif
+  return n;
+}
@@ -28,13 +28,39 @@
 #define TFTYPE	void
 #define TFRET()
 #define THANDLE	HANDLE
+#define TMUTEX	CRITICAL_SECTION
+#define TCOND	CONDITION_VARIABLE
+#define TMutexInit(m)	InitializeCriticalSection(m)
+#define TMutexFree(m)	DeleteCriticalSection(m)
+#define TMutexLock(m)	EnterCriticalSection(m)
+#define TMutexUnlock(m)	LeaveCriticalSection(m)
+#define TCondInit(c)	InitializeConditionVariable(c)
+#define TCondFree(c)
+#define TCondWait(c,m)	SleepConditionVariableCS(c, m, INFINITE)
+#define TCondSignal(c)	WakeConditionVariable(c)
+#define TCondBroadcast(c)	WakeAllConditionVariable(c)
 #else
 #include <pthread.h>
 #define TFTYPE	void *
 #define TFRET()	return 0
 #define THANDLE pthread_t
+#define TMUTEX	pthread_mutex_t
+#define TCOND	pthread_cond_t
+#define TMutexInit(m)	pthread_mutex_init(m, NULL)
+#define TMutexFree(m)	pthread_mutex_destroy(m)
+#define TMutexLock(m)	pthread_mutex_lock(m)
+#define TMutexUnlock(m)	pthread_mutex_unlock(m)
+#define TCondInit(c)	pthread_cond_init(c, NULL)
+#define TCondFree(c)	pthread_cond_destroy(c)
+#define TCondWait(c,m)	pthread_cond_wait(c, m)
+#define TCondSignal(c)	pthread_cond_signal(c)
+#define TCondBroadcast(c)	pthread_cond_broadcast(c)
 #endif
 typedef TFTYPE (thrfunc)(void *arg);
 
 THANDLE ThreadCreate(thrfunc *routine, void *args);
+
+/* The number of server shards asked for by a -N argument: 0 means one
+ * per CPU, and without SO_REUSEPORT there is only ever one. */
+int ThreadShards(const char *arg);
 #endif /* __THREAD_H__ */